@@ -0,0 +1,132 @@
+"""Time ./pipe on multi-stage pipelines against the stages run alone.
+
+The input is a fixed-seed text file, so every run does the same work.
+For each pipeline the report shows the best wall time of ./pipe, of
+./pipe --relay, and of the same pipeline run by sh, the time of each
+stage run alone on the output of the one before it, and their sum.
+Stages that overlap finish in about the time of the slowest stage;
+stages run one after another take the sum.
+
+With --launch, it instead compares the ways ./pipe --launch can start
+programs, on pipelines of 2 to 256 stages. For each one it reports the
+time ./pipe --stats says starting `true` that many times took, the wall
+time of the whole pipeline of `true`, and the throughput of the same
+number of `cat` stages passing LAUNCH_BYTES along.
+"""
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import tempfile
+import time
+
+REPEATS = 3
+INPUT = 'bench-input.txt'
+INPUT_LINES = 2_000_000
+
+LAUNCH_METHODS = ('fork', 'vfork', 'spawn', 'clone')
+LAUNCH_STAGES = (2, 4, 16, 64, 256)
+LAUNCH_BYTES = 16 << 20
+
+PIPELINES = (
+    ('cat', 'sort', 'uniq'),
+    ('cat', 'gzip', 'gunzip', 'wc'),
+    ('cat', 'cat', 'cat', 'cat', 'wc'),
+)
+
+
+def make_input():
+    if os.path.exists(INPUT):
+        return
+    rng = random.Random(1)
+    words = [''.join(rng.choices('abcdefghijklmnopqrstuvwxyz', k=rng.randrange(3, 10)))
+             for _ in range(50000)]
+    with open(INPUT + '.partial', 'w') as f:
+        for _ in range(INPUT_LINES):
+            f.write(' '.join(rng.choices(words, k=rng.randrange(1, 8))) + '\n')
+    os.rename(INPUT + '.partial', INPUT)
+
+
+def best_time(args, stdin_path, **kwargs):
+    best = float('inf')
+    for _ in range(REPEATS):
+        with open(stdin_path, 'rb') as stdin:
+            start = time.monotonic()
+            subprocess.run(args, stdin=stdin, stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL, check=True, **kwargs)
+            best = min(best, time.monotonic() - start)
+    return best
+
+
+def stage_times(stages):
+    """Time each stage alone, fed the saved output of the one before."""
+    times = []
+    with tempfile.TemporaryDirectory() as tmp:
+        src = INPUT
+        for i, stage in enumerate(stages):
+            dst = os.path.join(tmp, f'stage{i}')
+            with open(src, 'rb') as stdin, open(dst, 'wb') as stdout:
+                start = time.monotonic()
+                subprocess.run([stage], stdin=stdin, stdout=stdout, check=True)
+                times.append(time.monotonic() - start)
+            src = dst
+    return times
+
+
+def launch_times(method, stages):
+    """Best setup and wall time of ./pipe starting STAGES `true` programs."""
+    args = ['./pipe', '--launch', method, *['true'] * stages]
+    best_setup = float('inf')
+    for _ in range(REPEATS):
+        # --stats checks on the programs every 10 ms, so the wall time is taken without it
+        result = subprocess.run([args[0], '--stats', *args[1:]], capture_output=True,
+                                text=True, check=True)
+        setup = re.search(r'^started \d+ programs in ([\d.]+) ms', result.stderr, re.M)
+        best_setup = min(best_setup, float(setup.group(1)) / 1e3)
+    return best_setup, best_time(args, '/dev/null')
+
+
+def launch_throughput(method, stages):
+    """Best MiB/s through STAGES `cat` programs."""
+    data = bytes(LAUNCH_BYTES)
+    best = float('inf')
+    for _ in range(REPEATS):
+        start = time.monotonic()
+        subprocess.run(['./pipe', '--launch', method, *['cat'] * stages], input=data,
+                       stdout=subprocess.DEVNULL, check=True)
+        best = min(best, time.monotonic() - start)
+    return LAUNCH_BYTES / (1 << 20) / best
+
+
+def bench_launch():
+    print(f'{"stages":>6} {"launch":<6} {"setup ms":>9} {"per stage":>9} '
+          f'{"wall ms":>8} {"cat MiB/s":>9}')
+    for stages in LAUNCH_STAGES:
+        for method in LAUNCH_METHODS:
+            setup, wall = launch_times(method, stages)
+            print(f'{stages:>6} {method:<6} {setup * 1e3:>9.2f} {setup * 1e6 / stages:>7.0f}us '
+                  f'{wall * 1e3:>8.2f} {launch_throughput(method, stages):>9.0f}', flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--launch', action='store_true',
+                        help='compare the ways to start programs instead')
+    if parser.parse_args().launch:
+        bench_launch()
+        return
+    make_input()
+    print(f'{"pipeline":<28} {"./pipe":>8} {"relay":>8} {"sh":>8} {"slowest":>8} {"sum":>8}')
+    for stages in PIPELINES:
+        pipe = best_time(['./pipe', *stages], INPUT)
+        relay = best_time(['./pipe', '--relay', *stages], INPUT)
+        sh = best_time(' | '.join(stages), INPUT, shell=True)
+        times = stage_times(stages)
+        print(f'{" | ".join(stages):<28} {pipe:>8.3f} {relay:>8.3f} {sh:>8.3f} '
+              f'{max(times):>8.3f} {sum(times):>8.3f}', flush=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,101 +1,1362 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
 
 // NOTE: This an implementation of the strategy explained in discussion!!!
 
-int main(int argc, char *argv[])
+// The plain pipeline, --expr and --parallel work anywhere POSIX does. --relay, --tee,
+// --pipe-size, --launch clone and how full the pipes are in --stats need Linux:
+// splice(), tee(), F_SETPIPE_SZ, clone() and /proc
+
+extern char **environ;
+
+// Most bytes moved by one splice() in relay mode
+#define RELAY_CHUNK (1 << 20)
+
+// Exit status of a program that could not be started, as in sh
+#define STATUS_NOT_STARTED 127
+
+// Input a --parallel program gets at a time, cut back to the last newline
+#define FAN_CHUNK (1 << 20)
+
+// Output a --parallel program may have waiting for its turn before we stop reading it
+#define FAN_BACKLOG (4 << 20)
+
+// Stack of a program started with --launch clone, until it calls exec
+#define CLONE_STACK (64 << 10)
+
+// How often --stats looks at how full the pipes are, in milliseconds
+#define SAMPLE_MS 10
+
+// --launch METHOD: how the programs are started, for comparing the ways to do it
+enum launch { LAUNCH_SPAWN, LAUNCH_FORK, LAUNCH_VFORK, LAUNCH_CLONE };
+static const char *const launch_names[] = {"spawn", "fork", "vfork", "clone"};
+
+// One program of the pipeline, with its arguments
+struct stage {
+	char **argv;
+	int argc;
+	pid_t pid;      // 0 if it could not be started
+	int replicas;   // --parallel: copies of it to run at once, 0 for just the one
+	int in;         // Where its input comes from and its output goes, -1 for ours
+	int out;
+	int reaped;     // Whether STATUS and USAGE are set yet
+	int status;
+	struct rusage usage;
+};
+
+// --tee N=FILE: a copy of everything program N writes goes into FILE
+struct tap {
+	int stage;      // Index of the program, counting from 0
+	int fd;         // FILE
+	int pipe[2];    // tee() copies into this pipe, which is then spliced into FILE
+};
+
+// With --relay, program i writes into a pipe the parent reads from, and the parent
+// splices what it reads into the pipe program i + 1 reads from. The bytes stay in the
+// kernel's pipe buffers the whole way, but the parent sees how many go by and can
+// tee() them to other places too
+struct link {
+	int src;          // Read end of the pipe program i writes into
+	int dst;          // Write end of the pipe program i + 1 reads from
+	int blocked;      // DST was full last time
+	size_t teed;      // Bytes at the head of SRC already copied to the taps
+	long long bytes;  // Bytes moved so far
+	struct tap **taps;
+	int ntaps;
+	// --pipe-size and --stats
+	int want_size;    // Bytes asked for with --pipe-size, 0 for the default
+	int size;         // Bytes the pipe (both pipes with --relay) can hold
+	ino_t ino;        // Without --relay: the pipe, for --stats to find it again
+	long long samples;
+	long long full;   // Samples where the writer could not write a page more
+	long long empty;  // Samples where the reader had nothing to read
+	double fill;      // Sum of how full the pipe was, as a fraction, over all samples
+};
+
+// --pipe-size [N=]SIZE: the pipe program N writes into holds SIZE bytes
+struct pipe_size {
+	int stage;      // Index of the program, counting from 0, or -1 for every pipe
+	int size;
+};
+
+// Wait for STAGE to finish unless it already has, or with WNOHANG in FLAGS only look.
+// Return 1 once it has finished, 0 if it is still running and -1 on an error
+int reap(struct stage *stage, int flags)
 {
-	// 0 Arguments: exit early
-	if (argc <= 1) {
-		errno = EINVAL;
-		perror("ERROR: No arguments provided");
+	if (stage->pid == 0 || stage->reaped)
+		return 1;
+	pid_t pid;
+	while ((pid = wait4(stage->pid, &stage->status, flags, &stage->usage)) == -1) {
+		if (errno != EINTR)
+			return -1;
+	}
+	if (pid == 0)
+		return 0;
+	stage->reaped = 1;
+	return 1;
+}
+
+// Wait for every program of the pipeline and return its exit status: that of
+// the last program to fail (like bash's "set -o pipefail"), 128 + the signal
+// number for a program killed by a signal, or 0 if all succeeded. A program
+// killed by SIGPIPE before the last one did not fail: the program it wrote to
+// just stopped reading, like head does
+int reap_children(struct stage *stages, int nstages)
+{
+	int ret = 0;
+	for (int i = 0; i < nstages; i++) {
+		if (stages[i].pid == 0) {
+			ret = STATUS_NOT_STARTED;
+			continue;
+		}
+		if (reap(&stages[i], 0) == -1) {
+			perror("ERROR: Failed to wait for child process");
+			return errno;
+		}
+		int status = stages[i].status;
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+			ret = WEXITSTATUS(status);
+		else if (WIFSIGNALED(status) && (WTERMSIG(status) != SIGPIPE || i == nstages - 1))
+			ret = 128 + WTERMSIG(status);
+	}
+	return ret;
+}
+
+// Append WORD to the arguments of STAGE
+void add_word(struct stage *stage, char *word)
+{
+	stage->argv = realloc(stage->argv, (stage->argc + 2) * sizeof(*stage->argv));
+	if (stage->argv == NULL) {
+		perror("ERROR: Out of memory");
 		exit(errno);
 	}
+	stage->argv[stage->argc++] = word;
+	stage->argv[stage->argc] = NULL;
+}
 
-	// 1 Argument: execute normally (avoid making unnecessary pipe)
-	if (argc == 2) {
-		if (execlp(argv[1], argv[1], NULL) == -1) {
-			perror("ERROR: Failed to execute the single program inputted.");
-			exit(errno);
+// Split the pipeline EXPR into programs at each unquoted '|', and each program into
+// words at unquoted blanks, the way sh would but without expanding anything.
+// Everything in '...' is kept as is, in "..." all but a backslash before " or \, and
+// outside quotes a backslash keeps the next character as is. Store the programs in
+// *STAGES and return how many there are, or -1 after reporting an error
+int parse_pipeline(const char *expr, struct stage **stages)
+{
+	// The words take no more room than EXPR, as each one ends where a blank, '|', a
+	// closing quote or the end of EXPR was
+	char *buf = malloc(strlen(expr) + 1);
+	*stages = calloc(1, sizeof(**stages));
+	if (buf == NULL || *stages == NULL) {
+		perror("ERROR: Out of memory");
+		exit(errno);
+	}
+	int nstages = 1;
+	char *out = buf;
+	char *word = NULL;
+	for (const char *p = expr; ; p++) {
+		struct stage *stage = &(*stages)[nstages - 1];
+		if (*p == '\0' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '|') {
+			if (word != NULL) {
+				*out++ = '\0';
+				add_word(stage, word);
+				word = NULL;
+			}
+			if ((*p == '|' || *p == '\0') && stage->argc == 0) {
+				fprintf(stderr, "ERROR: Empty program in pipeline: %s\n", expr);
+				return -1;
+			}
+			if (*p == '\0')
+				break;
+			if (*p == '|') {
+				*stages = realloc(*stages, (nstages + 1) * sizeof(**stages));
+				if (*stages == NULL) {
+					perror("ERROR: Out of memory");
+					exit(errno);
+				}
+				memset(&(*stages)[nstages++], 0, sizeof(**stages));
+			}
+			continue;
+		}
+
+		if (word == NULL)
+			word = out;
+		if (*p == '\'' || *p == '"') {
+			char quote = *p++;
+			while (*p != quote && *p != '\0') {
+				if (quote == '"' && *p == '\\' && (p[1] == '"' || p[1] == '\\'))
+					p++;
+				*out++ = *p++;
+			}
+			if (*p == '\0') {
+				fprintf(stderr, "ERROR: Unterminated %c in pipeline: %s\n", quote, expr);
+				return -1;
+			}
+		} else if (*p == '\\' && p[1] != '\0') {
+			*out++ = *++p;
+		} else {
+			*out++ = *p;
 		}
+	}
+	return nstages;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [OPTION]... PROGRAM...\n"
+	        "       %s [OPTION]... --expr 'PROGRAM [ARG]... | ...'\n"
+	        "  --expr EXPR            run the pipeline EXPR, whose programs take arguments;\n"
+	        "                         quote them with '...', \"...\" or \\ as in sh\n"
+	        "  --launch METHOD        start the programs with spawn (posix_spawnp(), the\n"
+	        "                         default), fork, vfork or clone (clone(CLONE_VM |\n"
+	        "                         CLONE_VFORK))\n"
+	        "  --parallel N=K         run program N (from 1) as K copies, handing each a\n"
+	        "                         chunk of input in turn, cut at a newline; with the\n"
+	        "                         output in order, each chunk gets its own run\n"
+	        "  --pipe-size [N=]SIZE   make the pipe program N (from 1) writes into, or every\n"
+	        "                         pipe, hold SIZE bytes; SIZE may end in K or M\n"
+	        "  --relay                move the data between programs through this process\n"
+	        "                         with splice() and report how many bytes each wrote\n"
+	        "  --stats                report the CPU time of each program and how full each\n"
+	        "                         pipe was, to show which program held the others up\n"
+	        "  --tee N=FILE           also copy what program N (from 1) writes into FILE;\n"
+	        "                         implies --relay\n"
+	        "  --unordered            let the output of --parallel copies go out as it\n"
+	        "                         comes, a line at a time, instead of in order\n", prog, prog);
+	exit(EINVAL);
+}
+
+// Parse the SIZE of --pipe-size: bytes, or KiB or MiB with a K or M after it. Return
+// -1 if it is not a size
+int parse_size(const char *arg)
+{
+	char *end;
+	long size = strtol(arg, &end, 10);
+	long unit = 1;
+	if (*end == 'K' || *end == 'k')
+		unit = 1 << 10;
+	else if (*end == 'M' || *end == 'm')
+		unit = 1 << 20;
+	if (unit > 1)
+		end++;
+	if (end == arg || *end != '\0' || size < 1 || size > INT_MAX / unit)
+		return -1;
+	return size * unit;
+}
+
+// Make the pipe FD is an end of hold SIZE bytes, if SIZE is not 0, and return how much
+// it holds. The kernel rounds SIZE up to a power of two pages, and without
+// CAP_SYS_RESOURCE it cannot go over /proc/sys/fs/pipe-max-size; if the size cannot be
+// set, the pipe keeps the one it had
+int set_pipe_size(int fd, int size)
+{
+#ifdef __linux__
+	if (size != 0 && fcntl(fd, F_SETPIPE_SZ, size) == -1)
+		fprintf(stderr, "ERROR: Failed to make a pipe hold %d bytes: %s\n", size, strerror(errno));
+	return fcntl(fd, F_GETPIPE_SZ);
+#else
+	// There is no asking elsewhere, and --pipe-size is refused
+	(void) fd;
+	(void) size;
+	return 0;
+#endif
+}
+
+// Create a pipe whose ends are closed on exec, with pipe2() where there is one. Elsewhere
+// the flag is set after the fact, which only races with other threads, and we have none
+int cloexec_pipe(int fds[2])
+{
+#ifdef __linux__
+	return pipe2(fds, O_CLOEXEC);
+#else
+	if (pipe(fds) == -1)
+		return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+#endif
+}
+
+// Exit with an error for OPTION, which needs what only Linux has
+void needs_linux(const char *option)
+{
+	fprintf(stderr, "ERROR: %s needs Linux\n", option);
+	exit(ENOSYS);
+}
+
+// Return the last newline in the N bytes at BUF, or NULL if there is none. memrchr() would
+// do, but it is a GNU extension
+char *last_newline(char *buf, size_t n)
+{
+	while (n > 0) {
+		if (buf[--n] == '\n')
+			return buf + n;
+	}
+	return NULL;
+}
+
+// Seconds on a clock that only goes forward
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef __linux__
+// --stats without --relay: open the pipe INO that STAGE reads from through its
+// /proc/PID/fd/0, or return -1 if that is no longer its input. We hold the read end only
+// while we sample, so that once the reader is gone its writer gets SIGPIPE as usual
+int open_input(const struct stage *stage, ino_t ino)
+{
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/%d/fd/0", (int) stage->pid);
+	// Without O_NONBLOCK, opening a pipe nobody writes into waits for a writer
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	struct stat st;
+	if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode) || st.st_ino != ino)) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+// --stats: reap the programs that have finished, then record how full each pipe between
+// two programs that are both still running is. Return how many programs still run
+int sample(struct stage *stages, int nstages, struct link *links)
+{
+	int running = 0;
+	int *alive = malloc(nstages * sizeof(*alive));
+	if (alive == NULL)
 		return 0;
+	for (int i = 0; i < nstages; i++) {
+		alive[i] = reap(&stages[i], WNOHANG) == 0;
+		running += alive[i];
 	}
 
-	// 2+ Arguments (pipe time!)
-	if (argc >= 3) {
-		// Multiple pipes to handle more than two arguments (more space efficient than a different pipe for every program)
-		int curr_pipe[2];
-		int prev_pipe[2];
+	// A pipe is only sampled while both its programs run: once the writer is done, an
+	// empty pipe does not mean the reader is waiting for it
+	for (int i = 0; i < nstages - 1; i++) {
+		struct link *link = &links[i];
+		if (!alive[i] || !alive[i + 1] || link->size <= 0)
+			continue;
+		int fd = link->src != -1 ? link->src : open_input(&stages[i + 1], link->ino);
+		if (fd == -1)
+			continue;
+		int queued = 0;
+		int relayed = 0;
+		ioctl(fd, FIONREAD, &queued);
+		if (link->src == -1)
+			close(fd);
+		if (link->dst != -1)
+			ioctl(link->dst, FIONREAD, &relayed);
+		queued += relayed;
+		link->samples++;
+		link->fill += (double) queued / link->size;
+		// Pipes fill a page at a time, so a writer blocks with less than a page free
+		if (queued > link->size - PIPE_BUF)
+			link->full++;
+		else if (queued == 0)
+			link->empty++;
+	}
+	free(alive);
+	return running;
+}
 
-		for (int i = 1; i < argc; i++) {
-			// Last argument = do not create a pipe
-			if (i < argc - 1)
-				pipe(curr_pipe);
+// --stats without --relay: sample the pipes until every program has finished
+void monitor(struct stage *stages, int nstages, struct link *links)
+{
+	while (sample(stages, nstages, links) > 0)
+		poll(NULL, 0, SAMPLE_MS);
+}
+#endif
 
-			// Create child process
-			int pid = fork();
+double cpu_time(const struct rusage *usage)
+{
+	return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6
+	       + usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
 
-			if (pid < 0) {
-				perror("ERROR: Fork failed!");
-				exit(errno);
-			}
+// --stats: print each program's CPU time, how full each pipe was and what that says
+// about who held up whom. A pipe that is full most of the time stalled the program
+// writing into it, so the reader is the slower one; one that is empty most of the
+// time starved the reader, so the writer is the slower one
+void print_stats(struct stage *stages, int nstages, struct link *links, double wall)
+{
+	fprintf(stderr, "%-20s %8s %8s\n", "program", "user s", "sys s");
+	int slowest = -1;
+	for (int i = 0; i < nstages; i++) {
+		if (stages[i].pid == 0) {
+			fprintf(stderr, "%2d %-17.17s not started\n", i + 1, stages[i].argv[0]);
+			continue;
+		}
+		const struct rusage *usage = &stages[i].usage;
+		fprintf(stderr, "%2d %-17.17s %8.3f %8.3f\n", i + 1, stages[i].argv[0],
+		        usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+		        usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6);
+		if (slowest == -1 || cpu_time(usage) > cpu_time(&stages[slowest].usage))
+			slowest = i;
+	}
 
-			// Child process
-			if (pid == 0) {
-				// Not the first program - redirect the input from previous
-				if (i > 1) {
-					dup2(prev_pipe[0], 0);
-					close(prev_pipe[0]);
-				}
+	fprintf(stderr, "%-8s %8s %8s %8s %6s %6s\n", "pipe", "size", "samples", "average",
+	        "full", "empty");
+	for (int i = 0; i < nstages - 1; i++) {
+		struct link *link = &links[i];
+		fprintf(stderr, "%2d -> %-2d", i + 1, i + 2);
+		if (link->size > 0)
+			fprintf(stderr, " %8d %8lld", link->size, link->samples);
+		else
+			fprintf(stderr, " %8s %8lld", "-", link->samples);
+		if (link->samples == 0) {
+			fprintf(stderr, " %8s %6s %6s\n", "-", "-", "-");
+			continue;
+		}
+		double full = (double) link->full / link->samples;
+		double empty = (double) link->empty / link->samples;
+		fprintf(stderr, " %7.0f%% %5.0f%% %5.0f%%", 100 * link->fill / link->samples,
+		        100 * full, 100 * empty);
+		if (full >= 0.5)
+			fprintf(stderr, "  %s stalled %s", stages[i + 1].argv[0], stages[i].argv[0]);
+		else if (empty >= 0.5)
+			fprintf(stderr, "  %s starved %s", stages[i].argv[0], stages[i + 1].argv[0]);
+		fputc('\n', stderr);
+	}
+
+	if (slowest != -1)
+		fprintf(stderr, "%.3f s in all; most CPU time: %s, %.3f s\n", wall,
+		        stages[slowest].argv[0], cpu_time(&stages[slowest].usage));
+}
+
+#ifdef __linux__
+void close_link(struct link *link)
+{
+	close(link->src);
+	close(link->dst);
+	link->src = -1;
+	link->dst = -1;
+}
+
+// Splice all N bytes waiting in the tap's pipe into its file
+int drain_tap(struct tap *tap, size_t n)
+{
+	while (n > 0) {
+		ssize_t moved = splice(tap->pipe[0], NULL, tap->fd, NULL, n, SPLICE_F_MOVE);
+		if (moved <= 0)
+			return -1;
+		n -= moved;
+	}
+	return 0;
+}
 
-				// Not the last program - redirect the output into curr
-				if (i < argc - 1) {
-					dup2(curr_pipe[1], 1);
-					close(curr_pipe[1]);
+// Move what is waiting in LINK's source pipe on, until one side would block. Return
+// -1 on an error, after which the link is closed
+int relay_link(struct link *link)
+{
+	for (;;) {
+		// Copy the next bytes to every tap before they are moved on, since tee() always
+		// copies from the head of the pipe
+		if (link->ntaps > 0 && link->teed == 0) {
+			ssize_t n = tee(link->src, link->taps[0]->pipe[1], RELAY_CHUNK, SPLICE_F_NONBLOCK);
+			if (n == -1 && errno == EAGAIN)
+				return 0;
+			if (n == -1) {
+				perror("ERROR: tee failed");
+				close_link(link);
+				return -1;
+			}
+			if (n == 0) {
+				close_link(link);
+				return 0;
+			}
+			// The tap pipes are empty, so each one takes the same N bytes the first did
+			for (int t = 1; t < link->ntaps; t++) {
+				if (tee(link->src, link->taps[t]->pipe[1], n, 0) != n) {
+					perror("ERROR: tee failed");
+					close_link(link);
+					return -1;
+				}
+			}
+			for (int t = 0; t < link->ntaps; t++) {
+				if (drain_tap(link->taps[t], n) == -1) {
+					perror("ERROR: Failed to write --tee file");
+					close_link(link);
+					return -1;
 				}
+			}
+			link->teed = n;
+		}
+
+		size_t len = link->ntaps > 0 ? link->teed : RELAY_CHUNK;
+		ssize_t n = splice(link->src, NULL, link->dst, NULL, len,
+		                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			link->bytes += n;
+			if (link->ntaps > 0)
+				link->teed -= n;
+			link->blocked = 0;
+			continue;
+		}
+		if (n == 0) {
+			// End of file: pass it on to the next program
+			close_link(link);
+			return 0;
+		}
+		if (errno == EAGAIN) {
+			// Either nothing is waiting or the next program's pipe is full
+			int waiting = 0;
+			ioctl(link->src, FIONREAD, &waiting);
+			link->blocked = waiting > 0;
+			return 0;
+		}
+		if (errno == EPIPE) {
+			// The next program is gone. Closing the source gives the writer SIGPIPE, as it
+			// would get writing to it directly
+			close_link(link);
+			return 0;
+		}
+		perror("ERROR: splice failed");
+		close_link(link);
+		return -1;
+	}
+}
+
+// Relay between the programs until every link has seen end of file. With STATS, also
+// sample the pipes every SAMPLE_MS
+int relay(struct stage *stages, struct link *links, int nlinks, int stats)
+{
+	int err = 0;
+	struct pollfd *fds = malloc(nlinks * sizeof(*fds));
+	if (fds == NULL) {
+		perror("ERROR: Out of memory");
+		return errno;
+	}
+	// A program that exits early must not kill us with SIGPIPE; we see EPIPE instead
+	signal(SIGPIPE, SIG_IGN);
+	for (int i = 0; i < nlinks; i++) {
+		fcntl(links[i].src, F_SETFL, O_NONBLOCK);
+		fcntl(links[i].dst, F_SETFL, O_NONBLOCK);
+	}
+
+	double next_sample = now();
+	for (;;) {
+		if (stats && now() >= next_sample) {
+			sample(stages, nlinks + 1, links);
+			next_sample = now() + SAMPLE_MS / 1e3;
+		}
+		int nfds = 0;
+		for (int i = 0; i < nlinks; i++) {
+			if (links[i].src == -1)
+				continue;
+			fds[nfds].fd = links[i].blocked ? links[i].dst : links[i].src;
+			fds[nfds].events = links[i].blocked ? POLLOUT : POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+		if (nfds == 0)
+			break;
+		if (poll(fds, nfds, stats ? SAMPLE_MS : -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			perror("ERROR: poll failed");
+			break;
+		}
+		for (int i = 0, f = 0; i < nlinks; i++) {
+			if (links[i].src == -1)
+				continue;
+			if (fds[f++].revents && relay_link(&links[i]) == -1)
+				err = EIO;
+		}
+	}
 
-				// Cleanup - after establishing previous fd modifications, we don't need these anymore
-				close(curr_pipe[0]);
-				close(curr_pipe[1]);
+	free(fds);
+	for (int i = 0; i < nlinks; i++) {
+		if (links[i].src != -1)
+			close_link(&links[i]);
+	}
+	return err;
+}
+#endif
 
-				if (execlp(argv[i], argv[i], NULL) == -1) {
-					perror("ERROR: Failed to execute program from within child process");
+// --parallel N=K: program N runs as K replicas. A process of its own splits the input
+// into chunks of about FAN_CHUNK bytes at newlines and hands them to the replicas in
+// turn, then merges what they write. What is left at end of file, which is all of a
+// short input, is shared out among the replicas free to take it. Unordered, each
+// replica runs for the whole input and its output goes out a whole line at a time, as
+// soon as it comes. In order, each chunk gets a run of the program of its own, since
+// only the end of a run tells where the output for its chunk ends. The K replicas take
+// the chunks in turn, one run at a time, and the output of each run goes out only after
+// that of the chunk before it. Until then we hold at most FAN_BACKLOG bytes of it and
+// then stop reading, so a run that is ahead waits for the others
+struct replica {
+	pid_t pid;        // 0 if none is running
+	int in;           // Write end of its input pipe, -1 once closed
+	int out;          // Read end of its output pipe, -1 at end of file
+	char *todo;       // Chunk of input still to write into IN, from TODO_OFF on
+	size_t todo_len;
+	size_t todo_off;
+	char *buf;        // Output read from OUT but not written out yet
+	size_t len;
+	size_t cap;
+	int ahead;        // In order: started before it has a chunk, so it may get none
+};
+
+// Start a replica of STAGE reading from and writing into pipes to this process. Return
+// -1 after reporting an error
+int start_replica(struct stage *stage, struct replica *r)
+{
+	int in[2], out[2];
+	if (cloexec_pipe(in) == -1) {
+		perror("ERROR: Failed to create pipe");
+		return -1;
+	}
+	if (cloexec_pipe(out) == -1) {
+		perror("ERROR: Failed to create pipe");
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+	posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+	// We ignore SIGPIPE, but the replica should die of it like any other program
+	posix_spawnattr_t attr;
+	sigset_t sigpipe;
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigpipe);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+	int err = posix_spawnp(&r->pid, stage->argv[0], &actions, &attr, stage->argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(in[0]);
+	close(out[1]);
+	if (err != 0) {
+		fprintf(stderr, "ERROR: Failed to execute %s: %s\n", stage->argv[0], strerror(err));
+		r->pid = 0;
+		close(in[1]);
+		close(out[0]);
+		return -1;
+	}
+	// A replica that is slow to read must not hold up the others
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	r->in = in[1];
+	r->out = out[0];
+	return 0;
+}
+
+// Wait for the replica R, which has closed its output, and fold its exit status into
+// *RET the way reap_children() does
+void finish_replica(struct replica *r, int *ret)
+{
+	if (r->in != -1)
+		close(r->in);
+	if (r->out != -1)
+		close(r->out);
+	free(r->todo);
+	r->in = -1;
+	r->out = -1;
+	r->todo = NULL;
+	int status;
+	while (waitpid(r->pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			perror("ERROR: Failed to wait for child process");
+			*ret = errno;
+			r->pid = 0;
+			return;
+		}
+	}
+	if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+		*ret = WEXITSTATUS(status);
+	else if (WIFSIGNALED(status))
+		*ret = 128 + WTERMSIG(status);
+	r->pid = 0;
+}
+
+// Write all N bytes of DATA to standard output. Return -1 on an error
+int write_out(const char *data, size_t n)
+{
+	while (n > 0) {
+		ssize_t written = write(1, data, n);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written == -1)
+			return -1;
+		data += written;
+		n -= written;
+	}
+	return 0;
+}
+
+// Write out what R has written so far: all of it if ALL, else up to its last newline
+// until it is done, so lines of different replicas do not mix. Return -1 on an error
+int emit(struct replica *r, int all)
+{
+	size_t n = r->len;
+	if (!all && r->out != -1) {
+		char *newline = last_newline(r->buf, r->len);
+		n = newline ? newline - r->buf + 1 : 0;
+	}
+	if (n == 0)
+		return 0;
+	if (write_out(r->buf, n) == -1)
+		return -1;
+	memmove(r->buf, r->buf + n, r->len - n);
+	r->len -= n;
+	return 0;
+}
+
+// Run the --parallel program STAGE on standard input, into standard output, and return
+// the exit status for the whole of it: that of the last replica to fail, if any did
+int fan(struct stage *stage, int unordered)
+{
+	int n = stage->replicas;
+	struct replica *replicas = calloc(n, sizeof(*replicas));
+	struct pollfd *fds = malloc((2 * n + 1) * sizeof(*fds));
+	size_t in_cap = FAN_CHUNK;
+	size_t in_len = 0;
+	char *in = malloc(in_cap);
+	if (replicas == NULL || fds == NULL || in == NULL) {
+		perror("ERROR: Out of memory");
+		return errno;
+	}
+	// A replica that exits early must not kill us with SIGPIPE; we see EPIPE instead
+	signal(SIGPIPE, SIG_IGN);
+
+	int ret = 0;
+	int err = 0;
+	for (int i = 0; i < n; i++) {
+		replicas[i].in = -1;
+		replicas[i].out = -1;
+	}
+	for (int i = 0; i < n && unordered && err == 0; i++) {
+		if (start_replica(stage, &replicas[i]) == -1)
+			err = STATUS_NOT_STARTED;
+	}
+	// In order, the first run starts at once rather than with the first chunk, like the
+	// program would on its own: one that does not read its input, like yes, need not
+	// wait for any, and without input at all it still runs once on none
+	if (!unordered) {
+		if (start_replica(stage, &replicas[0]) == -1)
+			err = STATUS_NOT_STARTED;
+		replicas[0].ahead = 1;
+	}
+	int eof = 0;
+	int next_in = 0;    // Replica the next chunk goes to, if it can take it
+	int next_out = 0;   // In order: replica whose output goes out next
+	while (err == 0) {
+		// Once the buffer is full, cut a chunk at its last newline for the next replica.
+		// Unordered, that is the next one that has written all it was given; in order,
+		// chunks go strictly in turn, and the replica must have finished its last one
+		struct replica *target = NULL;
+		int idle = 0;
+		for (int i = 0; i < n; i++) {
+			struct replica *r = &replicas[(next_in + i) % n];
+			if (unordered ? r->in != -1 && r->todo == NULL : r->pid == 0 || r->ahead) {
+				idle++;
+				if (target == NULL && (unordered || i == 0))
+					target = r;
+			}
+		}
+		if (in_len > 0 && (eof || in_len == in_cap)) {
+			char *newline = last_newline(in, in_len);
+			size_t cut = newline ? newline - in + 1 : 0;
+			if (eof) {
+				// Give each idle replica its share, up to the end of a line
+				size_t share = (in_len + idle - 1) / (idle > 0 ? idle : 1);
+				newline = memchr(in + share - 1, '\n', in_len - share + 1);
+				cut = newline ? newline - in + 1 : in_len;
+			}
+			if (cut == 0) {
+				// A line longer than the buffer: make room for the rest of it
+				in_cap *= 2;
+				in = realloc(in, in_cap);
+				if (in == NULL) {
+					perror("ERROR: Out of memory");
 					exit(errno);
 				}
-				
-				return 0;
-			} else { // Parent process
-				// Wait for child process to finish executing
-				int status;
-				wait(&status);
-				if (WEXITSTATUS(status) != 0) {
-					// This should handle if dup2 or close give an error...
-					perror("ERROR: Failed executing a child process, most likely related to the pipe!");
-					return WEXITSTATUS(status);
+			} else if (target != NULL) {
+				if (!unordered && !target->ahead && start_replica(stage, target) == -1) {
+					err = STATUS_NOT_STARTED;
+					break;
 				}
+				target->ahead = 0;
+				char *rest = malloc(in_cap);
+				if (rest == NULL) {
+					perror("ERROR: Out of memory");
+					exit(errno);
+				}
+				memcpy(rest, in + cut, in_len - cut);
+				target->todo = in;
+				target->todo_len = cut;
+				target->todo_off = 0;
+				in = rest;
+				in_len -= cut;
+				next_in = (target - replicas + 1) % n;
+				continue;
+			}
+		}
 
-				// The write fd is unnecessary; we only need the read if we have another pipe
-				// The read fd can stay open! Writing acts like a stream so we must close it else the program will hang
-				close(curr_pipe[1]);
-
-				// Not the last program - store old pipe to make space for new pipe
-				if (i < (argc - 1)) {
-					prev_pipe[0] = curr_pipe[0];
-					prev_pipe[1] = curr_pipe[1];
-				} else {
-					// Last program, close all pipes for cleanup just in case...
-					close(prev_pipe[0]);
-					close(prev_pipe[1]);
-					close(curr_pipe[0]);
-					close(curr_pipe[1]);
+		// A replica's input ends after its one chunk in order, or after the last chunk
+		// unordered. A run started ahead of its chunk waits for one until the input ends
+		int alive = 0;
+		for (int i = 0; i < n; i++) {
+			struct replica *r = &replicas[i];
+			int last = eof && in_len == 0;
+			if (r->in != -1 && r->todo == NULL && (unordered || r->ahead ? last : 1)) {
+				close(r->in);
+				r->in = -1;
+				r->ahead = 0;
+			}
+			alive += r->in != -1;
+		}
+		if (unordered && alive == 0 && !eof) {
+			// Every replica stopped reading, so we do too
+			close(0);
+			eof = 1;
+			in_len = 0;
+		}
+
+		int nfds = 0;
+		int done = eof && in_len == 0;
+		if (!eof && in_len < in_cap)
+			fds[nfds++] = (struct pollfd) {0, POLLIN, 0};
+		for (int i = 0; i < n; i++) {
+			struct replica *r = &replicas[i];
+			done &= r->pid == 0;
+			if (r->todo != NULL)
+				fds[nfds++] = (struct pollfd) {r->in, POLLOUT, 0};
+			// In order, output that is not due yet piles up only so far; poll() skips
+			// the replica while its fd is negative, and it blocks writing
+			int backlogged = !unordered && r != &replicas[next_out] && r->len >= FAN_BACKLOG;
+			if (r->out != -1)
+				fds[nfds++] = (struct pollfd) {backlogged ? -1 : r->out, POLLIN, 0};
+		}
+		if (done)
+			break;
+		if (poll(fds, nfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			perror("ERROR: poll failed");
+			break;
+		}
+
+		// Go through FDS in the order it was filled in
+		int f = 0;
+		if (!eof && in_len < in_cap && fds[f++].revents) {
+			ssize_t got = read(0, in + in_len, in_cap - in_len);
+			if (got == -1 && errno != EINTR) {
+				err = errno;
+				perror("ERROR: Failed to read input");
+				break;
+			}
+			if (got == 0)
+				eof = 1;
+			if (got > 0)
+				in_len += got;
+		}
+		for (int i = 0; i < n; i++) {
+			struct replica *r = &replicas[i];
+			if (r->todo != NULL && fds[f++].revents) {
+				ssize_t written = write(r->in, r->todo + r->todo_off, r->todo_len - r->todo_off);
+				if (written > 0)
+					r->todo_off += written;
+				// Once it is all written, or the replica stopped reading, the chunk is done
+				if ((written == -1 && errno != EINTR && errno != EAGAIN)
+				    || r->todo_off == r->todo_len) {
+					free(r->todo);
+					r->todo = NULL;
+					if (written == -1) {
+						close(r->in);
+						r->in = -1;
+					}
+				}
+			}
+			if (r->out != -1 && fds[f++].revents) {
+				if (r->len + PIPE_BUF > r->cap) {
+					r->cap = r->cap ? 2 * r->cap : FAN_CHUNK;
+					r->buf = realloc(r->buf, r->cap);
+					if (r->buf == NULL) {
+						perror("ERROR: Out of memory");
+						exit(errno);
+					}
+				}
+				ssize_t got = read(r->out, r->buf + r->len, r->cap - r->len);
+				if (got > 0) {
+					r->len += got;
+				} else if (got == 0 || errno != EINTR) {
+					close(r->out);
+					r->out = -1;
 				}
 			}
 		}
+
+		// Write out what may go out now: unordered, the whole lines of every replica; in
+		// order, all of the output of the replica whose turn it is, and once it is done,
+		// that of the next one
+		for (int i = 0; i < n; i++) {
+			struct replica *r = &replicas[unordered ? i : next_out];
+			if (emit(r, !unordered) == -1) {
+				err = errno;
+				if (err != EPIPE)
+					perror("ERROR: Failed to write output");
+				break;
+			}
+			if (r->pid != 0 && r->out == -1 && r->len == 0) {
+				finish_replica(r, &ret);
+				next_out = (next_out + 1) % n;
+			} else if (!unordered) {
+				break;
+			}
+		}
 	}
 
+	// After an error, the replicas get end of file on their input and EPIPE on their
+	// output, so they all finish
+	for (int i = 0; i < n; i++) {
+		if (replicas[i].pid != 0)
+			finish_replica(&replicas[i], &ret);
+	}
+	if (err == EPIPE) {
+		// The next program stopped reading: go the way we would have had we written to
+		// it directly, which reap_children() does not count as failing
+		signal(SIGPIPE, SIG_DFL);
+		raise(SIGPIPE);
+	}
+	return err ? err : ret;
+}
+
+// Start a process that runs the --parallel program STAGE from IN into OUT, either of
+// which may be -1 to keep our own. Return 0 or an errno value
+int start_fan(struct stage *stage, int in, int out, int unordered)
+{
+	pid_t pid = fork();
+	if (pid == -1)
+		return errno;
+	if (pid == 0) {
+		if ((in != -1 && dup2(in, 0) == -1) || (out != -1 && dup2(out, 1) == -1)) {
+			perror("ERROR: dup2 failed");
+			_exit(errno);
+		}
+		// Close-on-exec does not help here, as this process does not exec: drop every
+		// other pipe of the pipeline, or their readers would never see end of file
+#ifdef __linux__
+		close_range(3, ~0U, 0);
+#else
+		for (long fd = 3, max = sysconf(_SC_OPEN_MAX); fd < max; fd++)
+			close(fd);
+#endif
+		_exit(fan(stage, unordered));
+	}
+	stage->pid = pid;
 	return 0;
 }
+
+// In the child: move STAGE's pipe ends into place and exec it. After vfork() or
+// clone(CLONE_VM) the child runs in our memory, so nothing here may touch the heap or
+// stdio, and the error goes out with write()
+int exec_stage(void *arg)
+{
+	struct stage *stage = arg;
+	if ((stage->in == -1 || dup2(stage->in, 0) != -1)
+	    && (stage->out == -1 || dup2(stage->out, 1) != -1))
+		execvp(stage->argv[0], stage->argv);
+	static const char msg[] = "ERROR: Failed to execute ";
+	write(2, msg, sizeof(msg) - 1);
+	write(2, stage->argv[0], strlen(stage->argv[0]));
+	write(2, "\n", 1);
+	_exit(STATUS_NOT_STARTED);
+}
+
+// Start STAGE with METHOD, reading from IN and writing into OUT, either of which may be
+// -1 to keep ours. Return 0 or an errno value. With posix_spawnp() a program that cannot
+// be run is found out here; the others only learn of it from its exit status, 127:
+//  - spawn: posix_spawnp(), which glibc implements with clone(CLONE_VM | CLONE_VFORK).
+//    The child shares our memory until it execs, and we wait for that
+//  - fork: fork() then execvp(). The child gets a copy of our page tables, so it
+//    costs more the more memory we have
+//  - vfork: vfork() then execvp(). Like spawn, but without posix_spawnp()'s care:
+//    signal handlers of ours could run in the child
+//  - clone: clone(CLONE_VM | CLONE_VFORK) on a stack of its own, then execvp(). Like
+//    vfork, but the child does not run on our stack. We wait for the exec: the child
+//    shares our memory, errno included, so we must not run alongside it
+int launch(struct stage *stage, int in, int out, enum launch method)
+{
+	stage->in = in;
+	stage->out = out;
+	switch (method) {
+	case LAUNCH_SPAWN: {
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		if (in != -1)
+			posix_spawn_file_actions_adddup2(&actions, in, 0);
+		if (out != -1)
+			posix_spawn_file_actions_adddup2(&actions, out, 1);
+		int err = posix_spawnp(&stage->pid, stage->argv[0], &actions, NULL, stage->argv,
+		                       environ);
+		posix_spawn_file_actions_destroy(&actions);
+		return err;
+	}
+	case LAUNCH_FORK:
+		stage->pid = fork();
+		if (stage->pid == 0)
+			exec_stage(stage);
+		break;
+	case LAUNCH_VFORK:
+		stage->pid = vfork();
+		if (stage->pid == 0)
+			exec_stage(stage);
+		break;
+	case LAUNCH_CLONE: {
+#ifdef __linux__
+		// We are suspended until the child has exec'd, so one stack does for them all
+		static char stack[CLONE_STACK] __attribute__((aligned(16)));
+		stage->pid = clone(exec_stage, stack + CLONE_STACK, CLONE_VM | CLONE_VFORK | SIGCHLD,
+		                   stage);
+#else
+		// Refused with the options
+		return ENOSYS;
+#endif
+		break;
+	}
+	}
+	return stage->pid == -1 ? errno : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"expr", required_argument, NULL, 'e'},
+		{"launch", required_argument, NULL, 'l'},
+		{"parallel", required_argument, NULL, 'P'},
+		{"pipe-size", required_argument, NULL, 'p'},
+		{"relay", no_argument, NULL, 'r'},
+		{"stats", no_argument, NULL, 's'},
+		{"tee", required_argument, NULL, 't'},
+		{"unordered", no_argument, NULL, 'u'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *expr = NULL;
+	int relay_mode = 0;
+	int stats = 0;
+	enum launch method = LAUNCH_SPAWN;
+	int unordered = 0;
+	// --parallel N=K, as program N (from 1) and K, in pairs
+	int *parallel = NULL;
+	int nparallel = 0;
+	struct tap *taps = NULL;
+	int ntaps = 0;
+	struct pipe_size *pipe_sizes = NULL;
+	int npipe_sizes = 0;
+	int c;
+	// "+": stop at the first program, so its name may start with '-' after "--"
+	while ((c = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'e':
+			expr = optarg;
+			break;
+		case 'P': {
+			char *end;
+			long stage = strtol(optarg, &end, 10);
+			long replicas = *end == '=' ? strtol(end + 1, &end, 10) : 0;
+			if (*end != '\0' || stage < 1 || stage > INT_MAX || replicas < 1 || replicas > INT_MAX) {
+				fprintf(stderr, "ERROR: --parallel wants N=K, not %s\n", optarg);
+				exit(EINVAL);
+			}
+			parallel = realloc(parallel, (nparallel + 2) * sizeof(*parallel));
+			if (parallel == NULL) {
+				perror("ERROR: Out of memory");
+				exit(errno);
+			}
+			parallel[nparallel++] = stage - 1;
+			parallel[nparallel++] = replicas;
+			break;
+		}
+		case 'p': {
+			// Without "N=", the size is for every pipe
+			char *end = optarg;
+			long stage = 0;
+			int for_stage = strchr(optarg, '=') != NULL;
+			if (for_stage)
+				stage = strtol(optarg, &end, 10);
+			int size = parse_size(for_stage ? end + 1 : optarg);
+			if (size == -1
+			    || (for_stage && (end == optarg || *end != '=' || stage < 1 || stage > INT_MAX))) {
+				fprintf(stderr, "ERROR: --pipe-size wants [N=]SIZE, not %s\n", optarg);
+				exit(EINVAL);
+			}
+			pipe_sizes = realloc(pipe_sizes, (npipe_sizes + 1) * sizeof(*pipe_sizes));
+			if (pipe_sizes == NULL) {
+				perror("ERROR: Out of memory");
+				exit(errno);
+			}
+			pipe_sizes[npipe_sizes++] = (struct pipe_size) {stage - 1, size};
+#ifndef __linux__
+			needs_linux("--pipe-size");
+#endif
+			break;
+		}
+		case 'r':
+#ifndef __linux__
+			needs_linux("--relay");
+#endif
+			relay_mode = 1;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		case 'l':
+			for (method = 0; method < sizeof(launch_names) / sizeof(*launch_names); method++) {
+				if (strcmp(optarg, launch_names[method]) == 0)
+					break;
+			}
+			if (method == sizeof(launch_names) / sizeof(*launch_names)) {
+				fprintf(stderr, "ERROR: --launch wants spawn, fork, vfork or clone, not %s\n",
+				        optarg);
+				exit(EINVAL);
+			}
+#ifndef __linux__
+			if (method == LAUNCH_CLONE)
+				needs_linux("--launch clone");
+#endif
+			break;
+		case 'u':
+			unordered = 1;
+			break;
+		case 't': {
+			char *end;
+			long stage = strtol(optarg, &end, 10);
+			if (end == optarg || *end != '=' || stage < 1 || stage > INT_MAX) {
+				fprintf(stderr, "ERROR: --tee wants N=FILE, not %s\n", optarg);
+				exit(EINVAL);
+			}
+			taps = realloc(taps, (ntaps + 1) * sizeof(*taps));
+			if (taps == NULL) {
+				perror("ERROR: Out of memory");
+				exit(errno);
+			}
+#ifndef __linux__
+			needs_linux("--tee");
+#endif
+			struct tap *tap = &taps[ntaps++];
+			tap->stage = stage - 1;
+			tap->fd = open(end + 1, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			if (tap->fd == -1 || cloexec_pipe(tap->pipe) == -1) {
+				perror(end + 1);
+				exit(errno);
+			}
+			relay_mode = 1;
+			break;
+		}
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	// The programs: from --expr, or one per argument, without arguments of their own
+	struct stage *stages;
+	int nstages;
+	if (expr != NULL) {
+		if (optind < argc)
+			usage(argv[0]);
+		nstages = parse_pipeline(expr, &stages);
+		if (nstages == -1)
+			exit(EINVAL);
+	} else {
+		// 0 Arguments: exit early
+		if (optind >= argc) {
+			errno = EINVAL;
+			perror("ERROR: No arguments provided");
+			exit(errno);
+		}
+		nstages = argc - optind;
+		stages = calloc(nstages, sizeof(*stages));
+		if (stages == NULL) {
+			perror("ERROR: Out of memory");
+			exit(errno);
+		}
+		for (int i = 0; i < nstages; i++)
+			add_word(&stages[i], argv[optind + i]);
+	}
+	for (int t = 0; t < ntaps; t++) {
+		if (taps[t].stage >= nstages - 1) {
+			fprintf(stderr, "ERROR: --tee only works on a program that writes into another\n");
+			exit(EINVAL);
+		}
+	}
+	for (int p = 0; p < nparallel; p += 2) {
+		if (parallel[p] >= nstages) {
+			fprintf(stderr, "ERROR: --parallel %d=%d: there is no program %d\n",
+			        parallel[p] + 1, parallel[p + 1], parallel[p] + 1);
+			exit(EINVAL);
+		}
+		stages[parallel[p]].replicas = parallel[p + 1];
+	}
+	for (int p = 0; p < npipe_sizes; p++) {
+		if (pipe_sizes[p].stage >= nstages - 1) {
+			fprintf(stderr, "ERROR: --pipe-size only works on a program that writes into another\n");
+			exit(EINVAL);
+		}
+	}
+
+	// 1 Program: execute normally (avoid making unnecessary pipe)
+	if (nstages == 1 && stages[0].replicas <= 1) {
+		execvp(stages[0].argv[0], stages[0].argv);
+		perror("ERROR: Failed to execute the single program inputted.");
+		exit(errno);
+	}
+
+	// 2+ Programs (pipe time!)
+	// Every program is started before we wait for any of them, so they all run at once like
+	// in a shell pipeline. Waiting for each one before starting the next would deadlock as
+	// soon as a program writes more than the pipe can buffer (64 KiB on Linux)
+	// One link more than needed, so that a lone --parallel program does not ask for none
+	struct link *links = calloc(nstages, sizeof(*links));
+	if (links == NULL) {
+		perror("ERROR: Out of memory");
+		exit(errno);
+	}
+	for (int i = 0; i < nstages - 1; i++) {
+		links[i].src = -1;
+		links[i].dst = -1;
+	}
+	// Later --pipe-size options win, so "--pipe-size 1M --pipe-size 2=64K" works
+	for (int p = 0; p < npipe_sizes; p++) {
+		for (int i = 0; i < nstages - 1; i++) {
+			if (pipe_sizes[p].stage == -1 || pipe_sizes[p].stage == i)
+				links[i].want_size = pipe_sizes[p].size;
+		}
+	}
+	for (int t = 0; t < ntaps; t++) {
+		struct link *link = &links[taps[t].stage];
+		link->taps = realloc(link->taps, (link->ntaps + 1) * sizeof(*link->taps));
+		if (link->taps == NULL) {
+			perror("ERROR: Out of memory");
+			exit(errno);
+		}
+		link->taps[link->ntaps++] = &taps[t];
+	}
+
+	// Read end of the pipe from the previous program, -1 for the first program. All
+	// pipes are close-on-exec, so a program only keeps the ends dup2() gives it
+	int prev_read = -1;
+	int err = 0;
+	double start = now();
+	for (int i = 0; i < nstages; i++) {
+		// Relay mode: a second pipe from us to this program
+		if (relay_mode && i > 0) {
+			int relay_pipe[2];
+			if (cloexec_pipe(relay_pipe) == -1) {
+				err = errno;
+				perror("ERROR: Failed to create pipe");
+				break;
+			}
+			links[i - 1].dst = relay_pipe[1];
+			links[i - 1].size += set_pipe_size(relay_pipe[1], links[i - 1].want_size);
+			prev_read = relay_pipe[0];
+		}
+
+		// Last program = do not create a pipe
+		int curr_pipe[2] = {-1, -1};
+		if (i < nstages - 1 && cloexec_pipe(curr_pipe) == -1) {
+			err = errno;
+			perror("ERROR: Failed to create pipe");
+			break;
+		}
+		if (curr_pipe[1] != -1) {
+			links[i].size += set_pipe_size(curr_pipe[1], links[i].want_size);
+			// --stats finds the pipe again through its reader
+			struct stat st;
+			if (stats && !relay_mode && fstat(curr_pipe[0], &st) == 0)
+				links[i].ino = st.st_ino;
+		}
+
+		// Start the program, by default with posix_spawnp(), which glibc implements with
+		// clone(CLONE_VM | CLONE_VFORK): the parent's page tables are not copied as
+		// fork() would, however large the parent is. The child redirects the input from
+		// previous (if not the first program) and the output into curr (if not the
+		// last). A --parallel program gets a process of our own in between instead,
+		// which starts its replicas
+		int spawn_err;
+		if (stages[i].replicas > 1)
+			spawn_err = start_fan(&stages[i], prev_read, curr_pipe[1], unordered);
+		else
+			spawn_err = launch(&stages[i], prev_read, curr_pipe[1], method);
+		if (spawn_err != 0) {
+			// Like sh, carry on with the rest of the pipeline
+			fprintf(stderr, "ERROR: Failed to execute %s: %s\n", stages[i].argv[0],
+			        strerror(spawn_err));
+			stages[i].pid = 0;
+		}
+
+		// The parent only keeps the read end of the newest pipe, for the next program (or
+		// to relay from). Any write end left open here would keep the reader from ever
+		// seeing end of file
+		if (prev_read != -1)
+			close(prev_read);
+		if (curr_pipe[1] != -1)
+			close(curr_pipe[1]);
+		prev_read = -1;
+		if (relay_mode && curr_pipe[0] != -1)
+			links[i].src = curr_pipe[0];
+		else
+			prev_read = curr_pipe[0];
+	}
+	if (prev_read != -1)
+		close(prev_read);
+	double setup = now() - start;
+
+#ifdef __linux__
+	if (relay_mode) {
+		if (err == 0) {
+			err = relay(stages, links, nstages - 1, stats);
+		}
+		else {
+			// Something failed: give the programs started end of file so they finish
+			for (int i = 0; i < nstages - 1; i++) {
+				if (links[i].src != -1)
+					close(links[i].src);
+				if (links[i].dst != -1)
+					close(links[i].dst);
+			}
+		}
+	} else if (stats) {
+		monitor(stages, nstages, links);
+	}
+#endif
+
+	// Reap everything we started, even after an error, so no child is left behind
+	int ret = reap_children(stages, nstages);
+	if (relay_mode) {
+		for (int i = 0; i < nstages - 1; i++)
+			fprintf(stderr, "%s: %lld bytes\n", stages[i].argv[0], links[i].bytes);
+	}
+	if (stats) {
+		print_stats(stages, nstages, links, now() - start);
+		fprintf(stderr, "started %d programs in %.3f ms with %s\n", nstages, 1e3 * setup,
+		        launch_names[method]);
+	}
+	free(links);
+	free(taps);
+	free(pipe_sizes);
+	free(parallel);
+	return err ? err : ret;
+}
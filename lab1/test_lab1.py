@@ -1,6 +1,8 @@
+import os
 import pathlib
 import re
 import subprocess
+import tempfile
 import unittest
 
 class TestLab1(unittest.TestCase):
@@ -60,3 +62,131 @@ class TestLab1(unittest.TestCase):
         self.assertNotEqual(pipe_result.stderr, '', msg='Error should be reported to standard error.')
         self.assertTrue(self._make_clean, msg='make clean failed')
 
+    def test_large_output(self):
+        self.assertTrue(self.make, msg='make failed')
+        data = b''.join(b'line %d\n' % i for i in range(200000))
+        pipe_result = subprocess.run(('./pipe', 'cat', 'cat', 'wc'), input=data,
+            capture_output=True, timeout=30)
+        cl_result = subprocess.run(('wc'), input=data, capture_output=True)
+        self.assertEqual(cl_result.stdout, pipe_result.stdout,
+            msg='Output larger than the pipe buffer should not deadlock.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_exit_status(self):
+        self.assertTrue(self.make, msg='make failed')
+        self.assertEqual(subprocess.run(('./pipe', 'false', 'true')).returncode, 1)
+        self.assertEqual(subprocess.run(('./pipe', 'true', 'true')).returncode, 0)
+        pipe_result = subprocess.run(('./pipe', 'yes', 'head'), capture_output=True)
+        self.assertEqual(pipe_result.returncode, 0)
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_relay(self):
+        self.assertTrue(self.make, msg='make failed')
+        data = b''.join(b'line %d\n' % i for i in range(200000))
+        with tempfile.TemporaryDirectory() as tmp:
+            copy = os.path.join(tmp, 'copy')
+            pipe_result = subprocess.run(('./pipe', '--tee', '1=' + copy, 'cat', 'cat', 'wc'),
+                input=data, capture_output=True, timeout=30)
+            cl_result = subprocess.run(('wc'), input=data, capture_output=True)
+            self.assertEqual(cl_result.stdout, pipe_result.stdout)
+            self.assertIn(b'cat: %d bytes' % len(data), pipe_result.stderr)
+            with open(copy, 'rb') as f:
+                self.assertEqual(f.read(), data)
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_expr(self):
+        self.assertTrue(self.make, msg='make failed')
+        pipe_result = subprocess.run(('./pipe', '--expr',
+            """printf '%s\\n' 'a  b' "c \\"d\\"" e\\ f|sort -r | head -n 2"""),
+            capture_output=True, text=True)
+        self.assertEqual(pipe_result.stdout, 'e f\nc "d"\n')
+        pipe_result = subprocess.run(('./pipe', '--expr', 'ls | bogus'), capture_output=True)
+        self.assertEqual(pipe_result.returncode, 127)
+        pipe_result = subprocess.run(('./pipe', '--expr', 'ls | | wc'), capture_output=True)
+        self.assertTrue(pipe_result.returncode, msg='An empty program should be an error.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_stats(self):
+        self.assertTrue(self.make, msg='make failed')
+        data = b''.join(b'line %d\n' % i for i in range(200000))
+        for relay in ((), ('--relay',)):
+            pipe_result = subprocess.run(('./pipe', *relay, '--stats', '--pipe-size', '1M',
+                '--pipe-size', '2=16K', 'cat', 'cat', 'wc'),
+                input=data, capture_output=True, timeout=30)
+            cl_result = subprocess.run(('wc'), input=data, capture_output=True)
+            self.assertEqual(cl_result.stdout, pipe_result.stdout)
+            self.assertEqual(pipe_result.returncode, 0)
+            stderr = pipe_result.stderr.decode()
+            self.assertRegex(stderr, r' 1 cat +\d+\.\d+ +\d+\.\d+\n')
+            self.assertRegex(stderr, r' 3 wc +\d+\.\d+ +\d+\.\d+\n')
+            # Each pipe holds what --pipe-size asked for; with --relay there are two
+            sizes = [int(size) for size in re.findall(r'^ \d -> \d +(\d+)', stderr, re.M)]
+            self.assertEqual(sizes, [(2 if relay else 1) * n for n in (1 << 20, 16 << 10)])
+            self.assertIn('most CPU time', stderr)
+        # --stats must not keep yes from getting SIGPIPE once head is done
+        for relay in ((), ('--relay',)):
+            pipe_result = subprocess.run(('./pipe', *relay, '--stats', 'yes', 'head'),
+                capture_output=True, timeout=10)
+            self.assertEqual(pipe_result.stdout, b'y\n' * 10)
+            self.assertEqual(pipe_result.returncode, 0)
+        pipe_result = subprocess.run(('./pipe', '--pipe-size', '1X', 'ls', 'wc'),
+            capture_output=True)
+        self.assertTrue(pipe_result.returncode, msg='A bad size should be an error.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_parallel(self):
+        self.assertTrue(self.make, msg='make failed')
+        # Several chunks' worth of lines, so every replica gets some
+        data = b''.join(b'line %d\n' % i for i in range(1000000))
+        pipe_result = subprocess.run(('./pipe', '--parallel', '2=3', '--expr', 'cat | gzip -1 | gunzip'),
+            input=data, capture_output=True, timeout=60)
+        self.assertEqual(pipe_result.returncode, 0)
+        self.assertEqual(pipe_result.stdout, data, msg='In order, the output should match.')
+        # Far more chunks than replicas, and the first run finishes last
+        pipe_result = subprocess.run(('./pipe', '--parallel', '1=2', '--expr',
+            'awk \'{ print } NR == 1 && $2 == 0 { system("sleep 1") }\''),
+            input=data, capture_output=True, timeout=60)
+        self.assertEqual(pipe_result.returncode, 0)
+        self.assertEqual(pipe_result.stdout, data, msg='The output should stay in order.')
+        # Input shorter than a chunk is still shared out
+        small = b''.join(b'%d\n' % i for i in range(100))
+        pipe_result = subprocess.run(('./pipe', '--parallel', '1=4', '--expr', 'wc -l'),
+            input=small, capture_output=True, timeout=60)
+        counts = [int(line) for line in pipe_result.stdout.split()]
+        self.assertEqual(len(counts), 4, msg='Each replica should get a share.')
+        self.assertEqual(sum(counts), 100)
+        # In order, a run starts before any input comes, and runs once without any
+        with subprocess.Popen(('./pipe', '--parallel', '1=3', 'yes', 'head'),
+                stdin=subprocess.PIPE, stdout=subprocess.PIPE) as proc:
+            # Our end of its input stays open, so it must not wait for it
+            self.assertEqual(proc.stdout.read(), b'y\n' * 10)
+            self.assertEqual(proc.wait(timeout=10), 0)
+            proc.stdin.close()
+        pipe_result = subprocess.run(('./pipe', '--parallel', '1=3', '--expr', 'wc -l'),
+            stdin=subprocess.DEVNULL, capture_output=True, timeout=10)
+        self.assertEqual(pipe_result.stdout.split(), [b'0'])
+        pipe_result = subprocess.run(('./pipe', '--unordered', '--parallel', '1=3', '--expr', 'wc -l'),
+            input=data, capture_output=True, timeout=60)
+        counts = [int(line) for line in pipe_result.stdout.split()]
+        self.assertEqual(len(counts), 3, msg='Each replica should get a chunk.')
+        self.assertEqual(sum(counts), data.count(b'\n'))
+        pipe_result = subprocess.run(('./pipe', '--unordered', '--parallel', '2=4', '--expr',
+            'cat | sed s/line/LINE/ | sort'), input=data, capture_output=True, timeout=60)
+        cl_result = subprocess.run('sed s/line/LINE/ | sort', shell=True, input=data, capture_output=True)
+        self.assertEqual(cl_result.stdout, pipe_result.stdout)
+        pipe_result = subprocess.run(('./pipe', '--parallel', '2=2', '--expr', 'cat | bogus'),
+            input=data, capture_output=True, timeout=60)
+        self.assertEqual(pipe_result.returncode, 127)
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_launch(self):
+        self.assertTrue(self.make, msg='make failed')
+        cl_result = subprocess.run('ls | cat | wc', shell=True, capture_output=True)
+        for method in ('spawn', 'fork', 'vfork', 'clone'):
+            pipe_result = subprocess.run(('./pipe', '--launch', method, 'ls', 'cat', 'wc'),
+                capture_output=True)
+            self.assertEqual(cl_result.stdout, pipe_result.stdout, msg=method)
+            pipe_result = subprocess.run(('./pipe', '--launch', method, 'ls', 'bogus'),
+                capture_output=True)
+            self.assertEqual(pipe_result.returncode, 127, msg=method)
+        self.assertTrue(self._make_clean, msg='make clean failed')
@@ -0,0 +1,104 @@
+"""Time rr on synthetic traces and catch simulation throughput regressions.
+
+Traces come from gen-trace with fixed seeds, so every run simulates the
+same work.  Each case is run a few times and the best events/s kept.
+With --record, the results become the baseline; otherwise any case whose
+events/s falls more than --tolerance below the baseline fails the run.
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+SIZES = (10000, 100000, 1000000)
+QUANTA = (1, 4, 16)
+BURSTS = ('exp', 'bimodal', 'pareto')
+REPEATS = 5
+TRACE_DIR = 'bench-traces'
+
+STATS = re.compile(r'Simulated (\d+) ticks and (\d+) events in [\d.]+ s: '
+                   r'(\d+) ticks/s, (\d+) events/s')
+
+
+def trace(size, burst):
+    path = os.path.join(TRACE_DIR, f'{burst}-{size}.txt')
+    if not os.path.exists(path):
+        os.makedirs(TRACE_DIR, exist_ok=True)
+        subprocess.run(['./gen-trace', '--burst', burst, '--seed', '1',
+                        '--output', path, str(size)], check=True)
+    return path
+
+
+def cases():
+    for size in SIZES:
+        for quantum in QUANTA:
+            yield f'exp-{size}-q{quantum}', trace(size, 'exp'), quantum
+    for burst in BURSTS[1:]:
+        size = SIZES[1]
+        yield f'{burst}-{size}-q4', trace(size, burst), 4
+
+
+def measure(path, quantum):
+    best = (0, 0)
+    for _ in range(REPEATS):
+        result = subprocess.run(['./rr', '--stats', path, str(quantum)],
+                                capture_output=True, text=True, check=True)
+        m = STATS.search(result.stderr)
+        if not m:
+            sys.exit(f'unexpected rr output: {result.stderr!r}')
+        best = max(best, (int(m.group(4)), int(m.group(3))))
+    return best
+
+
+def load_baseline(path):
+    baseline = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                name, events = line.split()
+                baseline[name] = int(events)
+    return baseline
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--baseline', default='bench-baseline.txt')
+    parser.add_argument('--record', action='store_true',
+                        help='save the results as the new baseline')
+    parser.add_argument('--tolerance', type=float, default=0.15,
+                        help='allowed fractional drop in events/s')
+    args = parser.parse_args()
+
+    baseline = {} if args.record else load_baseline(args.baseline)
+    results = {}
+    regressions = []
+
+    print(f'{"case":<22} {"ticks/s":>14} {"events/s":>14} {"baseline":>14} {"change":>8}')
+    for name, path, quantum in cases():
+        events, ticks = measure(path, quantum)
+        results[name] = events
+        line = f'{name:<22} {ticks:>14,} {events:>14,}'
+        if name in baseline:
+            change = events / baseline[name] - 1
+            line += f' {baseline[name]:>14,} {change:>+8.1%}'
+            if change < -args.tolerance:
+                regressions.append(name)
+        print(line, flush=True)
+
+    if args.record:
+        with open(args.baseline, 'w') as f:
+            for name, events in results.items():
+                f.write(f'{name} {events}\n')
+        print(f'Recorded baseline in {args.baseline}')
+    elif not baseline:
+        print(f'No baseline in {args.baseline}; record one with "make bench-baseline"')
+
+    if regressions:
+        sys.exit(f'Throughput regressed by more than {args.tolerance:.0%}: '
+                 + ', '.join(regressions))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Write a synthetic process trace in the format rr reads: a process
+   count, then one "pid, arrival_time, burst_time" line per process.
+   Arrivals form a Poisson process whose rate keeps the CPU at the
+   requested load; burst times follow the requested distribution.  The
+   generator is seeded, so a seed and options always give the same
+   trace.  */
+
+/* The shapes of burst time distributions, all with mean MEAN_BURST.  */
+enum burst_kind
+{
+  BURST_EXP,		/* Exponential.  */
+  BURST_BIMODAL,	/* 90% short jobs, 10% jobs 41 times longer.  */
+  BURST_PARETO		/* Pareto with shape PARETO_ALPHA.  */
+};
+
+#define PARETO_ALPHA 1.5
+
+/* Heavy-tailed bursts are capped at this many times the mean.  */
+#define BURST_CAP_FACTOR 1000
+
+static uint64_t rng_state;
+
+/* Return the next output of the splitmix64 generator.  */
+static uint64_t
+next_random (void)
+{
+  uint64_t z = (rng_state += 0x9E3779B97F4A7C15);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+  return z ^ (z >> 31);
+}
+
+/* Return a uniform random number in (0, 1].  */
+static double
+uniform (void)
+{
+  return ((next_random () >> 11) + 1) * 0x1.0p-53;
+}
+
+static double
+exponential (double mean)
+{
+  return -mean * log (uniform ());
+}
+
+static double
+burst (enum burst_kind kind, double mean)
+{
+  switch (kind)
+    {
+    case BURST_BIMODAL:
+      return uniform () <= 0.9 ? exponential (mean / 5) : exponential (mean * 8.2);
+    case BURST_PARETO:
+      {
+	double scale = mean * (PARETO_ALPHA - 1) / PARETO_ALPHA;
+	double x = scale / pow (uniform (), 1 / PARETO_ALPHA);
+	return fmin (x, mean * BURST_CAP_FACTOR);
+      }
+    default:
+      return exponential (mean);
+    }
+}
+
+/* Return the value of the decimal number ARG, which must be positive.
+   Report an error and exit if it is not.  */
+static double
+positive_double (char const *arg, char const *what)
+{
+  char *end;
+  errno = 0;
+  double d = strtod (arg, &end);
+  if (errno || end == arg || *end || !(d > 0))
+    {
+      fprintf (stderr, "%s: invalid %s\n", arg, what);
+      exit (1);
+    }
+  return d;
+}
+
+static long
+positive_long (char const *arg, char const *what)
+{
+  char *end;
+  errno = 0;
+  long n = strtol (arg, &end, 10);
+  if (errno || end == arg || *end || n <= 0)
+    {
+      fprintf (stderr, "%s: invalid %s\n", arg, what);
+      exit (1);
+    }
+  return n;
+}
+
+/* Return the value of the decimal number ARG as a seed.  Report an
+   error and exit if it is not one.  */
+static uint64_t
+seed_value (char const *arg)
+{
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull (arg, &end, 10);
+  /* strtoull accepts and negates a leading minus sign.  */
+  if (errno || end == arg || *end || strchr (arg, '-'))
+    {
+      fprintf (stderr, "%s: invalid seed\n", arg);
+      exit (1);
+    }
+  return n;
+}
+
+static void
+usage (char const *prog)
+{
+  fprintf (stderr,
+	   "%s: usage: %s [OPTION]... nprocesses\n"
+	   "Options:\n"
+	   "  --burst KIND        exp (default), bimodal or pareto\n"
+	   "  --mean-burst N      mean burst time in ticks (default 10)\n"
+	   "  --load L            offered CPU load (default 0.9)\n"
+	   "  --seed N            random seed (default 1)\n"
+	   "  --output FILE       write to FILE instead of standard output\n",
+	   prog, prog);
+  exit (1);
+}
+
+static struct option const long_options[] = {
+  {"burst", required_argument, NULL, 'b'},
+  {"load", required_argument, NULL, 'l'},
+  {"mean-burst", required_argument, NULL, 'm'},
+  {"output", required_argument, NULL, 'o'},
+  {"seed", required_argument, NULL, 's'},
+  {NULL, 0, NULL, 0}
+};
+
+int
+main (int argc, char *argv[])
+{
+  enum burst_kind kind = BURST_EXP;
+  double mean_burst = 10;
+  double load = 0.9;
+  char const *output = NULL;
+  rng_state = 1;
+
+  int c;
+  while ((c = getopt_long (argc, argv, "b:l:m:o:s:", long_options, NULL))
+	 != -1)
+    switch (c)
+      {
+      case 'b':
+	if (strcmp (optarg, "exp") == 0)
+	  kind = BURST_EXP;
+	else if (strcmp (optarg, "bimodal") == 0)
+	  kind = BURST_BIMODAL;
+	else if (strcmp (optarg, "pareto") == 0)
+	  kind = BURST_PARETO;
+	else
+	  {
+	    fprintf (stderr, "%s: unknown burst distribution\n", optarg);
+	    return 1;
+	  }
+	break;
+      case 'l':
+	load = positive_double (optarg, "load");
+	break;
+      case 'm':
+	mean_burst = positive_double (optarg, "mean burst");
+	break;
+      case 'o':
+	output = optarg;
+	break;
+      case 's':
+	rng_state = seed_value (optarg);
+	break;
+      default:
+	usage (argv[0]);
+      }
+  if (argc - optind != 1)
+    usage (argv[0]);
+  long nprocesses = positive_long (argv[optind], "process count");
+
+  if (output && !freopen (output, "w", stdout))
+    {
+      perror (output);
+      return 1;
+    }
+  static char buf[1 << 20];
+  setvbuf (stdout, buf, _IOFBF, sizeof buf);
+
+  double mean_interarrival = mean_burst / load;
+  double arrival = 0;
+  printf ("%ld\n", nprocesses);
+  for (long pid = 1; pid <= nprocesses; pid++)
+    {
+      long b = lround (burst (kind, mean_burst));
+      printf ("%ld, %ld, %ld\n", pid, (long) arrival, b < 1 ? 1 : b);
+      arrival += exponential (mean_interarrival);
+    }
+
+  if (fflush (stdout) < 0 || ferror (stdout))
+    {
+      perror ("stdout");
+      return 1;
+    }
+  return 0;
+}
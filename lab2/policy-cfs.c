@@ -0,0 +1,381 @@
+#include "policy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* A CFS-style fair scheduler.  Runnable processes sit in a red-black
+   tree keyed by virtual runtime, the CPU time each has received so
+   far, and the leftmost (least served) process runs next.  Its slice
+   is an equal share of a scheduling period of CFS_LATENCY_QUANTA base
+   quanta, but never less than one quantum.  Arrivals start at the
+   queue's minimum virtual runtime so they cannot starve older work.  */
+#define CFS_LATENCY_QUANTA 8
+
+/* Tree links live in each process's SE.CFS; NIL is a black sentinel
+   owned by the queue.  */
+#define L(x) ((x)->se.cfs.left)
+#define R(x) ((x)->se.cfs.right)
+#define P(x) ((x)->se.cfs.parent)
+#define RED(x) ((x)->se.cfs.red)
+#define VRUNTIME(x) ((x)->se.cfs.vruntime)
+
+struct cfs_queue
+{
+  struct process_state nil_node;
+  struct process_state *nil;
+  struct process_state *root;
+  struct process_state *leftmost;
+  long nr_queued;
+  long min_vruntime;
+  long quantum_length;
+
+  /* When the process last picked started running.  */
+  long dispatched_at;
+};
+
+static bool
+cfs_before (struct process_state const *a, struct process_state const *b)
+{
+  return (VRUNTIME (a) < VRUNTIME (b)
+	  || (VRUNTIME (a) == VRUNTIME (b) && a < b));
+}
+
+static void
+cfs_rotate_left (struct cfs_queue *rq, struct process_state *x)
+{
+  struct process_state *y = R (x);
+  R (x) = L (y);
+  if (L (y) != rq->nil)
+    P (L (y)) = x;
+  P (y) = P (x);
+  if (P (x) == rq->nil)
+    rq->root = y;
+  else if (x == L (P (x)))
+    L (P (x)) = y;
+  else
+    R (P (x)) = y;
+  L (y) = x;
+  P (x) = y;
+}
+
+static void
+cfs_rotate_right (struct cfs_queue *rq, struct process_state *x)
+{
+  struct process_state *y = L (x);
+  L (x) = R (y);
+  if (R (y) != rq->nil)
+    P (R (y)) = x;
+  P (y) = P (x);
+  if (P (x) == rq->nil)
+    rq->root = y;
+  else if (x == R (P (x)))
+    R (P (x)) = y;
+  else
+    L (P (x)) = y;
+  R (y) = x;
+  P (x) = y;
+}
+
+static void
+cfs_insert (struct cfs_queue *rq, struct process_state *z)
+{
+  struct process_state *y = rq->nil;
+  bool leftmost = true;
+  for (struct process_state *x = rq->root; x != rq->nil; )
+    {
+      y = x;
+      if (cfs_before (z, x))
+	x = L (x);
+      else
+	{
+	  x = R (x);
+	  leftmost = false;
+	}
+    }
+  P (z) = y;
+  L (z) = R (z) = rq->nil;
+  RED (z) = true;
+  if (y == rq->nil)
+    rq->root = z;
+  else if (cfs_before (z, y))
+    L (y) = z;
+  else
+    R (y) = z;
+  if (leftmost)
+    rq->leftmost = z;
+  rq->nr_queued++;
+
+  while (RED (P (z)))
+    {
+      struct process_state *p = P (z);
+      struct process_state *g = P (p);
+      if (p == L (g))
+	{
+	  struct process_state *u = R (g);
+	  if (RED (u))
+	    {
+	      RED (p) = RED (u) = false;
+	      RED (g) = true;
+	      z = g;
+	      continue;
+	    }
+	  if (z == R (p))
+	    {
+	      z = p;
+	      cfs_rotate_left (rq, z);
+	      p = P (z);
+	    }
+	  RED (p) = false;
+	  RED (g) = true;
+	  cfs_rotate_right (rq, g);
+	}
+      else
+	{
+	  struct process_state *u = L (g);
+	  if (RED (u))
+	    {
+	      RED (p) = RED (u) = false;
+	      RED (g) = true;
+	      z = g;
+	      continue;
+	    }
+	  if (z == L (p))
+	    {
+	      z = p;
+	      cfs_rotate_right (rq, z);
+	      p = P (z);
+	    }
+	  RED (p) = false;
+	  RED (g) = true;
+	  cfs_rotate_left (rq, g);
+	}
+    }
+  RED (rq->root) = false;
+}
+
+static void
+cfs_transplant (struct cfs_queue *rq, struct process_state *u,
+		struct process_state *v)
+{
+  if (P (u) == rq->nil)
+    rq->root = v;
+  else if (u == L (P (u)))
+    L (P (u)) = v;
+  else
+    R (P (u)) = v;
+  P (v) = P (u);
+}
+
+static struct process_state *
+cfs_minimum (struct cfs_queue const *rq, struct process_state *x)
+{
+  while (L (x) != rq->nil)
+    x = L (x);
+  return x;
+}
+
+static void
+cfs_erase (struct cfs_queue *rq, struct process_state *z)
+{
+  if (z == rq->leftmost)
+    rq->leftmost = R (z) != rq->nil ? cfs_minimum (rq, R (z)) : P (z);
+  rq->nr_queued--;
+
+  struct process_state *x;
+  struct process_state *y = z;
+  bool y_was_red = RED (y);
+  if (L (z) == rq->nil)
+    {
+      x = R (z);
+      cfs_transplant (rq, z, x);
+    }
+  else if (R (z) == rq->nil)
+    {
+      x = L (z);
+      cfs_transplant (rq, z, x);
+    }
+  else
+    {
+      y = cfs_minimum (rq, R (z));
+      y_was_red = RED (y);
+      x = R (y);
+      if (P (y) == z)
+	P (x) = y;
+      else
+	{
+	  cfs_transplant (rq, y, R (y));
+	  R (y) = R (z);
+	  P (R (y)) = y;
+	}
+      cfs_transplant (rq, z, y);
+      L (y) = L (z);
+      P (L (y)) = y;
+      RED (y) = RED (z);
+    }
+
+  if (y_was_red)
+    return;
+  while (x != rq->root && !RED (x))
+    {
+      struct process_state *p = P (x);
+      if (x == L (p))
+	{
+	  struct process_state *w = R (p);
+	  if (RED (w))
+	    {
+	      RED (w) = false;
+	      RED (p) = true;
+	      cfs_rotate_left (rq, p);
+	      w = R (p);
+	    }
+	  if (!RED (L (w)) && !RED (R (w)))
+	    {
+	      RED (w) = true;
+	      x = p;
+	      continue;
+	    }
+	  if (!RED (R (w)))
+	    {
+	      RED (L (w)) = false;
+	      RED (w) = true;
+	      cfs_rotate_right (rq, w);
+	      w = R (p);
+	    }
+	  RED (w) = RED (p);
+	  RED (p) = false;
+	  RED (R (w)) = false;
+	  cfs_rotate_left (rq, p);
+	}
+      else
+	{
+	  struct process_state *w = L (p);
+	  if (RED (w))
+	    {
+	      RED (w) = false;
+	      RED (p) = true;
+	      cfs_rotate_right (rq, p);
+	      w = L (p);
+	    }
+	  if (!RED (R (w)) && !RED (L (w)))
+	    {
+	      RED (w) = true;
+	      x = p;
+	      continue;
+	    }
+	  if (!RED (L (w)))
+	    {
+	      RED (R (w)) = false;
+	      RED (w) = true;
+	      cfs_rotate_left (rq, w);
+	      w = L (p);
+	    }
+	  RED (w) = RED (p);
+	  RED (p) = false;
+	  RED (L (w)) = false;
+	  cfs_rotate_right (rq, p);
+	}
+      x = rq->root;
+    }
+  RED (x) = false;
+}
+
+static void *
+cfs_create (struct process_state *state, long quantum_length)
+{
+  (void) state;
+  if (quantum_length < 0)
+    {
+      fprintf (stderr, "cfs: needs a fixed quantum\n");
+      exit (1);
+    }
+  struct cfs_queue *rq = xcalloc (1, sizeof *rq);
+  rq->nil = &rq->nil_node;
+  rq->root = rq->leftmost = rq->nil;
+  rq->quantum_length = quantum_length;
+  return rq;
+}
+
+static void
+cfs_destroy (void *q)
+{
+  free (q);
+}
+
+static void
+cfs_enqueue (void *q, struct process_state *p, long time)
+{
+  (void) time;
+  struct cfs_queue *rq = q;
+  VRUNTIME (p) = rq->min_vruntime;
+  cfs_insert (rq, p);
+}
+
+static struct process_state *
+cfs_peek (void *q)
+{
+  struct cfs_queue *rq = q;
+  return rq->leftmost == rq->nil ? NULL : rq->leftmost;
+}
+
+static struct process_state *
+cfs_pick_next (void *q, long time, long *slice)
+{
+  struct cfs_queue *rq = q;
+  struct process_state *p = rq->leftmost;
+  if (p == rq->nil)
+    return NULL;
+
+  long share = CFS_LATENCY_QUANTA * rq->quantum_length / rq->nr_queued;
+  *slice = share > rq->quantum_length ? share : rq->quantum_length;
+
+  if (VRUNTIME (p) > rq->min_vruntime)
+    rq->min_vruntime = VRUNTIME (p);
+  cfs_erase (rq, p);
+  rq->dispatched_at = time;
+  return p;
+}
+
+static bool
+cfs_on_tick (void *q, struct process_state *curr, long time)
+{
+  (void) q;
+  (void) curr;
+  (void) time;
+  return false;
+}
+
+/* Charge CURR for the CPU time it just received and requeue it.  */
+static void
+cfs_on_preempt (void *q, struct process_state *curr, long time)
+{
+  struct cfs_queue *rq = q;
+  VRUNTIME (curr) += time - rq->dispatched_at;
+  cfs_insert (rq, curr);
+}
+
+/* Migrate the most-served process, the rightmost in the tree.  */
+static struct process_state *
+cfs_steal (void *q, long time)
+{
+  (void) time;
+  struct cfs_queue *rq = q;
+  struct process_state *p = rq->root;
+  if (p == rq->nil)
+    return NULL;
+  while (R (p) != rq->nil)
+    p = R (p);
+  cfs_erase (rq, p);
+  return p;
+}
+
+struct sched_policy const policy_cfs = {
+  "cfs",
+  cfs_create,
+  cfs_destroy,
+  cfs_enqueue,
+  cfs_peek,
+  cfs_pick_next,
+  cfs_on_tick,
+  cfs_on_preempt,
+  cfs_steal,
+};
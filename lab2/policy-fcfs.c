@@ -0,0 +1,97 @@
+#include "policy.h"
+#include "ring.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+/* First come, first served: a FIFO run queue and no preemption.  */
+struct fcfs_queue
+{
+  struct process_state *state;
+  struct ring ring;
+};
+
+static void *
+fcfs_create (struct process_state *state, long quantum_length)
+{
+  (void) quantum_length;
+  struct fcfs_queue *rq = xcalloc (1, sizeof *rq);
+  rq->state = state;
+  ring_init (&rq->ring);
+  return rq;
+}
+
+static void
+fcfs_destroy (void *q)
+{
+  struct fcfs_queue *rq = q;
+  ring_free (&rq->ring);
+  free (rq);
+}
+
+static void
+fcfs_enqueue (void *q, struct process_state *p, long time)
+{
+  (void) time;
+  struct fcfs_queue *rq = q;
+  ring_push_back (&rq->ring, p - rq->state);
+}
+
+static struct process_state *
+fcfs_peek (void *q)
+{
+  struct fcfs_queue *rq = q;
+  return rq->ring.len ? &rq->state[ring_at (&rq->ring, 0)] : NULL;
+}
+
+static struct process_state *
+fcfs_pick_next (void *q, long time, long *slice)
+{
+  (void) time;
+  struct fcfs_queue *rq = q;
+  if (!rq->ring.len)
+    return NULL;
+  *slice = LONG_MAX;
+  return &rq->state[ring_pop_front (&rq->ring)];
+}
+
+static bool
+fcfs_on_tick (void *q, struct process_state *curr, long time)
+{
+  (void) q;
+  (void) curr;
+  (void) time;
+  return false;
+}
+
+/* Slices never expire, so this only runs if a caller forces CURR off
+   the CPU; it keeps its place at the head of the line.  */
+static void
+fcfs_on_preempt (void *q, struct process_state *curr, long time)
+{
+  (void) time;
+  struct fcfs_queue *rq = q;
+  ring_push_front (&rq->ring, curr - rq->state);
+}
+
+static struct process_state *
+fcfs_steal (void *q, long time)
+{
+  (void) time;
+  struct fcfs_queue *rq = q;
+  if (!rq->ring.len)
+    return NULL;
+  return &rq->state[ring_pop_back (&rq->ring)];
+}
+
+struct sched_policy const policy_fcfs = {
+  "fcfs",
+  fcfs_create,
+  fcfs_destroy,
+  fcfs_enqueue,
+  fcfs_peek,
+  fcfs_pick_next,
+  fcfs_on_tick,
+  fcfs_on_preempt,
+  fcfs_steal,
+};
@@ -0,0 +1,255 @@
+#include "policy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Multi-level feedback queue.  Level K runs round robin with a slice
+   of QUANTUM << K.  A process that uses up its slice drops a level; a
+   process preempted by higher-priority work keeps its level.
+   Periodically everything returns to level 0.  The boost period is
+   MLFQ_BOOST_QUANTA base quanta plus, for each queued process, enough
+   for one slice at every level.  With a fixed period a long queue is
+   boosted before anything reaches a lower level, and MLFQ degenerates
+   into round robin.  */
+#define MLFQ_LEVELS 3
+#define MLFQ_BOOST_QUANTA 32
+
+/* The end of a level's list.  */
+#define MLFQ_NIL UINT32_MAX
+
+/* A doubly linked list of processes, linked by their indices in the
+   state vector through SE.MLFQ.NEXT and SE.MLFQ.PREV.  */
+struct mlfq_list
+{
+  uint32_t first;
+  uint32_t last;
+};
+
+struct mlfq_queue
+{
+  struct process_state *state;
+  struct mlfq_list level[MLFQ_LEVELS];
+  long nr_queued;
+  long quantum_length;
+
+  /* A process's level is its SE.MLFQ.LEVEL only if its SE.MLFQ.EPOCH
+     is the current EPOCH, and 0 otherwise, so that a boost is
+     O(MLFQ_LEVELS).  */
+  long current_epoch;
+  long next_boost;
+
+  /* ON_TICK preempted the running process.  */
+  bool preempted;
+};
+
+static bool
+mlfq_empty (struct mlfq_list const *l)
+{
+  return l->first == MLFQ_NIL;
+}
+
+static void
+mlfq_push (struct mlfq_queue *rq, struct mlfq_list *l, struct process_state *p)
+{
+  uint32_t i = p - rq->state;
+  rq->nr_queued++;
+  p->se.mlfq.next = MLFQ_NIL;
+  p->se.mlfq.prev = l->last;
+  if (l->last == MLFQ_NIL)
+    l->first = i;
+  else
+    rq->state[l->last].se.mlfq.next = i;
+  l->last = i;
+}
+
+static struct process_state *
+mlfq_pop_first (struct mlfq_queue *rq, struct mlfq_list *l)
+{
+  struct process_state *p = &rq->state[l->first];
+  rq->nr_queued--;
+  l->first = p->se.mlfq.next;
+  if (l->first == MLFQ_NIL)
+    l->last = MLFQ_NIL;
+  else
+    rq->state[l->first].se.mlfq.prev = MLFQ_NIL;
+  return p;
+}
+
+static struct process_state *
+mlfq_pop_last (struct mlfq_queue *rq, struct mlfq_list *l)
+{
+  struct process_state *p = &rq->state[l->last];
+  rq->nr_queued--;
+  l->last = p->se.mlfq.prev;
+  if (l->last == MLFQ_NIL)
+    l->first = MLFQ_NIL;
+  else
+    rq->state[l->last].se.mlfq.next = MLFQ_NIL;
+  return p;
+}
+
+/* Append the processes in SRC to DST and leave SRC empty.  */
+static void
+mlfq_concat (struct mlfq_queue *rq, struct mlfq_list *dst,
+	     struct mlfq_list *src)
+{
+  if (mlfq_empty (src))
+    return;
+  if (mlfq_empty (dst))
+    *dst = *src;
+  else
+    {
+      rq->state[dst->last].se.mlfq.next = src->first;
+      rq->state[src->first].se.mlfq.prev = dst->last;
+      dst->last = src->last;
+    }
+  src->first = src->last = MLFQ_NIL;
+}
+
+static int
+mlfq_level (struct mlfq_queue *rq, struct process_state *p)
+{
+  return p->se.mlfq.epoch == rq->current_epoch ? p->se.mlfq.level : 0;
+}
+
+static void
+mlfq_set_level (struct mlfq_queue *rq, struct process_state *p, int level)
+{
+  p->se.mlfq.level = level;
+  p->se.mlfq.epoch = rq->current_epoch;
+}
+
+/* Move every queued process to level 0, keeping their order by level,
+   once TIME reaches the next boost.  */
+static void
+mlfq_maybe_boost (struct mlfq_queue *rq, long time)
+{
+  if (time < rq->next_boost)
+    return;
+  for (int k = 1; k < MLFQ_LEVELS; k++)
+    mlfq_concat (rq, &rq->level[0], &rq->level[k]);
+  rq->current_epoch++;
+  long per_process = (1 << MLFQ_LEVELS) - 1;
+  rq->next_boost = time + ((MLFQ_BOOST_QUANTA + per_process * rq->nr_queued)
+			    * rq->quantum_length);
+}
+
+static void *
+mlfq_create (struct process_state *state, long quantum_length)
+{
+  if (quantum_length < 0)
+    {
+      fprintf (stderr, "mlfq: needs a fixed quantum\n");
+      exit (1);
+    }
+  struct mlfq_queue *rq = xcalloc (1, sizeof *rq);
+  rq->state = state;
+  for (int k = 0; k < MLFQ_LEVELS; k++)
+    rq->level[k].first = rq->level[k].last = MLFQ_NIL;
+  rq->quantum_length = quantum_length;
+  rq->next_boost = MLFQ_BOOST_QUANTA * quantum_length;
+  return rq;
+}
+
+static void
+mlfq_destroy (void *q)
+{
+  free (q);
+}
+
+/* A new arrival starts at level 0.  A process stolen from another
+   queue keeps the level it had there, since epochs of different queues
+   cannot be compared.  */
+static void
+mlfq_enqueue (void *q, struct process_state *p, long time)
+{
+  (void) time;
+  struct mlfq_queue *rq = q;
+  int level = p->se.mlfq.migrated ? p->se.mlfq.level : 0;
+  p->se.mlfq.migrated = false;
+  mlfq_set_level (rq, p, level);
+  mlfq_push (rq, &rq->level[level], p);
+}
+
+static struct process_state *
+mlfq_peek (void *q)
+{
+  struct mlfq_queue *rq = q;
+  for (int k = 0; k < MLFQ_LEVELS; k++)
+    if (!mlfq_empty (&rq->level[k]))
+      return &rq->state[rq->level[k].first];
+  return NULL;
+}
+
+static struct process_state *
+mlfq_pick_next (void *q, long time, long *slice)
+{
+  struct mlfq_queue *rq = q;
+  mlfq_maybe_boost (rq, time);
+  for (int k = 0; k < MLFQ_LEVELS; k++)
+    if (!mlfq_empty (&rq->level[k]))
+      {
+	struct process_state *p = mlfq_pop_first (rq, &rq->level[k]);
+	*slice = rq->quantum_length << mlfq_level (rq, p);
+	return p;
+      }
+  return NULL;
+}
+
+static bool
+mlfq_on_tick (void *q, struct process_state *curr, long time)
+{
+  struct mlfq_queue *rq = q;
+  mlfq_maybe_boost (rq, time);
+  int level = mlfq_level (rq, curr);
+  for (int k = 0; k < level; k++)
+    if (!mlfq_empty (&rq->level[k]))
+      {
+	rq->preempted = true;
+	return true;
+      }
+  return false;
+}
+
+static void
+mlfq_on_preempt (void *q, struct process_state *curr, long time)
+{
+  (void) time;
+  struct mlfq_queue *rq = q;
+  int level = mlfq_level (rq, curr);
+  if (!rq->preempted && level < MLFQ_LEVELS - 1)
+    level++;
+  rq->preempted = false;
+  mlfq_set_level (rq, curr, level);
+  mlfq_push (rq, &rq->level[level], curr);
+}
+
+/* Migrate the process at the back of the lowest nonempty level, with
+   its level as of this queue's last boost.  */
+static struct process_state *
+mlfq_steal (void *q, long time)
+{
+  (void) time;
+  struct mlfq_queue *rq = q;
+  for (int k = MLFQ_LEVELS - 1; k >= 0; k--)
+    if (!mlfq_empty (&rq->level[k]))
+      {
+	struct process_state *p = mlfq_pop_last (rq, &rq->level[k]);
+	p->se.mlfq.level = mlfq_level (rq, p);
+	p->se.mlfq.migrated = true;
+	return p;
+      }
+  return NULL;
+}
+
+struct sched_policy const policy_mlfq = {
+  "mlfq",
+  mlfq_create,
+  mlfq_destroy,
+  mlfq_enqueue,
+  mlfq_peek,
+  mlfq_pick_next,
+  mlfq_on_tick,
+  mlfq_on_preempt,
+  mlfq_steal,
+};
@@ -0,0 +1,315 @@
+#include "policy.h"
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Round robin: a FIFO run queue with a fixed quantum, or with the
+   median CPU time of the queued processes.  */
+
+/* A binary heap of process indices, a max-heap of CPU times if MAX and
+   a min-heap otherwise.  Each queued process's SE.RR.POS is its slot.  */
+struct median_heap
+{
+  uint32_t *slot;
+  long n;
+  long capacity;
+  bool max;
+};
+
+struct rr_queue
+{
+  struct process_state *state;
+  struct ring ring;
+  long quantum_length;
+
+  /* The last NR_NEW processes in the ring arrived during tick
+     NEW_TIME.  */
+  uint32_t nr_new;
+  long new_time;
+
+  /* For the median quantum, the CPU times of the queued processes: the
+     lower half in LOWER and the upper half in UPPER, with LOWER one
+     longer if their number is odd.  A queued process's CPU time does
+     not change, so the median costs O(log n) per queue operation
+     rather than a sort per dispatch.  */
+  struct median_heap lower;
+  struct median_heap upper;
+};
+
+static long
+cpu_time (struct rr_queue const *rq, uint32_t i)
+{
+  return rq->state[i].burst_time - rq->state[i].remaining_time;
+}
+
+/* Return whether slot A belongs above slot B in heap H.  */
+static bool
+heap_before (struct rr_queue const *rq, struct median_heap const *h,
+	     long a, long b)
+{
+  long x = cpu_time (rq, h->slot[a]);
+  long y = cpu_time (rq, h->slot[b]);
+  return h->max ? x > y : x < y;
+}
+
+static void
+heap_set (struct rr_queue *rq, struct median_heap *h, long pos, uint32_t i)
+{
+  h->slot[pos] = i;
+  rq->state[i].se.rr.pos = pos;
+  rq->state[i].se.rr.upper = h == &rq->upper;
+}
+
+static void
+heap_swap (struct rr_queue *rq, struct median_heap *h, long a, long b)
+{
+  uint32_t i = h->slot[a];
+  heap_set (rq, h, a, h->slot[b]);
+  heap_set (rq, h, b, i);
+}
+
+static void
+heap_sift_up (struct rr_queue *rq, struct median_heap *h, long pos)
+{
+  while (pos > 0 && heap_before (rq, h, pos, (pos - 1) / 2))
+    {
+      heap_swap (rq, h, pos, (pos - 1) / 2);
+      pos = (pos - 1) / 2;
+    }
+}
+
+static void
+heap_sift_down (struct rr_queue *rq, struct median_heap *h, long pos)
+{
+  for (;;)
+    {
+      long child = 2 * pos + 1;
+      if (child >= h->n)
+	break;
+      if (child + 1 < h->n && heap_before (rq, h, child + 1, child))
+	child++;
+      if (!heap_before (rq, h, child, pos))
+	break;
+      heap_swap (rq, h, pos, child);
+      pos = child;
+    }
+}
+
+static void
+heap_push (struct rr_queue *rq, struct median_heap *h, uint32_t i)
+{
+  if (h->n == h->capacity)
+    {
+      h->capacity = h->capacity ? 2 * h->capacity : 64;
+      h->slot = realloc (h->slot, h->capacity * sizeof *h->slot);
+      if (!h->slot)
+	{
+	  perror ("realloc");
+	  exit (1);
+	}
+    }
+  heap_set (rq, h, h->n++, i);
+  heap_sift_up (rq, h, h->n - 1);
+}
+
+/* Remove and return the process in slot POS of H.  */
+static uint32_t
+heap_remove (struct rr_queue *rq, struct median_heap *h, long pos)
+{
+  uint32_t i = h->slot[pos];
+  h->n--;
+  if (pos < h->n)
+    {
+      heap_set (rq, h, pos, h->slot[h->n]);
+      heap_sift_up (rq, h, pos);
+      heap_sift_down (rq, h, rq->state[h->slot[pos]].se.rr.pos);
+    }
+  return i;
+}
+
+/* Restore the sizes of the halves after an insertion or removal.  */
+static void
+median_rebalance (struct rr_queue *rq)
+{
+  if (rq->lower.n > rq->upper.n + 1)
+    heap_push (rq, &rq->upper, heap_remove (rq, &rq->lower, 0));
+  else if (rq->upper.n > rq->lower.n)
+    heap_push (rq, &rq->lower, heap_remove (rq, &rq->upper, 0));
+}
+
+static void
+median_insert (struct rr_queue *rq, uint32_t i)
+{
+  if (rq->lower.n == 0 || cpu_time (rq, i) <= cpu_time (rq, rq->lower.slot[0]))
+    heap_push (rq, &rq->lower, i);
+  else
+    heap_push (rq, &rq->upper, i);
+  median_rebalance (rq);
+}
+
+static void
+median_remove (struct rr_queue *rq, uint32_t i)
+{
+  struct process_state *p = &rq->state[i];
+  heap_remove (rq, p->se.rr.upper ? &rq->upper : &rq->lower, p->se.rr.pos);
+  median_rebalance (rq);
+}
+
+/* Add queued process I to the ring, and to the halves if they are
+   kept.  */
+static void
+rr_push_back (struct rr_queue *rq, uint32_t i)
+{
+  ring_push_back (&rq->ring, i);
+  if (rq->quantum_length == -1)
+    median_insert (rq, i);
+}
+
+/* Return the median CPU time of the queued processes, rounded as the
+   original round robin did, and at least 1.  */
+static long
+compute_median (struct rr_queue *rq)
+{
+  long median = 0;
+  long n = rq->lower.n + rq->upper.n;
+
+  if (n % 2 != 0)
+    median = cpu_time (rq, rq->lower.slot[0]);
+  else if (n != 0)
+    {
+      long sum = cpu_time (rq, rq->lower.slot[0])
+		 + cpu_time (rq, rq->upper.slot[0]);
+      if (sum % 2 == 0)
+	median = sum / 2;
+      else
+	{
+	  median = (sum + 1) / 2;
+	  if (median % 2 == 1)
+	    median--;
+	}
+    }
+
+  if (median == 0)
+    return 1;
+  return median;
+}
+
+static void *
+rr_create (struct process_state *state, long quantum_length)
+{
+  struct rr_queue *rq = xcalloc (1, sizeof *rq);
+  rq->state = state;
+  ring_init (&rq->ring);
+  rq->quantum_length = quantum_length;
+  rq->new_time = -1;
+  rq->lower.max = true;
+  return rq;
+}
+
+static void
+rr_destroy (void *q)
+{
+  struct rr_queue *rq = q;
+  ring_free (&rq->ring);
+  free (rq->lower.slot);
+  free (rq->upper.slot);
+  free (rq);
+}
+
+static void
+rr_enqueue (void *q, struct process_state *p, long time)
+{
+  struct rr_queue *rq = q;
+  if (rq->new_time != time)
+    {
+      rq->nr_new = 0;
+      rq->new_time = time;
+    }
+  rr_push_back (rq, p - rq->state);
+  rq->nr_new++;
+}
+
+static struct process_state *
+rr_peek (void *q)
+{
+  struct rr_queue *rq = q;
+  return rq->ring.len ? &rq->state[ring_at (&rq->ring, 0)] : NULL;
+}
+
+static struct process_state *
+rr_pick_next (void *q, long time, long *slice)
+{
+  (void) time;
+  struct rr_queue *rq = q;
+  if (!rq->ring.len)
+    return NULL;
+
+  // Handle quantum length
+  if (rq->quantum_length == -1)
+    *slice = compute_median (rq);
+  else
+    *slice = rq->quantum_length;
+
+  /* Once the first of the new arrivals runs, nothing goes ahead of
+     the rest.  */
+  if (rq->nr_new == rq->ring.len)
+    rq->nr_new = 0;
+  uint32_t i = ring_pop_front (&rq->ring);
+  if (rq->quantum_length == -1)
+    median_remove (rq, i);
+  return &rq->state[i];
+}
+
+static bool
+rr_on_tick (void *q, struct process_state *curr, long time)
+{
+  (void) q;
+  (void) curr;
+  (void) time;
+  return false;
+}
+
+/* A process whose quantum expires goes back in line ahead of the
+   processes that arrived during its last tick, TIME - 1.  */
+static void
+rr_on_preempt (void *q, struct process_state *curr, long time)
+{
+  struct rr_queue *rq = q;
+  if (rq->nr_new && rq->new_time == time - 1)
+    {
+      ring_insert_before_last (&rq->ring, rq->nr_new, curr - rq->state);
+      if (rq->quantum_length == -1)
+	median_insert (rq, curr - rq->state);
+    }
+  else
+    rr_push_back (rq, curr - rq->state);
+}
+
+/* Migrate the process at the back of the line.  */
+static struct process_state *
+rr_steal (void *q, long time)
+{
+  (void) time;
+  struct rr_queue *rq = q;
+  if (!rq->ring.len)
+    return NULL;
+  if (rq->nr_new)
+    rq->nr_new--;
+  uint32_t i = ring_pop_back (&rq->ring);
+  if (rq->quantum_length == -1)
+    median_remove (rq, i);
+  return &rq->state[i];
+}
+
+struct sched_policy const policy_rr = {
+  "rr",
+  rr_create,
+  rr_destroy,
+  rr_enqueue,
+  rr_peek,
+  rr_pick_next,
+  rr_on_tick,
+  rr_on_preempt,
+  rr_steal,
+};
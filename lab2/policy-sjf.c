@@ -0,0 +1,183 @@
+#include "policy.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Shortest job first and shortest remaining time first: a binary
+   min-heap keyed by remaining time, ties broken by arrival time and
+   then by position in the process table.  Only the running process's
+   remaining time ever changes, and it is never in the heap, so keys
+   are stable while queued.  */
+struct sjf_queue
+{
+  struct process_state **heap;
+  long n;
+  long capacity;
+  bool preemptive;
+};
+
+static bool
+sjf_before (struct process_state const *a, struct process_state const *b)
+{
+  if (a->remaining_time != b->remaining_time)
+    return a->remaining_time < b->remaining_time;
+  if (a->arrival_time != b->arrival_time)
+    return a->arrival_time < b->arrival_time;
+  return a < b;
+}
+
+static void
+sjf_push (struct sjf_queue *rq, struct process_state *p)
+{
+  if (rq->n == rq->capacity)
+    {
+      rq->capacity = rq->capacity ? 2 * rq->capacity : 64;
+      rq->heap = realloc (rq->heap, rq->capacity * sizeof *rq->heap);
+      if (!rq->heap)
+	{
+	  perror ("realloc");
+	  exit (1);
+	}
+    }
+  long i = rq->n++;
+  while (i > 0)
+    {
+      long parent = (i - 1) / 2;
+      if (!sjf_before (p, rq->heap[parent]))
+	break;
+      rq->heap[i] = rq->heap[parent];
+      i = parent;
+    }
+  rq->heap[i] = p;
+}
+
+static struct process_state *
+sjf_pop (struct sjf_queue *rq)
+{
+  struct process_state *top = rq->heap[0];
+  struct process_state *last = rq->heap[--rq->n];
+  long i = 0;
+  for (;;)
+    {
+      long child = 2 * i + 1;
+      if (child >= rq->n)
+	break;
+      if (child + 1 < rq->n && sjf_before (rq->heap[child + 1], rq->heap[child]))
+	child++;
+      if (!sjf_before (rq->heap[child], last))
+	break;
+      rq->heap[i] = rq->heap[child];
+      i = child;
+    }
+  if (rq->n > 0)
+    rq->heap[i] = last;
+  return top;
+}
+
+static struct sjf_queue *
+sjf_alloc (bool preemptive)
+{
+  struct sjf_queue *rq = xcalloc (1, sizeof *rq);
+  rq->preemptive = preemptive;
+  return rq;
+}
+
+static void *
+sjf_create (struct process_state *state, long quantum_length)
+{
+  (void) state;
+  (void) quantum_length;
+  return sjf_alloc (false);
+}
+
+static void *
+srtf_create (struct process_state *state, long quantum_length)
+{
+  (void) state;
+  (void) quantum_length;
+  return sjf_alloc (true);
+}
+
+static void
+sjf_destroy (void *q)
+{
+  struct sjf_queue *rq = q;
+  free (rq->heap);
+  free (rq);
+}
+
+static void
+sjf_enqueue (void *q, struct process_state *p, long time)
+{
+  (void) time;
+  sjf_push (q, p);
+}
+
+static struct process_state *
+sjf_peek (void *q)
+{
+  struct sjf_queue *rq = q;
+  return rq->n ? rq->heap[0] : NULL;
+}
+
+static struct process_state *
+sjf_pick_next (void *q, long time, long *slice)
+{
+  (void) time;
+  struct sjf_queue *rq = q;
+  if (rq->n == 0)
+    return NULL;
+  *slice = LONG_MAX;
+  return sjf_pop (rq);
+}
+
+/* Under SRTF, an arrival with less work left than CURR takes the CPU.  */
+static bool
+sjf_on_tick (void *q, struct process_state *curr, long time)
+{
+  (void) time;
+  struct sjf_queue *rq = q;
+  return (rq->preemptive && rq->n
+	  && rq->heap[0]->remaining_time < curr->remaining_time);
+}
+
+static void
+sjf_on_preempt (void *q, struct process_state *curr, long time)
+{
+  (void) time;
+  sjf_push (q, curr);
+}
+
+/* Migrate the last leaf; removing it leaves a valid heap.  */
+static struct process_state *
+sjf_steal (void *q, long time)
+{
+  (void) time;
+  struct sjf_queue *rq = q;
+  return rq->n ? rq->heap[--rq->n] : NULL;
+}
+
+struct sched_policy const policy_sjf = {
+  "sjf",
+  sjf_create,
+  sjf_destroy,
+  sjf_enqueue,
+  sjf_peek,
+  sjf_pick_next,
+  sjf_on_tick,
+  sjf_on_preempt,
+  sjf_steal,
+};
+
+struct sched_policy const policy_srtf = {
+  "srtf",
+  srtf_create,
+  sjf_destroy,
+  sjf_enqueue,
+  sjf_peek,
+  sjf_pick_next,
+  sjf_on_tick,
+  sjf_on_preempt,
+  sjf_steal,
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A process table entry.  This is shared read-only between
+   simulation runs; per-run accounting lives in struct process_state.  */
+struct process
+{
+  long pid;
+  long arrival_time;
+  long burst_time;
+};
+
+/* A vector of processes of length NPROCESSES; the vector consists of
+   PROCESS[0], ..., PROCESS[NPROCESSES - 1].  ARRIVAL_ORDER holds the
+   same indices sorted by arrival time, ties broken by file order.  */
+struct process_set
+{
+  long nprocesses;
+  struct process *process;
+  long *arrival_order;
+};
+
+/* The accounting state of one process within one simulation run.
+   Run queues refer to processes by their 32-bit index in the run's
+   state vector rather than by pointer where they can.  */
+struct process_state
+{
+  /* Fields the tick loop touches, first and together.  BURST_TIME and
+     ARRIVAL_TIME are copies from the process table, so the loop never
+     chases PROCESS.  */
+  long remaining_time;
+  long burst_time;
+  long arrival_time;
+  long response_time;
+
+  long waiting_time;
+
+  /* Times it left the CPU before finishing.  */
+  long context_switches;
+
+  struct process const *process;
+
+  /* Policy-private scheduling state, like the kernel's sched_entity.
+     It lives here rather than in per-queue tables so that a process
+     can migrate between CPUs' run queues.  */
+  union
+  {
+    struct
+    {
+      uint32_t pos;
+      bool upper;
+    } rr;
+    struct
+    {
+      uint32_t next;
+      uint32_t prev;
+      int level;
+      long epoch;
+      bool migrated;
+    } mlfq;
+    struct
+    {
+      struct process_state *left;
+      struct process_state *right;
+      struct process_state *parent;
+      long vruntime;
+      bool red;
+    } cfs;
+  } se;
+};
+
+/* A scheduling policy.  The simulator owns the clock and the CPUs; the
+   policy owns each CPU's run queue and decides who runs next and for
+   how long.  All hooks receive a run queue returned by CREATE.  */
+struct sched_policy
+{
+  char const *name;
+
+  /* Return an empty run queue for processes in the state vector STATE.
+     QUANTUM_LENGTH is the quantum given on the command line, or -1 for
+     "median".  Report an error and exit on failure.  */
+  void *(*create) (struct process_state *state, long quantum_length);
+  void (*destroy) (void *rq);
+
+  /* P arrived at TIME, or migrated to this queue at TIME, and is
+     runnable.  */
+  void (*enqueue) (void *rq, struct process_state *p, long time);
+
+  /* Return the process PICK_NEXT would choose without removing it, or
+     NULL if the run queue is empty.  */
+  struct process_state *(*peek) (void *rq);
+
+  /* Remove and return the next process to run at TIME, or NULL if the
+     run queue is empty.  Store its time slice into *SLICE.  */
+  struct process_state *(*pick_next) (void *rq, long time, long *slice);
+
+  /* CURR holds the CPU at the start of tick TIME, after that tick's
+     arrivals were enqueued.  Return true to preempt it before it runs
+     the tick.  */
+  bool (*on_tick) (void *rq, struct process_state *curr, long time);
+
+  /* CURR left the CPU at TIME without finishing, either because its
+     slice expired or because ON_TICK preempted it.  Requeue it.  */
+  void (*on_preempt) (void *rq, struct process_state *curr, long time);
+
+  /* Remove and return a queued process for an idle CPU to take over at
+     TIME, preferring the one this queue would run last, or NULL if
+     the queue is empty.  */
+  struct process_state *(*steal) (void *rq, long time);
+};
+
+extern struct sched_policy const policy_rr;
+extern struct sched_policy const policy_fcfs;
+extern struct sched_policy const policy_sjf;
+extern struct sched_policy const policy_srtf;
+extern struct sched_policy const policy_mlfq;
+extern struct sched_policy const policy_cfs;
+
+/* Allocate N zeroed objects of SIZE bytes.  Report an error and exit
+   on failure.  */
+void *xcalloc (long n, long size);
@@ -0,0 +1,52 @@
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RING_MIN_CAPACITY 64
+
+/* An empty ring has a capacity of 0, so its first push grows it.  MASK
+   is then UINT32_MAX, which makes LEN == MASK + 1 hold.  */
+void
+ring_init (struct ring *r)
+{
+  *r = (struct ring) {NULL, UINT32_MAX, 0, 0};
+}
+
+void
+ring_free (struct ring *r)
+{
+  free (r->slot);
+  ring_init (r);
+}
+
+/* Unwrap the contents to the start of a buffer twice the size.  */
+void
+ring_grow (struct ring *r)
+{
+  uint32_t capacity = r->mask + 1;
+  uint32_t new_capacity = capacity ? 2 * capacity : RING_MIN_CAPACITY;
+  uint32_t *slot = malloc ((size_t) new_capacity * sizeof *slot);
+  if (!slot)
+    {
+      perror ("malloc");
+      exit (1);
+    }
+  for (uint32_t i = 0; i < r->len; i++)
+    slot[i] = ring_at (r, i);
+  free (r->slot);
+  r->slot = slot;
+  r->mask = new_capacity - 1;
+  r->head = 0;
+}
+
+void
+ring_insert_before_last (struct ring *r, uint32_t k, uint32_t v)
+{
+  if (r->len == r->mask + 1)
+    ring_grow (r);
+  for (uint32_t i = r->len; i > r->len - k; i--)
+    r->slot[(r->head + i) & r->mask] = r->slot[(r->head + i - 1) & r->mask];
+  r->slot[(r->head + r->len - k) & r->mask] = v;
+  r->len++;
+}
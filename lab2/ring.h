@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+/* A double-ended queue of 32-bit process indices in a power-of-two
+   ring buffer that grows on demand.  Four bytes per queued process, in
+   one contiguous block, instead of a pair of list pointers in every
+   process.  */
+struct ring
+{
+  uint32_t *slot;
+  uint32_t mask;
+  uint32_t head;
+  uint32_t len;
+};
+
+void ring_init (struct ring *r);
+void ring_free (struct ring *r);
+
+/* Double the capacity of full R.  */
+void ring_grow (struct ring *r);
+
+/* Insert V so that the last K elements of R come after it.  */
+void ring_insert_before_last (struct ring *r, uint32_t k, uint32_t v);
+
+/* Return element I of R, counting from the front.  */
+static inline uint32_t
+ring_at (struct ring const *r, uint32_t i)
+{
+  return r->slot[(r->head + i) & r->mask];
+}
+
+static inline void
+ring_push_back (struct ring *r, uint32_t v)
+{
+  if (r->len == r->mask + 1)
+    ring_grow (r);
+  r->slot[(r->head + r->len) & r->mask] = v;
+  r->len++;
+}
+
+static inline void
+ring_push_front (struct ring *r, uint32_t v)
+{
+  if (r->len == r->mask + 1)
+    ring_grow (r);
+  r->head = (r->head - 1) & r->mask;
+  r->slot[r->head] = v;
+  r->len++;
+}
+
+/* Remove and return the front or back element of nonempty R.  */
+static inline uint32_t
+ring_pop_front (struct ring *r)
+{
+  uint32_t v = r->slot[r->head];
+  r->head = (r->head + 1) & r->mask;
+  r->len--;
+  return v;
+}
+
+static inline uint32_t
+ring_pop_back (struct ring *r)
+{
+  r->len--;
+  return r->slot[(r->head + r->len) & r->mask];
+}
@@ -1,32 +1,19 @@
+#include "policy.h"
+
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdckdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <sys/queue.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-/* A process table entry.  */
-struct process
-{
-  long pid;
-  long arrival_time;
-  long burst_time;
-
-  TAILQ_ENTRY (process) pointers;
-
-  /* Additional fields here */
-  long remaining_time;
-  long waiting_time;
-  long response_time;
-  /* End of "Additional fields here" */
-};
-
-TAILQ_HEAD (process_list, process);
-
 /* Skip past initial nondigits in *DATA, then scan an unsigned decimal
    integer and return its value.  Do not scan past DATA_END.  Return
    the integer’s value.  Report an error and exit if no integer is
@@ -73,14 +60,52 @@ next_int_from_c_str (char const *data)
   return next_int (&data, strchr (data, 0));
 }
 
-/* A vector of processes of length NPROCESSES; the vector consists of
-   PROCESS[0], ..., PROCESS[NPROCESSES - 1].  */
-struct process_set
+void *
+xcalloc (long n, long size)
 {
-  long nprocesses;
-  struct process *process;
+  void *p = calloc (n, size);
+  if (!p)
+    {
+      perror ("calloc");
+      exit (1);
+    }
+  return p;
+}
+
+/* A process index keyed by arrival time, for sorting.  */
+struct arrival
+{
+  long arrival_time;
+  long index;
 };
 
+static int
+compare_arrivals (void const *a, void const *b)
+{
+  struct arrival const *x = a;
+  struct arrival const *y = b;
+  if (x->arrival_time != y->arrival_time)
+    return x->arrival_time < y->arrival_time ? -1 : 1;
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+/* Return the indices of the NPROCESSES processes in PROCESS sorted by
+   arrival time, ties broken by file order.  */
+static long *
+sort_by_arrival (long nprocesses, struct process const *process)
+{
+  struct arrival *arrival = xcalloc (nprocesses, sizeof *arrival);
+  for (long i = 0; i < nprocesses; i++)
+    arrival[i] = (struct arrival) {process[i].arrival_time, i};
+  qsort (arrival, nprocesses, sizeof *arrival, compare_arrivals);
+
+  long *order = xcalloc (nprocesses, sizeof *order);
+  for (long i = 0; i < nprocesses; i++)
+    order[i] = arrival[i].index;
+  free (arrival);
+  return order;
+}
+
 /* Return a vector of processes scanned from the file named FILENAME.
    Report an error and exit on failure.  */
 static struct process_set
@@ -123,6 +148,12 @@ init_processes (char const *filename)
       fprintf (stderr, "no processes\n");
       exit (1);
     }
+  // Run queues hold 32-bit process indices
+  if (nprocesses >= UINT32_MAX)
+    {
+      fprintf (stderr, "%ld: too many processes\n", nprocesses);
+      exit (1);
+    }
 
   struct process *process = calloc (sizeof *process, nprocesses);
   if (!process)
@@ -136,11 +167,6 @@ init_processes (char const *filename)
       process[i].pid = next_int (&data, data_end);
       process[i].arrival_time = next_int (&data, data_end);
       process[i].burst_time = next_int (&data, data_end);
-      /* START of user added code */
-      process[i].remaining_time = process[i].burst_time;
-      process[i].waiting_time = 0;
-      process[i].response_time = 0;
-      /* END of user added code */
 
       if (process[i].burst_time == 0)
 	{
@@ -160,221 +186,885 @@ init_processes (char const *filename)
       perror ("close");
       exit (1);
     }
-  return (struct process_set) {nprocesses, process};
+  return (struct process_set) {nprocesses, process,
+			       sort_by_arrival (nprocesses, process)};
 }
 
-long
-compare_longs(const void *a, const void *b) {
-  return (*(long *)a - *(long *)b);
+/* How to simulate: the scheduling policy, the number of CPUs and the
+   number of ticks a context switch costs.  */
+struct sim_config
+{
+  struct sched_policy const *policy;
+  long ncpus;
+  long switch_cost;
+
+  /* Whether to compute latency percentiles.  */
+  bool percentiles;
+
+  /* Where to write the dispatch timeline, or null.  */
+  FILE *timeline;
+};
+
+/* Why a run on a CPU ended.  */
+enum run_end
+{
+  RUN_EXPIRE,
+  RUN_EXIT,
+  RUN_PREEMPT,
+  RUN_SWITCH
+};
+
+static char const *const run_end_name[] = {
+  [RUN_EXPIRE] = "expire",
+  [RUN_EXIT] = "exit",
+  [RUN_PREEMPT] = "preempt",
+  [RUN_SWITCH] = "switch",
+};
+
+/* A run of one process on a CPU from START to END.  It is held back
+   from the timeline while the same process might be dispatched again
+   at END, so that back-to-back quanta form one interval.  */
+struct pending_run
+{
+  long pid;
+  long start;
+  long end;
+  enum run_end reason;
+  bool valid;
+};
+
+/* One simulated CPU and its run queue.  */
+struct cpu
+{
+  long id;
+  void *rq;
+  long nr_queued;
+  struct process_state *curr;
+  struct process_state *prev;
+  long slice;
+
+  /* Ticks of an ongoing context switch still to be paid.  */
+  long switch_left;
+
+  long busy_ticks;
+  long switch_ticks;
+
+  /* When CURR's timeline interval began, and the last run not yet
+     written.  */
+  long since;
+  struct pending_run pending;
+};
+
+/* Write C's held-back run, if any, to TIMELINE.  */
+static void
+timeline_flush (FILE *timeline, struct cpu *c)
+{
+  if (!c->pending.valid)
+    return;
+  fprintf (timeline, "%ld,%ld,%ld,%ld,%s\n", c->id, c->pending.pid,
+	   c->pending.start, c->pending.end, run_end_name[c->pending.reason]);
+  c->pending.valid = false;
 }
 
-long
-compute_median(struct process_list *pl) {
-  double median = 0;
-
-  if (!TAILQ_EMPTY(pl)) {
-    // Populate array with CPU Times
-    long n = 0;
-    struct process *temp;
-    TAILQ_FOREACH(temp, pl, pointers) {
-      n++;
-    }
-
-    long* cpu_times = malloc(sizeof(long) * n);
-    int i = 0;
-    TAILQ_FOREACH(temp, pl, pointers) {
-      cpu_times[i++] = temp->burst_time - temp->remaining_time;
-    }
-
-    qsort(cpu_times, n, sizeof(long), compare_longs);
-
-    // Go to the middle of the sorted array to find median
-    // if (n % 2 != 0) {
-    //   median = cpu_times[n / 2];
-    // } else { // Median is a calculation between two numbers
-    //   median = (cpu_times[(n/2) - 1] + cpu_times[(n/2)]) / 2.0;
-
-    //   // Round to nearest even number
-    //   long truncated = (long)median;
-    //   if (median - truncated != 0) {
-    //     if (truncated % 2 == 0)
-    //       median = truncated;
-    //     else
-    //       median = truncated + 1;
-    //   }
-    // }
-    if (n % 2 != 0) {
-      median = cpu_times[n / 2];
-    } else { // Median is a calculation between two numbers
-      bool is_even = (cpu_times[n / 2] + cpu_times[(n / 2) - 1]) % 2 == 0;
-      if (is_even)
-        median = ((cpu_times[n / 2] + cpu_times[(n / 2) - 1]) / 2);
-      else {
-        median = ((cpu_times[n / 2] + cpu_times[(n / 2) - 1] + 1) / 2);
-        if ((long)median % 2 == 1)
-          median--;
-      }
+/* C dispatches P at TIME.  If P is the process C held back and it
+   left at TIME, continue that interval.  */
+static void
+timeline_dispatch (FILE *timeline, struct cpu *c, struct process_state *p,
+		   long time)
+{
+  if (!timeline)
+    return;
+  if (c->pending.valid && c->pending.pid == p->process->pid
+      && c->pending.end == time)
+    {
+      c->since = c->pending.start;
+      c->pending.valid = false;
     }
+  else
+    {
+      timeline_flush (timeline, c);
+      c->since = time;
+    }
+}
 
-    free(cpu_times);
-  }
+/* C's current process leaves the CPU at TIME for REASON.  */
+static void
+timeline_leave (FILE *timeline, struct cpu *c, long time,
+		enum run_end reason)
+{
+  if (!timeline)
+    return;
+  c->pending = (struct pending_run) {c->curr->process->pid, c->since, time,
+				     reason, true};
+}
 
-  if ((long)median == 0)
-    return 1;
-  return (long)median;
+/* C starts a context switch at TIME that lasts COST ticks.  */
+static void
+timeline_switch (FILE *timeline, struct cpu *c, long time, long cost)
+{
+  if (!timeline)
+    return;
+  timeline_flush (timeline, c);
+  fprintf (timeline, "%ld,,%ld,%ld,%s\n", c->id, time, time + cost,
+	   run_end_name[RUN_SWITCH]);
 }
 
-int
-main (int argc, char *argv[])
+/* What a CPU did over a run.  */
+struct cpu_stats
+{
+  long busy_ticks;
+  long switch_ticks;
+};
+
+/* Nearest-rank percentiles of a latency distribution.  */
+struct latency_summary
+{
+  long p50;
+  long p90;
+  long p99;
+};
+
+/* The outcome of one simulation run.  The summaries are filled in only
+   if the run's configuration asks for percentiles.  */
+struct sim_result
+{
+  long quantum_length;
+  long total_wait_time;
+  long total_response_time;
+  long end_time;
+  long busy_ticks;
+
+  /* Arrivals, dispatches and departures processed.  */
+  long events;
+
+  struct latency_summary wait;
+  struct latency_summary response;
+  struct latency_summary turnaround;
+};
+
+static int
+compare_longs (void const *a, void const *b)
 {
-  if (argc != 3)
+  long x = *(long const *) a;
+  long y = *(long const *) b;
+  return (x > y) - (x < y);
+}
+
+/* Sort the N values in VALUES and return their percentiles.  */
+static struct latency_summary
+summarize (long *values, long n)
+{
+  qsort (values, n, sizeof *values, compare_longs);
+  return (struct latency_summary) {values[(n * 50 + 99) / 100 - 1],
+				   values[(n * 90 + 99) / 100 - 1],
+				   values[(n * 99 + 99) / 100 - 1]};
+}
+
+/* Return the CPU with the fewest runnable processes.  */
+static struct cpu *
+least_loaded (struct cpu *cpus, long ncpus)
+{
+  struct cpu *best = &cpus[0];
+  long best_load = LONG_MAX;
+  for (long i = 0; i < ncpus; i++)
     {
-      fprintf (stderr, "%s: usage: %s file quantum\n", argv[0], argv[0]);
-      return 1;
+      long load = cpus[i].nr_queued + (cpus[i].curr != NULL);
+      if (load < best_load)
+	{
+	  best = &cpus[i];
+	  best_load = load;
+	}
     }
+  return best;
+}
 
-  struct process_set ps = init_processes (argv[1]);
-  long quantum_length = (strcmp (argv[2], "median") == 0 ? -1
-			 : next_int_from_c_str (argv[2]));
-  if (quantum_length == 0)
+/* Move a queued process from the CPU with the longest run queue onto
+   idle CPU C's queue at TIME.  Return true if there was one to take.  */
+static bool
+steal_work (struct sched_policy const *policy, struct cpu *cpus,
+	    long ncpus, struct cpu *c, long time)
+{
+  struct cpu *victim = NULL;
+  for (long i = 0; i < ncpus; i++)
+    if (cpus[i].nr_queued > 0
+	&& (!victim || cpus[i].nr_queued > victim->nr_queued))
+      victim = &cpus[i];
+  if (!victim)
+    return false;
+
+  struct process_state *p = policy->steal (victim->rq, time);
+  victim->nr_queued--;
+  policy->enqueue (c->rq, p, time);
+  c->nr_queued++;
+  return true;
+}
+
+/* Simulate scheduling PS on CONFIG->ncpus CPUs under CONFIG->policy
+   with QUANTUM_LENGTH, or with the median quantum if QUANTUM_LENGTH is
+   -1.  Each CPU has its own run queue; arrivals go to the least loaded
+   CPU and an idle CPU steals from the longest queue.  STATE must have
+   room for PS->nprocesses entries; it is overwritten, so a run never
+   writes to the shared process table.  If CPU_STATS is not null, it
+   receives one entry per CPU.  */
+static struct sim_result
+simulate (struct process_set const *ps, struct sim_config const *config,
+	  long quantum_length, struct process_state *state,
+	  struct cpu_stats *cpu_stats)
+{
+  for (long i = 0; i < ps->nprocesses; i++)
     {
-      fprintf (stderr, "%s: zero quantum length\n", argv[0]);
-      return 1;
+      state[i] = (struct process_state) {
+	.remaining_time = ps->process[i].burst_time,
+	.burst_time = ps->process[i].burst_time,
+	.arrival_time = ps->process[i].arrival_time,
+	.process = &ps->process[i],
+      };
     }
 
-  struct process_list list;
-  TAILQ_INIT (&list);
-
-  long total_wait_time = 0;
-  long total_response_time = 0;
+  struct sched_policy const *policy = config->policy;
+  long ncpus = config->ncpus;
+  struct cpu *cpus = xcalloc (ncpus, sizeof *cpus);
+  for (long i = 0; i < ncpus; i++)
+    {
+      cpus[i].id = i;
+      cpus[i].rq = policy->create (state, quantum_length);
+    }
+  FILE *timeline = config->timeline;
+  long const *order = ps->arrival_order;
 
-  /* Your code here */
+  struct sim_result r = {.quantum_length = quantum_length};
   long time = 0;
-  long new_processes = 0;
-  long curr_quantum = 1; // 1 by default for median
-  bool non_zero_remaining_time = false;
-  bool context_switch = false;
-  struct process* curr_process = NULL;
-  struct process* prev_process = NULL;
-  struct process* first_new = NULL;
-
-  struct process_list temp_list;
-  TAILQ_INIT (&temp_list);
-
-  for (;;) {
-    // Add on any new arriving processes
-    new_processes = 0;
-    first_new = NULL;
-    for (int i = 0; i < ps.nprocesses; i++) {
-      if (time == ps.process[i].arrival_time) {
-        if (first_new == NULL)
-          first_new = &ps.process[i];
-        TAILQ_INSERT_TAIL(&list, &ps.process[i], pointers);
-        // printf("New arrival: %d at t=%d", (long)ps.process[i].pid, time);
-        // new_processes += 1;
-      }
+  long next_arrival = 0;
+  long next_arrival_time = state[order[0]].arrival_time;
+  long finished = 0;
+
+  while (finished < ps->nprocesses)
+    {
+      // Add on any new arriving processes
+      for (; next_arrival_time <= time; next_arrival++)
+	{
+	  struct cpu *c = least_loaded (cpus, ncpus);
+	  policy->enqueue (c->rq, &state[order[next_arrival]], time);
+	  c->nr_queued++;
+	  r.events++;
+	  next_arrival_time = (next_arrival + 1 < ps->nprocesses
+			       ? state[order[next_arrival + 1]].arrival_time
+			       : LONG_MAX);
+	}
+
+      bool active = false;
+      for (long i = 0; i < ncpus; i++)
+	{
+	  struct cpu *c = &cpus[i];
+
+	  if (c->switch_left > 0)
+	    {
+	      c->switch_left--;
+	      c->switch_ticks++;
+	      active = true;
+	      continue;
+	    }
+
+	  if (c->curr && policy->on_tick (c->rq, c->curr, time))
+	    {
+	      c->curr->context_switches++;
+	      r.events++;
+	      timeline_leave (timeline, c, time, RUN_PREEMPT);
+	      policy->on_preempt (c->rq, c->curr, time);
+	      c->nr_queued++;
+	      c->prev = c->curr;
+	      c->curr = NULL;
+	    }
+
+	  // Schedule new process!
+	  if (!c->curr)
+	    {
+	      struct process_state *next = policy->peek (c->rq);
+	      if (!next && steal_work (policy, cpus, ncpus, c, time))
+		next = policy->peek (c->rq);
+	      if (!next)
+		{
+		  // No context switch after an empty interval
+		  c->prev = NULL;
+		  if (timeline)
+		    timeline_flush (timeline, c);
+		  continue;
+		}
+
+	      // Context switches
+	      if (c->prev && c->prev->process->pid != next->process->pid)
+		{
+		  c->prev = NULL;
+		  if (config->switch_cost > 0)
+		    {
+		      timeline_switch (timeline, c, time, config->switch_cost);
+		      c->switch_left = config->switch_cost - 1;
+		      c->switch_ticks++;
+		      active = true;
+		      continue;
+		    }
+		}
+
+	      c->curr = policy->pick_next (c->rq, time, &c->slice);
+	      c->nr_queued--;
+	      r.events++;
+	      timeline_dispatch (timeline, c, c->curr, time);
+	    }
+
+	  // Calculate response time for current process if necessary
+	  struct process_state *p = c->curr;
+	  if (p->burst_time == p->remaining_time)
+	    {
+	      p->response_time = time - p->arrival_time;
+	      r.total_response_time += p->response_time;
+	    }
+
+	  c->slice--;
+	  p->remaining_time--;
+	  c->busy_ticks++;
+	  active = true;
+	}
+
+      if (!active)
+	{
+	  // Every CPU is idle until the next arrival
+	  time = next_arrival_time;
+	  continue;
+	}
+
+      time++;
+
+      // Check if process finished executing or quantum time finished
+      for (long i = 0; i < ncpus; i++)
+	{
+	  struct cpu *c = &cpus[i];
+	  struct process_state *p = c->curr;
+	  if (!p)
+	    continue;
+	  if (p->remaining_time == 0)
+	    {
+	      p->waiting_time = time - p->arrival_time - p->burst_time;
+	      r.total_wait_time += p->waiting_time;
+	      finished++;
+	      timeline_leave (timeline, c, time, RUN_EXIT);
+	    }
+	  else if (c->slice <= 0)
+	    {
+	      p->context_switches++;
+	      timeline_leave (timeline, c, time, RUN_EXPIRE);
+	      policy->on_preempt (c->rq, p, time);
+	      c->nr_queued++;
+	    }
+	  else
+	    continue;
+	  r.events++;
+	  c->prev = p;
+	  c->curr = NULL;
+	}
     }
 
-    // Schedule new process!
-    if (!TAILQ_EMPTY(&list) && curr_process == NULL) {
-        // Context switches
-        if (prev_process != NULL && prev_process->pid != TAILQ_FIRST(&list)->pid) {
-            time++;
-            prev_process = NULL;
-            context_switch = true;
-            continue;
-        }
-
-        // Handle quantum length
-        if (quantum_length == -1)
-          curr_quantum = compute_median(&list);
-        else
-          curr_quantum = quantum_length;
-
-        // Schedule new process
-        curr_process = TAILQ_FIRST(&list);
-        TAILQ_REMOVE(&list, curr_process, pointers);
-
-        // if (context_switch == true) {
-        //   context_switch = false;
-        //   continue;
-        // }
-
-        if (curr_process->arrival_time == time)
-          new_processes--;
-    } else
-      prev_process = NULL; // Make sure a context switch is not done after an empty interval
-
-    // Calculate response time for current process if necessary
-    if (curr_process != NULL && curr_process->burst_time == curr_process->remaining_time)
-        curr_process->response_time = time - curr_process->arrival_time;
-
-    if (curr_process != NULL) {
-        curr_quantum--;
-        curr_process->remaining_time--;
-    }
-
-    time++;
-
-    // Check if process finished executing or quantum time finished
-    if (curr_process != NULL) {
-      if (curr_process->remaining_time <= 0 || curr_quantum <= 0) {
-        if (curr_process->remaining_time == 0)
-          curr_process->waiting_time = time - curr_process->arrival_time - curr_process->burst_time;
-        else {
-            // printf("|%d|", new_processes);
-            // for (int i = 0; i < new_processes; i++) {
-            //   struct process* last_item = TAILQ_LAST(&list, process_list);
-            //   TAILQ_REMOVE(&list, last_item, pointers);
-            //   // printf("Popped\n");
-            //   printf("%d", last_item->pid);
-            //   TAILQ_INSERT_TAIL(&temp_list, last_item, pointers);
-            // }
-            // printf("Reinserted: %d at t=%d\n", (int)curr_process->pid, time - 1);
-            // TAILQ_INSERT_TAIL(&list, curr_process, pointers);
-            // while (!TAILQ_EMPTY(&temp_list)) {
-            //   struct process* first_item = TAILQ_FIRST(&temp_list);
-            //   TAILQ_REMOVE(&temp_list, TAILQ_FIRST(&temp_list), pointers);
-            //   TAILQ_INSERT_TAIL(&list, first_item, pointers);
-            //   // printf("Replaced\n");
-            // }
-            if (first_new != NULL) {
-              if (first_new == curr_process)
-                TAILQ_INSERT_TAIL(&list, curr_process, pointers);
-              else
-                TAILQ_INSERT_BEFORE(first_new, curr_process, pointers);
-            } else
-              TAILQ_INSERT_TAIL(&list, curr_process, pointers);
-        }
-        prev_process = curr_process;
-        curr_process = NULL;
-      }
+  for (long i = 0; i < ncpus; i++)
+    {
+      if (timeline)
+	timeline_flush (timeline, &cpus[i]);
+      policy->destroy (cpus[i].rq);
+      r.busy_ticks += cpus[i].busy_ticks;
+      if (cpu_stats)
+	cpu_stats[i] = (struct cpu_stats) {cpus[i].busy_ticks,
+					   cpus[i].switch_ticks};
+    }
+  free (cpus);
+
+  r.end_time = time;
+
+  if (config->percentiles)
+    {
+      long n = ps->nprocesses;
+      long *values = xcalloc (n, sizeof *values);
+      for (long i = 0; i < n; i++)
+	values[i] = state[i].waiting_time;
+      r.wait = summarize (values, n);
+      for (long i = 0; i < n; i++)
+	values[i] = state[i].response_time;
+      r.response = summarize (values, n);
+      for (long i = 0; i < n; i++)
+	values[i] = state[i].waiting_time + state[i].burst_time;
+      r.turnaround = summarize (values, n);
+      free (values);
+    }
+  return r;
+}
+
+/* Return the current time in seconds, for throughput reports.  */
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+    {
+      perror ("clock_gettime");
+      exit (1);
+    }
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Report on standard error how fast TICKS simulated ticks and EVENTS
+   scheduling events were processed in SECONDS of wall time.  */
+static void
+report_throughput (long ticks, long events, double seconds)
+{
+  fprintf (stderr,
+	   "Simulated %ld ticks and %ld events in %.3f s: "
+	   "%.0f ticks/s, %.0f events/s\n",
+	   ticks, events, seconds, ticks / seconds, events / seconds);
+}
+
+/* A quantum sweep: the shared, read-only process set, how and which
+   quanta to simulate and one result slot per quantum.  Workers claim
+   quanta by bumping NEXT.  */
+struct sweep
+{
+  struct process_set const *ps;
+  struct sim_config const *config;
+  long nquanta;
+  long const *quanta;
+  struct sim_result *results;
+  long next;
+};
+
+/* Worker thread for a sweep: simulate unclaimed quanta until none are
+   left, reusing one private state vector for every run.  */
+static void *
+sweep_worker (void *arg)
+{
+  struct sweep *sw = arg;
+  struct process_state *state = xcalloc (sw->ps->nprocesses, sizeof *state);
+
+  for (;;)
+    {
+      long i = __atomic_fetch_add (&sw->next, 1, __ATOMIC_RELAXED);
+      if (i >= sw->nquanta)
+	break;
+      sw->results[i] = simulate (sw->ps, sw->config, sw->quanta[i], state,
+				 NULL);
+    }
+
+  free (state);
+  return NULL;
+}
+
+/* Parse the sweep specification SPEC, a comma-separated list of
+   quanta, inclusive ranges LO..HI and "median", into a freshly
+   allocated vector.  Store its length into *NQUANTA.  Report an error
+   and exit on failure.  */
+static long *
+parse_sweep (char const *spec, long *nquanta)
+{
+  long n = 0;
+  long *quanta = NULL;
+  char const *end = strchr (spec, 0);
+
+  for (char const *p = spec; p < end; )
+    {
+      char const *comma = memchr (p, ',', end - p);
+      char const *item_end = comma ? comma : end;
+      long lo, hi;
+
+      if (item_end - p == 6 && memcmp (p, "median", 6) == 0)
+	lo = hi = -1;
+      else
+	{
+	  char const *d = p;
+	  lo = hi = next_int (&d, item_end);
+	  if (d + 2 <= item_end && d[0] == '.' && d[1] == '.')
+	    {
+	      d += 2;
+	      hi = next_int (&d, item_end);
+	    }
+	  if (d != item_end || lo == 0 || hi < lo)
+	    {
+	      fprintf (stderr, "%.*s: invalid sweep range\n",
+		       (int) (item_end - p), p);
+	      exit (1);
+	    }
+	}
+
+      long count = hi - lo + 1;
+      long *q = realloc (quanta, (n + count) * sizeof *quanta);
+      if (!q)
+	{
+	  perror ("realloc");
+	  exit (1);
+	}
+      quanta = q;
+      for (long v = lo; v <= hi; v++)
+	quanta[n++] = v;
+
+      p = comma ? comma + 1 : end;
+    }
+
+  if (n == 0)
+    {
+      fprintf (stderr, "empty sweep\n");
+      exit (1);
+    }
+  *nquanta = n;
+  return quanta;
+}
+
+/* Simulate every quantum in SPEC over PS as CONFIG says on NTHREADS
+   worker threads and print a table of the averages.  If STATS, report
+   throughput too.  Return the exit status.  */
+static int
+run_sweep (struct process_set const *ps, struct sim_config const *config,
+	   char const *spec, long nthreads, bool stats)
+{
+  struct sweep sw = {ps, config, 0, NULL, NULL, 0};
+  long *quanta = parse_sweep (spec, &sw.nquanta);
+  sw.quanta = quanta;
+  sw.results = xcalloc (sw.nquanta, sizeof *sw.results);
+
+  if (nthreads > sw.nquanta)
+    nthreads = sw.nquanta;
+  pthread_t *threads = xcalloc (nthreads, sizeof *threads);
+  double start = now_seconds ();
+  for (long i = 0; i < nthreads; i++)
+    {
+      int err = pthread_create (&threads[i], NULL, sweep_worker, &sw);
+      if (err != 0)
+	{
+	  fprintf (stderr, "pthread_create: %s\n", strerror (err));
+	  exit (1);
+	}
+    }
+  for (long i = 0; i < nthreads; i++)
+    {
+      int err = pthread_join (threads[i], NULL);
+      if (err != 0)
+	{
+	  fprintf (stderr, "pthread_join: %s\n", strerror (err));
+	  exit (1);
+	}
+    }
+
+  double elapsed = now_seconds () - start;
+
+  printf ("%8s %14s %14s %10s", "quantum", "avg wait", "avg response",
+	  "cpu util");
+  if (config->percentiles)
+    printf (" %10s %10s", "p99 wait", "p99 resp");
+  putchar ('\n');
+  for (long i = 0; i < sw.nquanta; i++)
+    {
+      struct sim_result const *r = &sw.results[i];
+      if (r->quantum_length == -1)
+	printf ("%8s", "median");
+      else
+	printf ("%8ld", r->quantum_length);
+      printf (" %14.2f %14.2f %9.2f%%",
+	      r->total_wait_time / (double) ps->nprocesses,
+	      r->total_response_time / (double) ps->nprocesses,
+	      100.0 * r->busy_ticks / ((double) r->end_time * config->ncpus));
+      if (config->percentiles)
+	printf (" %10ld %10ld", r->wait.p99, r->response.p99);
+      putchar ('\n');
+    }
+
+  if (stats)
+    {
+      long ticks = 0;
+      long events = 0;
+      for (long i = 0; i < sw.nquanta; i++)
+	{
+	  ticks += sw.results[i].end_time;
+	  events += sw.results[i].events;
+	}
+      report_throughput (ticks, events, elapsed);
+    }
+
+  free (threads);
+  free (sw.results);
+  free (quanta);
+  return 0;
+}
+
+/* Size of the stdio buffers for metrics and timeline output.  */
+#define EXPORT_BUFSIZ (1 << 20)
+
+/* Open the file named FILENAME for output, or return standard output
+   if FILENAME is "-".  Buffer it fully in BUF, which must hold
+   EXPORT_BUFSIZ bytes.  Report an error and exit on failure.  */
+static FILE *
+open_output (char const *filename, char *buf)
+{
+  if (strcmp (filename, "-") == 0)
+    return stdout;
+  FILE *f = fopen (filename, "w");
+  if (!f)
+    {
+      perror (filename);
+      exit (1);
+    }
+  setvbuf (f, buf, _IOFBF, EXPORT_BUFSIZ);
+  return f;
+}
+
+/* Flush F, which was opened as FILENAME by open_output, and close it
+   unless it is standard output.  Report an error and exit on
+   failure.  */
+static void
+close_output (FILE *f, char const *filename)
+{
+  if (f == stdout ? fflush (f) != 0 || ferror (f) : fclose (f) != 0)
+    {
+      perror (filename);
+      exit (1);
+    }
+}
+
+/* Write the per-process metrics in STATE, a vector of NPROCESSES
+   entries, to the file named FILENAME ("-" for standard output), as
+   JSON if JSON and as CSV otherwise.  Report an error and exit on
+   failure.  */
+static void
+export_metrics (char const *filename, bool json,
+		struct process_state const *state, long nprocesses)
+{
+  static char buf[EXPORT_BUFSIZ];
+  FILE *f = open_output (filename, buf);
+
+  if (json)
+    fputs ("[\n", f);
+  else
+    fputs ("pid,arrival_time,burst_time,waiting_time,response_time,"
+	   "turnaround_time,context_switches\n", f);
+
+  for (long i = 0; i < nprocesses; i++)
+    {
+      struct process_state const *p = &state[i];
+      long turnaround = p->waiting_time + p->process->burst_time;
+      if (json)
+	fprintf (f,
+		 "  {\"pid\": %ld, \"arrival_time\": %ld, \"burst_time\": %ld, "
+		 "\"waiting_time\": %ld, \"response_time\": %ld, "
+		 "\"turnaround_time\": %ld, \"context_switches\": %ld}%s\n",
+		 p->process->pid, p->process->arrival_time,
+		 p->process->burst_time, p->waiting_time, p->response_time,
+		 turnaround, p->context_switches,
+		 i + 1 < nprocesses ? "," : "");
+      else
+	fprintf (f, "%ld,%ld,%ld,%ld,%ld,%ld,%ld\n",
+		 p->process->pid, p->process->arrival_time,
+		 p->process->burst_time, p->waiting_time, p->response_time,
+		 turnaround, p->context_switches);
     }
 
-    // Check to see if all processes have finished
-    for (int i = 0; i < ps.nprocesses; i++) {
-      if (ps.process[i].remaining_time != 0) {
-        non_zero_remaining_time = true;
-        break;
+  if (json)
+    fputs ("]\n", f);
+
+  close_output (f, filename);
+}
+
+static void
+print_summary (char const *what, struct latency_summary s)
+{
+  printf ("%s p50/p90/p99: %ld / %ld / %ld\n", what, s.p50, s.p90, s.p99);
+}
+
+static struct sched_policy const *const policies[] = {
+  &policy_rr,
+  &policy_fcfs,
+  &policy_sjf,
+  &policy_srtf,
+  &policy_mlfq,
+  &policy_cfs,
+};
+
+/* Return the policy called NAME.  Report an error and exit if there
+   is none.  */
+static struct sched_policy const *
+find_policy (char const *name)
+{
+  for (size_t i = 0; i < sizeof policies / sizeof *policies; i++)
+    if (strcmp (policies[i]->name, name) == 0)
+      return policies[i];
+  fprintf (stderr, "%s: unknown policy (one of rr, fcfs, sjf, srtf, mlfq, cfs)\n",
+	   name);
+  exit (1);
+}
+
+static void
+usage (char const *prog)
+{
+  fprintf (stderr,
+	   "%s: usage: %s [OPTION]... file quantum\n"
+	   "       %s [OPTION]... [--threads N] --sweep LO..HI[,median,...] file\n"
+	   "Options:\n"
+	   "  --policy NAME       rr (default), fcfs, sjf, srtf, mlfq or cfs\n"
+	   "  --cpus N            simulate N CPUs with per-CPU run queues\n"
+	   "  --switch-cost N     ticks per context switch (default 1)\n"
+	   "  --percentiles       report p50/p90/p99 latencies\n"
+	   "  --csv FILE          export per-process metrics as CSV\n"
+	   "  --json FILE         export per-process metrics as JSON\n"
+	   "  --timeline FILE     write the dispatch timeline as CSV\n"
+	   "  --stats             report simulation throughput on stderr\n",
+	   prog, prog, prog);
+  exit (1);
+}
+
+static struct option const long_options[] = {
+  {"cpus", required_argument, NULL, 'c'},
+  {"csv", required_argument, NULL, 'C'},
+  {"json", required_argument, NULL, 'J'},
+  {"percentiles", no_argument, NULL, 'P'},
+  {"policy", required_argument, NULL, 'p'},
+  {"sweep", required_argument, NULL, 's'},
+  {"stats", no_argument, NULL, 'S'},
+  {"switch-cost", required_argument, NULL, 'w'},
+  {"timeline", required_argument, NULL, 'T'},
+  {"threads", required_argument, NULL, 't'},
+  {NULL, 0, NULL, 0}
+};
+
+int
+main (int argc, char *argv[])
+{
+  struct sim_config config = {&policy_rr, 1, 1, false, NULL};
+  bool report_cpus = false;
+  char const *export_file = NULL;
+  char const *timeline_file = NULL;
+  bool stats = false;
+  bool export_json = false;
+  char const *sweep_spec = NULL;
+  long nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1)
+    nthreads = 1;
+
+  int c;
+  while ((c = getopt_long (argc, argv, "c:p:s:t:w:C:J:PST:", long_options, NULL))
+	 != -1)
+    switch (c)
+      {
+      case 'c':
+	config.ncpus = next_int_from_c_str (optarg);
+	if (config.ncpus == 0)
+	  {
+	    fprintf (stderr, "%s: zero CPUs\n", argv[0]);
+	    return 1;
+	  }
+	report_cpus = true;
+	break;
+      case 'C':
+      case 'J':
+	if (export_file && export_json != (c == 'J'))
+	  {
+	    fprintf (stderr, "%s: --csv and --json cannot be combined\n",
+		     argv[0]);
+	    usage (argv[0]);
+	  }
+	export_file = optarg;
+	export_json = c == 'J';
+	break;
+      case 'P':
+	config.percentiles = true;
+	break;
+      case 'S':
+	stats = true;
+	break;
+      case 'T':
+	timeline_file = optarg;
+	break;
+      case 'p':
+	config.policy = find_policy (optarg);
+	break;
+      case 's':
+	sweep_spec = optarg;
+	break;
+      case 't':
+	nthreads = next_int_from_c_str (optarg);
+	if (nthreads == 0)
+	  {
+	    fprintf (stderr, "%s: zero threads\n", argv[0]);
+	    return 1;
+	  }
+	break;
+      case 'w':
+	config.switch_cost = next_int_from_c_str (optarg);
+	break;
+      default:
+	usage (argv[0]);
       }
+
+  if (argc - optind != (sweep_spec ? 1 : 2))
+    usage (argv[0]);
+  if (sweep_spec && (export_file || timeline_file))
+    {
+      fprintf (stderr, "%s: cannot export metrics or a timeline from a sweep\n",
+	       argv[0]);
+      return 1;
+    }
+
+  struct process_set ps = init_processes (argv[optind]);
+
+  if (sweep_spec)
+    {
+      int status = run_sweep (&ps, &config, sweep_spec, nthreads, stats);
+      if (fflush (stdout) < 0 || ferror (stdout))
+	{
+	  perror ("stdout");
+	  return 1;
+	}
+      free (ps.arrival_order);
+      free (ps.process);
+      return status;
     }
-    if (non_zero_remaining_time == false) break;
-    non_zero_remaining_time = false;
-  }
 
-  // Do final totals and calculations
-  for (int i = 0; i < ps.nprocesses; i++) {
-    total_wait_time += ps.process[i].waiting_time;
-    total_response_time += ps.process[i].response_time;
-    // printf("%d %d %d\n", ps.process[i].pid, ps.process[i].waiting_time, ps.process[i].response_time);
-  }
-  // printf("Final time: %d\n", time); // remove later
-  /* End of "Your code here" */
+  char const *quantum_arg = argv[optind + 1];
+  long quantum_length = (strcmp (quantum_arg, "median") == 0 ? -1
+			 : next_int_from_c_str (quantum_arg));
+  if (quantum_length == 0)
+    {
+      fprintf (stderr, "%s: zero quantum length\n", argv[0]);
+      return 1;
+    }
+
+  static char timeline_buf[EXPORT_BUFSIZ];
+  if (timeline_file)
+    {
+      config.timeline = open_output (timeline_file, timeline_buf);
+      fputs ("cpu,pid,start,end,reason\n", config.timeline);
+    }
+
+  struct process_state *state = xcalloc (ps.nprocesses, sizeof *state);
+  struct cpu_stats *cpu_stats = xcalloc (config.ncpus, sizeof *cpu_stats);
+  double start = now_seconds ();
+  struct sim_result r = simulate (&ps, &config, quantum_length, state,
+				  cpu_stats);
+  if (stats)
+    report_throughput (r.end_time, r.events, now_seconds () - start);
+  if (timeline_file)
+    close_output (config.timeline, timeline_file);
+  if (export_file)
+    export_metrics (export_file, export_json, state, ps.nprocesses);
+  free (state);
 
   printf ("Average wait time: %.2f\n",
-	  total_wait_time / (double) ps.nprocesses);
+	  r.total_wait_time / (double) ps.nprocesses);
   printf ("Average response time: %.2f\n",
-	  total_response_time / (double) ps.nprocesses);
+	  r.total_response_time / (double) ps.nprocesses);
+  if (config.percentiles)
+    {
+      print_summary ("Wait time", r.wait);
+      print_summary ("Response time", r.response);
+      print_summary ("Turnaround time", r.turnaround);
+    }
+  if (report_cpus)
+    for (long i = 0; i < config.ncpus; i++)
+      printf ("CPU %ld utilization: %.2f%% (busy %ld, switching %ld, idle %ld)\n",
+	      i, 100.0 * cpu_stats[i].busy_ticks / r.end_time,
+	      cpu_stats[i].busy_ticks, cpu_stats[i].switch_ticks,
+	      r.end_time - cpu_stats[i].busy_ticks - cpu_stats[i].switch_ticks);
+  free (cpu_stats);
 
   if (fflush (stdout) < 0 || ferror (stdout))
     {
@@ -382,6 +1072,7 @@ main (int argc, char *argv[])
       return 1;
     }
 
+  free (ps.arrival_order);
   free (ps.process);
   return 0;
-}
\ No newline at end of file
+}
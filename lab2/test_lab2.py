@@ -0,0 +1,220 @@
+import csv
+import json
+import os
+import subprocess
+import tempfile
+import unittest
+
+class TestLab2(unittest.TestCase):
+
+    def _make():
+        result = subprocess.run(['make'], capture_output=True, text=True)
+        return result
+
+    def _make_clean():
+        result = subprocess.run(['make', 'clean'],
+                                capture_output=True, text=True)
+        return result
+
+    @classmethod
+    def setUpClass(cls):
+        cls.make = cls._make().returncode == 0
+
+    @classmethod
+    def tearDownClass(cls):
+        cls._make_clean()
+
+    def test_mlfq_steal_keeps_level(self):
+        self.assertTrue(self.make, msg='make failed')
+        # CPU 1 finishes process 2 and steals process 3 from CPU 0, where
+        # it already used up a slice. Process 5 arrives on CPU 1 at level 0
+        # and must preempt it at once.
+        with tempfile.TemporaryDirectory() as tmp:
+            trace = os.path.join(tmp, 'processes.txt')
+            timeline = os.path.join(tmp, 'timeline.csv')
+            with open(trace, 'w') as f:
+                f.write('5\n1, 0, 100\n2, 0, 5\n3, 0, 100\n4, 7, 1\n5, 7, 1\n')
+            subprocess.run(('./rr', '--policy', 'mlfq', '--cpus', '2',
+                            '--timeline', timeline, trace, '2'),
+                           capture_output=True, check=True)
+            with open(timeline) as f:
+                runs = [row for row in csv.DictReader(f) if row['pid'] == '3']
+        stolen = [row for row in runs if row['cpu'] == '1']
+        self.assertTrue(stolen, msg='Process 3 should be stolen by CPU 1.')
+        self.assertEqual((stolen[0]['start'], stolen[0]['end'], stolen[0]['reason']),
+                         ('6', '7', 'preempt'),
+                         msg='A demoted process should stay demoted after a steal.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_mlfq_favors_interactive(self):
+        self.assertTrue(self.make, msg='make failed')
+        # More CPU-bound processes than a fixed boost period of 32 quanta
+        # could serve, and short interactive ones arriving among them.
+        long = ['{}, 0, 200'.format(pid) for pid in range(1, 41)]
+        short = ['{}, {}, 2'.format(pid, 500 + 100 * i)
+                 for i, pid in enumerate(range(41, 46))]
+        waits = {}
+        with tempfile.TemporaryDirectory() as tmp:
+            trace = os.path.join(tmp, 'processes.txt')
+            with open(trace, 'w') as f:
+                f.write('{}\n{}\n'.format(len(long) + len(short),
+                                           '\n'.join(long + short)))
+            for policy in ('rr', 'mlfq'):
+                result = subprocess.run(('./rr', '--policy', policy, '--csv', '-',
+                                         trace, '2'),
+                                        capture_output=True, text=True, check=True)
+                rows = csv.DictReader(result.stdout.splitlines()[:-2])
+                waits[policy] = sum(int(row['waiting_time']) for row in rows
+                                    if int(row['pid']) > 40)
+        self.assertLess(2 * waits['mlfq'], waits['rr'],
+                        msg='Interactive processes should wait less under MLFQ.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_sweep(self):
+        self.assertTrue(self.make, msg='make failed')
+        expected = ('quantum       avg wait   avg response   cpu util\n'
+                    '       1          14.00           4.00     59.26%\n'
+                    '       2          11.50           4.50     69.57%\n'
+                    '       3          10.25           5.50     72.73%\n'
+                    '  median          12.25           4.25     64.00%\n')
+        for threads in ('1', '3'):
+            result = subprocess.run(('./rr', '--threads', threads, '--sweep', '1..3,median',
+                                     'processes.txt'),
+                                    capture_output=True, text=True, check=True)
+            self.assertEqual(result.stdout.lstrip(), expected,
+                             msg='The sweep table should not depend on the threads.')
+        for quantum, row in (('2', '11.50'), ('median', '12.25')):
+            result = subprocess.run(('./rr', 'processes.txt', quantum),
+                                    capture_output=True, text=True, check=True)
+            self.assertIn('Average wait time: ' + row, result.stdout,
+                          msg='A sweep should match the single runs.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_export(self):
+        self.assertTrue(self.make, msg='make failed')
+        expected = [
+            {'pid': 1, 'arrival_time': 0, 'burst_time': 7, 'waiting_time': 7,
+             'response_time': 0, 'turnaround_time': 14, 'context_switches': 2},
+            {'pid': 2, 'arrival_time': 2, 'burst_time': 4, 'waiting_time': 14,
+             'response_time': 5, 'turnaround_time': 18, 'context_switches': 1},
+            {'pid': 3, 'arrival_time': 4, 'burst_time': 1, 'waiting_time': 7,
+             'response_time': 7, 'turnaround_time': 8, 'context_switches': 0},
+            {'pid': 4, 'arrival_time': 5, 'burst_time': 4, 'waiting_time': 13,
+             'response_time': 10, 'turnaround_time': 17, 'context_switches': 1},
+        ]
+        with tempfile.TemporaryDirectory() as tmp:
+            csv_file = os.path.join(tmp, 'metrics.csv')
+            json_file = os.path.join(tmp, 'metrics.json')
+            subprocess.run(('./rr', '--csv', csv_file, 'processes.txt', '3'),
+                           capture_output=True, check=True)
+            subprocess.run(('./rr', '--json', json_file, 'processes.txt', '3'),
+                           capture_output=True, check=True)
+            with open(csv_file) as f:
+                rows = [{k: int(v) for k, v in row.items()} for row in csv.DictReader(f)]
+            with open(json_file) as f:
+                records = json.load(f)
+        self.assertEqual(rows, expected, msg='CSV export is wrong.')
+        self.assertEqual(records, expected, msg='JSON export is wrong.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_percentiles(self):
+        self.assertTrue(self.make, msg='make failed')
+        result = subprocess.run(('./rr', '--percentiles', 'processes.txt', '3'),
+                                capture_output=True, text=True, check=True)
+        # Nearest rank: waits 7, 7, 13, 14; responses 0, 5, 7, 10;
+        # turnarounds 8, 14, 17, 18.
+        self.assertEqual(result.stdout,
+                         'Average wait time: 10.25\n'
+                         'Average response time: 5.50\n'
+                         'Wait time p50/p90/p99: 7 / 14 / 14\n'
+                         'Response time p50/p90/p99: 5 / 10 / 10\n'
+                         'Turnaround time p50/p90/p99: 14 / 18 / 18\n')
+        with tempfile.TemporaryDirectory() as tmp:
+            # One-tick processes served in order give waits 0, 1, ..., 99
+            trace = os.path.join(tmp, 'processes.txt')
+            with open(trace, 'w') as f:
+                f.write('100\n')
+                f.writelines('{}, 0, 1\n'.format(pid) for pid in range(1, 101))
+            result = subprocess.run(('./rr', '--percentiles', '--policy', 'fcfs',
+                                     '--switch-cost', '0', trace, '1'),
+                                    capture_output=True, text=True, check=True)
+        self.assertIn('Wait time p50/p90/p99: 49 / 89 / 98\n', result.stdout)
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_timeline(self):
+        self.assertTrue(self.make, msg='make failed')
+        result = subprocess.run(('./rr', '--timeline', '-', 'processes.txt', '3'),
+                                capture_output=True, text=True, check=True)
+        # Process 1 keeps the CPU for two quanta: one interval, not six ticks
+        self.assertEqual(result.stdout.splitlines()[:14], [
+            'cpu,pid,start,end,reason',
+            '0,1,0,6,expire', '0,,6,7,switch',
+            '0,2,7,10,expire', '0,,10,11,switch',
+            '0,3,11,12,exit', '0,,12,13,switch',
+            '0,1,13,14,exit', '0,,14,15,switch',
+            '0,4,15,18,expire', '0,,18,19,switch',
+            '0,2,19,20,exit', '0,,20,21,switch',
+            '0,4,21,22,exit',
+        ])
+        with tempfile.TemporaryDirectory() as tmp:
+            trace = os.path.join(tmp, 'processes.txt')
+            with open(trace, 'w') as f:
+                f.write('1\n1, 0, 100000\n')
+            result = subprocess.run(('./rr', '--timeline', '-', trace, '1'),
+                                    capture_output=True, text=True, check=True)
+        self.assertEqual(result.stdout.splitlines()[:2],
+                         ['cpu,pid,start,end,reason', '0,1,0,100000,exit'],
+                         msg='A process running alone should be one interval.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_gen_trace_seed(self):
+        self.assertTrue(self.make, msg='make failed')
+        self.assertEqual(subprocess.run(('./gen-trace', '--seed', '7', '5'),
+                                        capture_output=True, text=True, check=True).stdout,
+                         '5\n1, 0, 9\n2, 45, 1\n3, 51, 8\n4, 66, 8\n5, 79, 20\n')
+        for burst in ('exp', 'bimodal', 'pareto'):
+            runs = [subprocess.run(('./gen-trace', '--burst', burst, '--seed', seed, '1000'),
+                                   capture_output=True, check=True).stdout
+                    for seed in ('3', '3', '4')]
+            self.assertEqual(runs[0], runs[1], msg='The same seed should give the same trace.')
+            self.assertNotEqual(runs[0], runs[2], msg='Another seed should give another trace.')
+        stdout = subprocess.run(('./gen-trace', '--seed', '3', '1000'),
+                                capture_output=True, check=True).stdout
+        with tempfile.TemporaryDirectory() as tmp:
+            trace = os.path.join(tmp, 'processes.txt')
+            subprocess.run(('./gen-trace', '--seed', '3', '--output', trace, '1000'),
+                           capture_output=True, check=True)
+            with open(trace, 'rb') as f:
+                self.assertEqual(f.read(), stdout, msg='--output should match standard output.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_ring_run_queue(self):
+        self.assertTrue(self.make, msg='make failed')
+        # 1000 processes of 3 ticks, all at time 0, grow the ring run queue
+        # and wrap around it. At quantum 2 process K (from 0) first runs
+        # at 3K and finishes at 3000 + 2K + 1.
+        with tempfile.TemporaryDirectory() as tmp:
+            trace = os.path.join(tmp, 'processes.txt')
+            with open(trace, 'w') as f:
+                f.write('1000\n')
+                f.writelines('{}, 0, 3\n'.format(pid) for pid in range(1, 1001))
+            result = subprocess.run(('./rr', '--csv', '-', trace, '2'),
+                                    capture_output=True, text=True, check=True)
+        lines = result.stdout.splitlines()
+        rows = list(csv.DictReader(lines[:-2]))
+        self.assertEqual([(int(row['response_time']), int(row['waiting_time']))
+                          for row in rows],
+                         [(3 * k, 2998 + 2 * k) for k in range(1000)])
+        self.assertEqual(lines[-2:], ['Average wait time: 3997.00',
+                                      'Average response time: 1498.50'])
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_bad_options(self):
+        self.assertTrue(self.make, msg='make failed')
+        result = subprocess.run(('./rr', '--csv', 'a.csv', '--json', 'a.json',
+                                 'processes.txt', '2'), capture_output=True)
+        self.assertNotEqual(result.returncode, 0, msg='--csv and --json should conflict.')
+        self.assertFalse(os.path.exists('a.csv') or os.path.exists('a.json'))
+        result = subprocess.run(('./gen-trace', '--seed', 'abc', '3'), capture_output=True)
+        self.assertNotEqual(result.returncode, 0, msg='A bad seed should be an error.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
@@ -0,0 +1,170 @@
+"""Time ext2-create on synthetic source trees and catch build regressions.
+
+The trees are generated once with a fixed seed, so every run copies the
+same files: many small files, a few huge ones, and deep directories.
+Each case is built once to warm the page cache, then a few times more,
+and the fastest run kept.  Besides the wall time, the report shows CPU
+time and peak RSS from the child's rusage, and the write and read calls
+and bytes written that ext2-create --stats counts.  With --record, the wall times and peak RSS
+become the baseline; otherwise any case more than --tolerance slower or
+larger than the baseline fails the run.
+"""
+
+import argparse
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import time
+
+REPEATS = 7
+TREE_DIR = 'bench-trees'
+IMAGE = 'bench.img'
+
+STATS = re.compile(r': \d+ inodes, \d+ blocks .* in [\d.]+ s; '
+                   r'(\d+) write calls \((\d+) bytes\), (\d+) read calls')
+
+
+def small_files(root, rng):
+    """50000 files of up to 4 KiB in 500 directories."""
+    for d in range(500):
+        path = os.path.join(root, f'dir{d:03}')
+        os.mkdir(path)
+        for f in range(100):
+            with open(os.path.join(path, f'file{f:03}'), 'wb') as out:
+                out.write(rng.randbytes(rng.randrange(4097)))
+
+
+def huge_files(root, rng):
+    """Four files of 40 MiB."""
+    chunk = rng.randbytes(1 << 20)
+    for f in range(4):
+        with open(os.path.join(root, f'huge{f}'), 'wb') as out:
+            for i in range(40):
+                out.write(chunk[i:] + chunk[:i])
+
+
+def deep_dirs(root, rng):
+    """100 chains of 100 nested directories, with a file at every level."""
+    for c in range(100):
+        path = os.path.join(root, f'chain{c:02}')
+        for level in range(100):
+            path = os.path.join(path, f'd{level}')
+            os.makedirs(path)
+            with open(os.path.join(path, 'file'), 'wb') as out:
+                out.write(rng.randbytes(rng.randrange(2048)))
+
+
+CASES = (
+    ('small-files', small_files, ['--block-size', '1024']),
+    ('huge-files', huge_files, ['--block-size', '4096']),
+    ('deep-dirs', deep_dirs, ['--block-size', '1024']),
+)
+
+
+def tree(name, generate):
+    path = os.path.join(TREE_DIR, name)
+    if not os.path.exists(path):
+        partial = path + '.partial'
+        shutil.rmtree(partial, ignore_errors=True)
+        os.makedirs(partial)
+        generate(partial, random.Random(1))
+        os.rename(partial, path)
+    return path
+
+
+def build(path, options):
+    """Build one image; return wall s, rusage and the --stats counts."""
+    # A new file, so that writeback of the last image's pages can be
+    # dropped instead of slowing this run down
+    if os.path.exists(IMAGE):
+        os.remove(IMAGE)
+    start = time.monotonic()
+    proc = subprocess.Popen(['./ext2-create', '--stats', '--from', path,
+                             '--output', IMAGE] + options,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                            text=True)
+    stderr = proc.stderr.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        sys.exit(f'ext2-create failed on {path}: {stderr}')
+    m = STATS.search(stderr)
+    if not m:
+        sys.exit(f'unexpected ext2-create output: {stderr!r}')
+    writes, written, reads = map(int, m.groups())
+    return wall, usage, writes, written, reads
+
+
+def measure(path, options):
+    build(path, options)
+    runs = [build(path, options) for _ in range(REPEATS)]
+    return min(runs, key=lambda run: run[0])
+
+
+def load_baseline(path):
+    baseline = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                name, wall, rss = line.split()
+                baseline[name] = (float(wall), int(rss))
+    return baseline
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--baseline', default='bench-baseline.txt')
+    parser.add_argument('--record', action='store_true',
+                        help='save the results as the new baseline')
+    parser.add_argument('--tolerance', type=float, default=0.25,
+                        help='allowed fractional rise in wall time and RSS')
+    args = parser.parse_args()
+
+    baseline = {} if args.record else load_baseline(args.baseline)
+    results = {}
+    regressions = []
+
+    print(f'{"case":<12} {"wall s":>7} {"user s":>7} {"sys s":>7} '
+          f'{"RSS MiB":>8} {"writes":>8} {"reads":>8} {"MiB out":>8} '
+          f'{"baseline":>8} {"change":>8}')
+    try:
+        for name, generate, options in CASES:
+            path = tree(name, generate)
+            wall, usage, writes, written, reads = measure(path, options)
+            rss = usage.ru_maxrss  # KiB on Linux
+            results[name] = (wall, rss)
+            line = (f'{name:<12} {wall:>7.3f} {usage.ru_utime:>7.3f} '
+                    f'{usage.ru_stime:>7.3f} {rss / 1024:>8.1f} {writes:>8,} '
+                    f'{reads:>8,} {written / (1 << 20):>8.1f}')
+            if name in baseline:
+                base_wall, base_rss = baseline[name]
+                change = wall / base_wall - 1
+                line += f' {base_wall:>8.3f} {change:>+8.1%}'
+                if change > args.tolerance:
+                    regressions.append(f'{name} (time)')
+                if rss > base_rss * (1 + args.tolerance):
+                    regressions.append(f'{name} (RSS {base_rss // 1024} -> {rss // 1024} MiB)')
+            print(line, flush=True)
+    finally:
+        if os.path.exists(IMAGE):
+            os.remove(IMAGE)
+
+    if args.record:
+        with open(args.baseline, 'w') as f:
+            for name, (wall, rss) in results.items():
+                f.write(f'{name} {wall:.4f} {rss}\n')
+        print(f'Recorded baseline in {args.baseline}')
+    elif not baseline:
+        print(f'No baseline in {args.baseline}; record one with "make bench-baseline"')
+
+    if regressions:
+        sys.exit(f'Regressed by more than {args.tolerance:.0%}: '
+                 + ', '.join(regressions))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,47 +1,35 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
-typedef int16_t i16;
-typedef int32_t i32;
-
-#define BLOCK_SIZE 1024
-#define BLOCK_OFFSET(i) (i * BLOCK_SIZE)
-#define NUM_BLOCKS 1024
-#define NUM_INODES 128
-
-#define LOST_AND_FOUND_INO 11
-#define HELLO_WORLD_INO    12
-#define HELLO_INO          13
-#define LAST_INO           HELLO_INO
-
-#define SUPERBLOCK_BLOCKNO             1
-#define BLOCK_GROUP_DESCRIPTOR_BLOCKNO 2
-#define BLOCK_BITMAP_BLOCKNO           3
-#define INODE_BITMAP_BLOCKNO           4
-#define INODE_TABLE_BLOCKNO            5
-#define ROOT_DIR_BLOCKNO               21
-#define LOST_AND_FOUND_DIR_BLOCKNO     22
-#define HELLO_WORLD_FILE_BLOCKNO       23
-#define LAST_BLOCK                     HELLO_WORLD_FILE_BLOCKNO
+#include "ext2.h"
 
-#define NUM_FREE_BLOCKS (NUM_BLOCKS - LAST_BLOCK - 1)
-#define NUM_FREE_INODES (NUM_INODES - LAST_INO)
+/* The geometry of the original image, used unless overridden */
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_NUM_BLOCKS 1024
+#define BYTES_PER_INODE    8192
 
-#define EXT2_SUPER_MAGIC 0xEF53
+/* Hashed into the UUID of --deterministic images. Bump it when the same
+   tree and options start to give a different image, so that images built
+   before are not taken to be up to date. */
+#define IMAGE_FORMAT_VERSION 1
 
-/* http://www.nongnu.org/ext2-doc/ext2.html */
-/* http://www.science.smith.edu/~nhowe/262/oldlabs/ext2.html */
+#define BLOCK_OFFSET(i) ((off_t) (i) * geometry.block_size)
 
 /* START OF SELF-DEFINED MACROS */
 
@@ -62,120 +50,8 @@ typedef int32_t i32;
 #define EXT2_DEF_RESUID 0
 #define EXT2_DEF_RESGID 0
 
-// BLOCK GROUP DESCRIPTOR
-#define DIRS_COUNT 2
-
 /* END OF SELF-DEFINED MACROS */
 
-#define	EXT2_BAD_INO             1
-#define EXT2_ROOT_INO            2
-#define EXT2_GOOD_OLD_FIRST_INO 11
-
-#define EXT2_GOOD_OLD_REV 0
-
-#define EXT2_S_IFSOCK 0xC000
-#define EXT2_S_IFLNK  0xA000
-#define EXT2_S_IFREG  0x8000
-#define EXT2_S_IFBLK  0x6000
-#define EXT2_S_IFDIR  0x4000
-#define EXT2_S_IFCHR  0x2000
-#define EXT2_S_IFIFO  0x1000
-#define EXT2_S_ISUID  0x0800
-#define EXT2_S_ISGID  0x0400
-#define EXT2_S_ISVTX  0x0200
-#define EXT2_S_IRUSR  0x0100
-#define EXT2_S_IWUSR  0x0080
-#define EXT2_S_IXUSR  0x0040
-#define EXT2_S_IRGRP  0x0020
-#define EXT2_S_IWGRP  0x0010
-#define EXT2_S_IXGRP  0x0008
-#define EXT2_S_IROTH  0x0004
-#define EXT2_S_IWOTH  0x0002
-#define EXT2_S_IXOTH  0x0001
-
-#define	EXT2_NDIR_BLOCKS 12
-#define	EXT2_IND_BLOCK   EXT2_NDIR_BLOCKS
-#define	EXT2_DIND_BLOCK  (EXT2_IND_BLOCK + 1)
-#define	EXT2_TIND_BLOCK  (EXT2_DIND_BLOCK + 1)
-#define	EXT2_N_BLOCKS    (EXT2_TIND_BLOCK + 1)
-
-#define EXT2_NAME_LEN 255
-
-struct ext2_superblock {
-	u32 s_inodes_count;
-	u32 s_blocks_count;
-	u32 s_r_blocks_count;
-	u32 s_free_blocks_count;
-	u32 s_free_inodes_count;
-	u32 s_first_data_block;
-	u32 s_log_block_size;
-	i32 s_log_frag_size;
-	u32 s_blocks_per_group;
-	u32 s_frags_per_group;
-	u32 s_inodes_per_group;
-	u32 s_mtime;
-	u32 s_wtime;
-	u16 s_mnt_count;
-	i16 s_max_mnt_count;
-	u16 s_magic;
-	u16 s_state;
-	u16 s_errors;
-	u16 s_minor_rev_level;
-	u32 s_lastcheck;
-	u32 s_checkinterval;
-	u32 s_creator_os;
-	u32 s_rev_level;
-	u16 s_def_resuid;
-	u16 s_def_resgid;
-	u32 s_pad[5];
-	u8 s_uuid[16];
-	u8 s_volume_name[16];
-	u32 s_reserved[229];
-};
-
-struct ext2_block_group_descriptor
-{
-	u32 bg_block_bitmap;
-	u32 bg_inode_bitmap;
-	u32 bg_inode_table;
-	u16 bg_free_blocks_count;
-	u16 bg_free_inodes_count;
-	u16 bg_used_dirs_count;
-	u16 bg_pad;
-	u32 bg_reserved[3];
-};
-
-struct ext2_inode {
-	u16 i_mode;
-	u16 i_uid;
-	u32 i_size;
-	u32 i_atime;
-	u32 i_ctime;
-	u32 i_mtime;
-	u32 i_dtime;
-	u16 i_gid;
-	u16 i_links_count;
-	u32 i_blocks;
-	u32 i_flags;
-	u32 i_reserved1;
-	u32 i_block[EXT2_N_BLOCKS];
-	u32 i_version;
-	u32 i_file_acl;
-	u32 i_dir_acl;
-	u32 i_faddr;
-	u8  i_frag;
-	u8  i_fsize;
-	u16 i_pad1;
-	u32 i_reserved2[2];
-};
-
-struct ext2_dir_entry {
-	u32 inode;
-	u16 rec_len;
-	u16 name_len;
-	u8  name[EXT2_NAME_LEN];
-};
-
 #define errno_exit(str)                                                        \
 	do { int err = errno; perror(str); exit(err); } while (0)
 
@@ -194,15 +70,135 @@ struct ext2_dir_entry {
 		}                                                              \
 	} while (0)
 
-#define dir_entry_write(entry, fd)                                             \
-	do {                                                                   \
-		size_t size = entry.rec_len;                                   \
-		if (write(fd, &entry, size) != size) {                         \
-			errno_exit("write");                                   \
-		}                                                              \
-	} while (0)
+/* A run of LEN consecutive blocks starting at START. A SHARED run was
+   allocated to some earlier file with the same blocks (--dedup), or is
+   a hole if START is zero, so the file does not write it. */
+struct extent {
+	u32 start;
+	u32 len;
+	int shared;
+};
+
+/* A file in the tree the image is built from. The tree comes either from
+   base_tree() or from walking a host directory with --from. */
+struct node {
+	char *name;
+	char *path;        /* Host path to copy from, NULL for built-in nodes */
+	const char *data;  /* Contents of a built-in regular file */
+	char *target;      /* Symbolic link target */
+
+	u16 mode;
+	u32 uid;
+	u32 gid;
+	u16 links_count;
+	u64 size;
+	u32 atime;
+	u32 ctime;
+	u32 mtime;
+	u32 rdev;          /* Device number of a device file, new style */
+	u64 host_dev;      /* Host device and inode of a file with more */
+	u64 host_ino;      /* than one name, else zero */
+	struct node *link; /* An earlier name of the same file, whose inode
+	                      this one shares */
+	u16 extra_names;   /* Later names of this file that link to it */
+	int sparse;        /* The host file has holes */
+	u64 hash[2];       /* Hash of the contents of a host file */
+	u64 (*block_hashes)[2];  /* Hash of each data block, or zeros for
+	                            a block of zeros, with --dedup */
+
+	u32 ino;
+	struct extent *extents;  /* Data blocks, in file order */
+	u32 num_extents;
+	u32 num_blocks;
+	u32 num_holes;           /* Data blocks left out: where a sparse host
+	                            file has no data, and with --dedup blocks
+	                            of zeros */
+	struct extent *host_holes;  /* Runs of whole blocks a sparse host file
+	                               has no data in, by block of the file */
+	u32 num_host_holes;
+	int keep_blocks;   /* --update: reuse the blocks of the file replaced */
+	int unchanged;     /* --update: and they already hold the contents */
+	struct extent *map_extents;  /* Indirect blocks, in the order
+	                                write_map() fills them */
+	u32 num_map_extents;
+	u32 num_map_blocks;
+
+	struct node *parent;
+	struct node **children;
+	size_t num_children;
+	size_t children_cap;
+};
+
+/* The shape of the file system, fixed by geometry_init() before any
+   tree is laid out. Every group has BLOCKS_PER_GROUP blocks except maybe
+   the last, and starts with a copy of the superblock and descriptor
+   table if group_has_super() says so, followed by its block bitmap,
+   inode bitmap and inode table. */
+struct geometry {
+	u32 block_size;
+	u32 log_block_size;
+	u32 blocks_count;
+	u32 inodes_count;
+	u32 first_data_block;
+	u32 blocks_per_group;
+	u32 inodes_per_group;
+	u32 num_groups;
+	u32 gdt_blocks;
+	u32 inode_table_blocks;
+	int sparse_super;
+	int dir_index;   /* Index directories larger than a block */
+	int dedup;       /* Share identical file blocks (experimental) */
+};
+
+struct geometry geometry;
+
+/* Block numbers by the hash of their contents, for --dedup. A slot is
+   free while its block number is zero. */
+struct block_table {
+	u64 (*keys)[2];
+	u32 *blocks;
+	size_t cap;
+	size_t len;
+};
+
+/* Which inodes and blocks are in use, and where the search for free
+   ones starts in each group: everything before the cursor is taken.
+   Directories are spread over the groups the way Linux's Orlov allocator
+   spreads them, and every other file goes in its directory's group, its
+   blocks in one run where some group has room for them. --update fills
+   the gaps that removed files leave too. */
+struct layout {
+	u32 *group_next_ino;
+	u32 *group_next_block;
+	u8 *inode_map;    /* Bit I for inode I + 1 */
+	u8 *block_map;    /* Bit I for block first_data_block + I */
+	u32 *group_inodes;  /* Inodes in use in each group */
+	u32 *group_blocks;  /* Blocks in use in each group, metadata included */
+	u32 dirs_count;
+	u32 *group_dirs;  /* Directories in each group */
+	int large_file;   /* Some file is 2 GiB or larger */
+	struct block_table dedup;  /* Data blocks allocated so far */
+	u64 shared_blocks;
+	u32 *freed_inodes;  /* --update: inodes of removed files */
+	u32 num_freed_inodes;
+	u32 write_time;   /* Of the superblock; --update keeps the image's
+	                     until something else changes */
+};
+
+/* The time every timestamp is set to with --deterministic, or -1 to
+   read the clock */
+long long fixed_time = -1;
+
+/* The UUID written to the superblock */
+u8 volume_uuid[16] = {
+	0x5A, 0x1E, 0xAB, 0x1E, 0x13, 0x37, 0x13, 0x37,
+	0x13, 0x37, 0xC0, 0xFF, 0xEE, 0xC0, 0xFF, 0xEE
+};
 
 u32 get_current_time() {
+	if (fixed_time >= 0) {
+		return fixed_time;
+	}
 	time_t t = time(NULL);
 	if (t == ((time_t) -1)) {
 		errno_exit("time");
@@ -210,369 +206,3594 @@ u32 get_current_time() {
 	return t;
 }
 
-void write_superblock(int fd) {
-	off_t off = lseek(fd, BLOCK_OFFSET(1), SEEK_SET);
-	if (off == -1) {
-		errno_exit("lseek");
+double now_seconds() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		errno_exit("clock_gettime");
+	}
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *xmalloc(size_t size) {
+	void *p = malloc(size);
+	if (p == NULL) {
+		errno_exit("malloc");
+	}
+	return p;
+}
+
+char *xstrdup(const char *s) {
+	char *p = strdup(s);
+	if (p == NULL) {
+		errno_exit("strdup");
+	}
+	return p;
+}
+
+struct node *node_new(struct node *parent, const char *name) {
+	struct node *node = xmalloc(sizeof(*node));
+	memset(node, 0, sizeof(*node));
+	node->name = xstrdup(name);
+	node->parent = parent ? parent : node;
+	return node;
+}
+
+void node_add_child(struct node *dir, struct node *child) {
+	if (dir->num_children == dir->children_cap) {
+		dir->children_cap = dir->children_cap ? 2 * dir->children_cap : 8;
+		dir->children = realloc(dir->children,
+		                        dir->children_cap * sizeof(*dir->children));
+		if (dir->children == NULL) {
+			errno_exit("realloc");
+		}
 	}
+	dir->children[dir->num_children++] = child;
+}
+
+const char *node_path(struct node *node) {
+	return node->path ? node->path : node->name;
+}
 
+/* The image ext2-create has always built: lost+found, a hello-world file
+   and a hello symlink pointing at it. */
+struct node *base_tree() {
 	u32 current_time = get_current_time();
 
-	struct ext2_superblock superblock = {0};
+	/* The root directory and the lost+found should be
+	owned by uid 0 and gid 0 (root). The owner should have read, write, and execute permissions. The group and
+	other should have read and execute permissions */
+	struct node *root = node_new(NULL, "");
+	root->mode = EXT2_S_IFDIR
+	             | EXT2_S_IRUSR
+	             | EXT2_S_IWUSR
+	             | EXT2_S_IXUSR
+	             | EXT2_S_IRGRP
+	             | EXT2_S_IXGRP
+	             | EXT2_S_IROTH
+	             | EXT2_S_IXOTH;
+	root->atime = root->ctime = root->mtime = current_time;
 
-	superblock.s_inodes_count = NUM_INODES;
-	superblock.s_blocks_count = NUM_BLOCKS;
-	superblock.s_r_blocks_count = 0;
-	superblock.s_free_blocks_count = NUM_FREE_BLOCKS;
-	superblock.s_free_inodes_count = NUM_FREE_INODES;
-	superblock.s_first_data_block = SUPERBLOCK_BLOCKNO; /* First Data Block */
-	superblock.s_log_block_size = 0;					/* 1024 */ // 0 because you want to bitshift 0 bits
-	superblock.s_log_frag_size = 0;						/* 1024 */ // 0 because you want to bitshift 0 bits
-	superblock.s_blocks_per_group = BLOCK_SIZE * 8;
-	superblock.s_frags_per_group = BLOCK_SIZE * 8;
-	superblock.s_inodes_per_group = NUM_INODES;
-	superblock.s_mtime = 0;				/* Mount time */
-	superblock.s_wtime = current_time;	/* Write time */
-	superblock.s_mnt_count         = 0; /* Number of times mounted so far */
-	superblock.s_max_mnt_count     = UNLIMITED_MNT_COUNT; /* Make this unlimited */
-	superblock.s_magic = EXT2_SUPER_MAGIC; /* ext2 Signature */
-	superblock.s_state             = EXT2_VALID_FS; /* File system is clean */
-	superblock.s_errors            = EXT2_ERRORS_CONTINUE; /* Ignore the error (continue on) */
-	superblock.s_minor_rev_level   = 0; /* Leave this as 0 */
-	superblock.s_lastcheck = current_time; /* Last check time */
-	superblock.s_checkinterval     = CHECK_INTERVAL; /* Force checks by making them every 1 second */
-	superblock.s_creator_os        = EXT2_OS_LINUX; /* Linux */
-	superblock.s_rev_level         = 0; /* Leave this as 0 */
-	superblock.s_def_resuid        = EXT2_DEF_RESUID; /* root */ // 0 is default
-	superblock.s_def_resgid        = EXT2_DEF_RESGID; /* root */ // 0 is default
+	/* The hello-world file and hello symlink should be owned by
+	uid 1000 and gid 1000 (typically the number of the first “normal” user). The owner should have read and write
+	permissions. The group and other should only have read permission. Your hello-world file should only be 12
+	bytes long and contain “Hello world” followed by a newline */
+	struct node *hello_world = node_new(root, "hello-world");
+	hello_world->mode = EXT2_S_IFREG
+	                    | EXT2_S_IRUSR
+	                    | EXT2_S_IWUSR
+	                    | EXT2_S_IRGRP
+	                    | EXT2_S_IROTH;
+	hello_world->uid = 1000;
+	hello_world->gid = 1000;
+	hello_world->data = "Hello world\n";
+	hello_world->size = strlen(hello_world->data);
+	hello_world->atime = hello_world->ctime = hello_world->mtime = current_time;
+	node_add_child(root, hello_world);
 
-	superblock.s_uuid[0] = 0x5A;
-	superblock.s_uuid[1] = 0x1E;
-	superblock.s_uuid[2] = 0xAB;
-	superblock.s_uuid[3] = 0x1E;
-	superblock.s_uuid[4] = 0x13;
-	superblock.s_uuid[5] = 0x37;
-	superblock.s_uuid[6] = 0x13;
-	superblock.s_uuid[7] = 0x37;
-	superblock.s_uuid[8] = 0x13;
-	superblock.s_uuid[9] = 0x37;
-	superblock.s_uuid[10] = 0xC0;
-	superblock.s_uuid[11] = 0xFF;
-	superblock.s_uuid[12] = 0xEE;
-	superblock.s_uuid[13] = 0xC0;
-	superblock.s_uuid[14] = 0xFF;
-	superblock.s_uuid[15] = 0xEE;
+	// Symbolic link named hello pointing to hello-world
+	struct node *hello = node_new(root, "hello");
+	hello->mode = EXT2_S_IFLNK
+	              | EXT2_S_IRUSR
+	              | EXT2_S_IWUSR
+	              | EXT2_S_IRGRP
+	              | EXT2_S_IROTH;
+	hello->uid = 1000;
+	hello->gid = 1000;
+	hello->target = xstrdup("hello-world");
+	hello->size = strlen(hello->target);
+	hello->atime = hello->ctime = hello->mtime = current_time;
+	node_add_child(root, hello);
+
+	return root;
+}
 
-	memcpy(&superblock.s_volume_name, "cs111-base", 10);
+void node_set_stat(struct node *node, const struct stat *st) {
+	node->mode = st->st_mode;
+	node->uid = st->st_uid;
+	node->gid = st->st_gid;
+	node->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+	node->sparse = S_ISREG(st->st_mode) && st->st_blocks * 512 < st->st_size;
+	node->atime = st->st_atime;
+	node->ctime = st->st_ctime;
+	node->mtime = st->st_mtime;
+	if (st->st_nlink > 1 && !S_ISDIR(st->st_mode)) {
+		node->host_dev = st->st_dev;
+		node->host_ino = st->st_ino;
+	}
+	if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode)) {
+		/* The new-style encoding Linux uses: 12-bit major, 20-bit minor */
+		u64 maj = major(st->st_rdev);
+		u64 min = minor(st->st_rdev);
+		if (maj > 0xFFF || min > 0xFFFFF) {
+			fprintf(stderr, "%s: device number too large\n", node->path);
+			exit(1);
+		}
+		node->rdev = (min & 0xFF) | maj << 8 | (min & ~0xFFull) << 12;
+	}
+}
+
+/* Directories waiting to be read by the walker threads. PENDING counts
+   directories that are queued or being read; the walk is over when it
+   drops to zero. */
+struct walker {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct node **queue;
+	size_t queue_len;
+	size_t queue_cap;
+	size_t pending;
+};
+
+void walker_push(struct walker *w, struct node *dir) {
+	pthread_mutex_lock(&w->lock);
+	if (w->queue_len == w->queue_cap) {
+		w->queue_cap = w->queue_cap ? 2 * w->queue_cap : 64;
+		w->queue = realloc(w->queue, w->queue_cap * sizeof(*w->queue));
+		if (w->queue == NULL) {
+			errno_exit("realloc");
+		}
+	}
+	w->queue[w->queue_len++] = dir;
+	w->pending++;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
 
-	ssize_t size = sizeof(superblock);
-	if (write(fd, &superblock, size) != size) {
-		errno_exit("write");
+/* Set once opening with O_NOATIME has failed for lack of permission */
+int noatime_denied;
+
+/* Open the host file PATH for reading, with the extra open() FLAGS.
+   Where the file's owner allows, its access time is left alone, which
+   spares the host file system an inode write for every file read, and
+   keeps the times --update compares from moving. */
+int open_source(const char *path, int flags) {
+#ifdef O_NOATIME
+	if (!__atomic_load_n(&noatime_denied, __ATOMIC_RELAXED)) {
+		int fd = open(path, O_RDONLY | O_NOATIME | flags);
+		if (fd != -1 || errno != EPERM) {
+			return fd;
+		}
+		__atomic_store_n(&noatime_denied, 1, __ATOMIC_RELAXED);
 	}
+#endif
+	return open(path, O_RDONLY | flags);
 }
 
-void write_block_group_descriptor_table(int fd) {
-	off_t off = lseek(fd, BLOCK_OFFSET(BLOCK_GROUP_DESCRIPTOR_BLOCKNO), SEEK_SET);
-	if (off == -1) {
-		errno_exit("lseek");
+/* Read the entries of DIR into its children, queueing subdirectories.
+   Only the thread reading DIR touches its children. */
+void walk_dir(struct walker *w, struct node *dir) {
+	int dir_fd = open_source(dir->path, O_DIRECTORY);
+	if (dir_fd == -1) {
+		errno_exit(dir->path);
+	}
+	DIR *d = fdopendir(dir_fd);
+	if (d == NULL) {
+		errno_exit(dir->path);
 	}
 
-	struct ext2_block_group_descriptor block_group_descriptor = {0};
+	struct dirent *entry;
+	while ((errno = 0, entry = readdir(d)) != NULL) {
+		const char *name = entry->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+		/* The image gets its own lost+found */
+		if (dir->parent == dir && strcmp(name, "lost+found") == 0) {
+			continue;
+		}
+		if (strlen(name) > EXT2_NAME_LEN) {
+			fprintf(stderr, "%s/%s: name too long\n", dir->path, name);
+			exit(1);
+		}
+
+		struct stat st;
+		if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			errno_exit(name);
+		}
+
+		struct node *child = node_new(dir, name);
+		child->path = xmalloc(strlen(dir->path) + strlen(name) + 2);
+		sprintf(child->path, "%s/%s", dir->path, name);
+		node_set_stat(child, &st);
+
+		if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t len = readlinkat(dir_fd, name, target, sizeof(target) - 1);
+			if (len == -1) {
+				errno_exit(child->path);
+			}
+			target[len] = '\0';
+			child->target = xstrdup(target);
+			child->size = len;
+		}
+
+		node_add_child(dir, child);
+		if (S_ISDIR(st.st_mode)) {
+			walker_push(w, child);
+		}
+	}
+	if (errno) {
+		errno_exit(dir->path);
+	}
+	closedir(d);
+}
 
-	block_group_descriptor.bg_block_bitmap = BLOCK_BITMAP_BLOCKNO;
-	block_group_descriptor.bg_inode_bitmap = INODE_BITMAP_BLOCKNO;
-	block_group_descriptor.bg_inode_table = INODE_TABLE_BLOCKNO;
-	block_group_descriptor.bg_free_blocks_count = NUM_FREE_BLOCKS;
-	block_group_descriptor.bg_free_inodes_count = NUM_FREE_INODES;
-	block_group_descriptor.bg_used_dirs_count = DIRS_COUNT;
+void *walker_thread(void *arg) {
+	struct walker *w = arg;
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->queue_len == 0 && w->pending > 0) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->queue_len == 0) {
+			pthread_mutex_unlock(&w->lock);
+			return NULL;
+		}
+		struct node *dir = w->queue[--w->queue_len];
+		pthread_mutex_unlock(&w->lock);
+
+		walk_dir(w, dir);
+
+		pthread_mutex_lock(&w->lock);
+		if (--w->pending == 0) {
+			pthread_cond_broadcast(&w->cond);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+}
 
-	ssize_t size = sizeof(block_group_descriptor);
-	if (write(fd, &block_group_descriptor, size) != size) {
-		errno_exit("write");
+void run_threads(void *(*fn)(void *), void *arg, int num_threads) {
+	pthread_t *threads = xmalloc(num_threads * sizeof(*threads));
+	for (int i = 0; i < num_threads; i++) {
+		int err = pthread_create(&threads[i], NULL, fn, arg);
+		if (err) {
+			errno = err;
+			errno_exit("pthread_create");
+		}
 	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
 }
 
-void write_block_bitmap(int fd)
-{
-	off_t off = lseek(fd, BLOCK_OFFSET(BLOCK_BITMAP_BLOCKNO), SEEK_SET);
-	if (off == -1)
-	{
-		errno_exit("lseek");
-	}
-
-	u8 map_value[BLOCK_SIZE] = {0};
-	
-	// 1 bit = 1 block, thus 8 blocks per index
-	// First 23 blocks used to setup file system
-	// b7 b6 b5 b4 b3 b2 b1 b0 --> 8 7 6 5 4 3 2 1
-	// 1000 free blocks total in addition to starting 23 --> 1023 / 8 = 127r1
-	// Free blocks: 24-1023
-	map_value[0] = 0xFF; // 11111111 | 8
-	map_value[1] = 0xFF; // 11111111 | 8
-	map_value[2] = 0x7F; // 01111111 | 7
-	map_value[127] = 0x80; // 10000000, handle the remainder
+int compare_nodes(const void *a, const void *b) {
+	const struct node *x = *(struct node *const *) a;
+	const struct node *y = *(struct node *const *) b;
+	return strcmp(x->name, y->name);
+}
 
-	// Bitmap padding
-	for (int i = 128; i < BLOCK_SIZE; i++) {
-		map_value[i] = 0xFF;
+/* Threads finish directories in any order, so sort every directory by
+   name to make the image independent of scheduling. */
+void sort_tree(struct node *dir) {
+	qsort(dir->children, dir->num_children, sizeof(*dir->children),
+	      compare_nodes);
+	for (size_t i = 0; i < dir->num_children; i++) {
+		if (S_ISTYPE(dir->children[i]->mode, EXT2_S_IFDIR)) {
+			sort_tree(dir->children[i]);
+		}
 	}
+}
 
-	if (write(fd, map_value, BLOCK_SIZE) != BLOCK_SIZE)
-	{
-		errno_exit("write");
+/* Walk the host directory PATH with NUM_THREADS threads. */
+struct node *host_tree(const char *path, int num_threads) {
+	struct stat st;
+	if (stat(path, &st)) {
+		errno_exit(path);
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: not a directory\n", path);
+		exit(1);
 	}
+
+	struct node *root = node_new(NULL, "");
+	root->path = xstrdup(path);
+	node_set_stat(root, &st);
+
+	struct walker w = {0};
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	walker_push(&w, root);
+	run_threads(walker_thread, &w, num_threads);
+	free(w.queue);
+
+	sort_tree(root);
+	return root;
 }
 
-void write_inode_bitmap(int fd)
-{
-	off_t off = lseek(fd, BLOCK_OFFSET(INODE_BITMAP_BLOCKNO), SEEK_SET);
-	if (off == -1)
-	{
-		errno_exit("lseek");
+/* Append NODE to the *NUM_FILES nodes at *FILES. */
+void file_list_add(struct node ***files, size_t *num_files, struct node *node) {
+	if ((*num_files & (*num_files - 1)) == 0) {
+		*files = realloc(*files, (*num_files ? 2 * *num_files : 1)
+		                         * sizeof(**files));
+		if (*files == NULL) {
+			errno_exit("realloc");
+		}
+	}
+	(*files)[(*num_files)++] = node;
+}
+
+/* Add the nodes under NODE that are one of several names of a host file
+   to FILES, in tree order. */
+void collect_linked(struct node *node, struct node ***files,
+                    size_t *num_files) {
+	if (node->host_ino != 0) {
+		file_list_add(files, num_files, node);
+	}
+	for (size_t i = 0; i < node->num_children; i++) {
+		collect_linked(node->children[i], files, num_files);
 	}
+}
 
-	u8 map_value[BLOCK_SIZE] = {0};
+/* A name of a host file with several, and its place in tree order */
+struct host_name {
+	struct node *node;
+	size_t order;
+};
 
-	// First 13 inodes used to setup file system
-	// Free inodes: 14-128
-	map_value[0] = 0xFF; // 11111111 | 8
-	map_value[1] = 0x1F; // 00011111 | 5
+int compare_host_names(const void *a, const void *b) {
+	const struct host_name *x = a;
+	const struct host_name *y = b;
+	if (x->node->host_dev != y->node->host_dev) {
+		return x->node->host_dev < y->node->host_dev ? -1 : 1;
+	}
+	if (x->node->host_ino != y->node->host_ino) {
+		return x->node->host_ino < y->node->host_ino ? -1 : 1;
+	}
+	return x->order < y->order ? -1 : x->order > y->order;
+}
 
-	// Bitmap padding
-	for (int i = NUM_INODES / 8; i < BLOCK_SIZE; i++) {
-		map_value[i] = 0xFF;
+/* Find the names in the tree at ROOT that are hard links to the same
+   host file, by device and inode. The first in tree order keeps the
+   inode and the others link to it, so the file is stored once with the
+   right link count. A file with more than EXT2_LINK_MAX names starts a
+   new inode every EXT2_LINK_MAX names. Return the number of links. */
+u64 link_tree(struct node *root) {
+	struct node **files = NULL;
+	size_t num_files = 0;
+	collect_linked(root, &files, &num_files);
+
+	struct host_name *names = xmalloc((num_files + 1) * sizeof(*names));
+	for (size_t i = 0; i < num_files; i++) {
+		names[i].node = files[i];
+		names[i].order = i;
 	}
+	qsort(names, num_files, sizeof(*names), compare_host_names);
+
+	u64 num_links = 0;
+	struct node *first = NULL;
+	for (size_t i = 0; i < num_files; i++) {
+		struct node *node = names[i].node;
+		if (first != NULL && first->host_dev == node->host_dev
+		    && first->host_ino == node->host_ino
+		    && first->extra_names + 1 < EXT2_LINK_MAX) {
+			node->link = first;
+			first->extra_names++;
+			num_links++;
+		}
+		else {
+			first = node;
+		}
+	}
+	free(names);
+	free(files);
+	return num_links;
+}
+
+/* Add lost+found as the first entry of ROOT. */
+void add_lost_and_found(struct node *root) {
+	struct node *lost_and_found = node_new(root, "lost+found");
+	lost_and_found->mode = EXT2_S_IFDIR
+	                       | EXT2_S_IRUSR
+	                       | EXT2_S_IWUSR
+	                       | EXT2_S_IXUSR
+	                       | EXT2_S_IRGRP
+	                       | EXT2_S_IXGRP
+	                       | EXT2_S_IROTH
+	                       | EXT2_S_IXOTH;
+	lost_and_found->atime = root->atime;
+	lost_and_found->ctime = root->ctime;
+	lost_and_found->mtime = root->mtime;
+
+	node_add_child(root, lost_and_found);
+	memmove(root->children + 1, root->children,
+	        (root->num_children - 1) * sizeof(*root->children));
+	root->children[0] = lost_and_found;
+}
 
-	if (write(fd, map_value, BLOCK_SIZE) != BLOCK_SIZE)
-	{
-		errno_exit("write");
+/* Append an entry for INODE_NUM named NAME to the directory blocks at BUF,
+   of which *OFF bytes are used, starting a new block when the entry would
+   cross a block boundary. *LAST is the offset of the previous entry,
+   whose rec_len is stretched to the end of its block. BUF may be NULL
+   to only measure the directory. */
+void dir_add_entry(u8 *buf, size_t *off, size_t *last, u32 inode_num,
+                   char *name) {
+	struct ext2_dir_entry entry = {0};
+	dir_entry_set(entry, inode_num, name);
+
+	size_t block_left = geometry.block_size - *off % geometry.block_size;
+	if (entry.rec_len > block_left) {
+		if (buf) {
+			struct ext2_dir_entry *prev = (void *) (buf + *last);
+			prev->rec_len += block_left;
+		}
+		*off += block_left;
 	}
+	if (buf) {
+		memcpy(buf + *off, &entry, entry.rec_len);
+	}
+	*last = *off;
+	*off += entry.rec_len;
 }
 
-void write_inode(int fd, u32 index, struct ext2_inode *inode) {
-	off_t off = BLOCK_OFFSET(INODE_TABLE_BLOCKNO)
-	            + (index - 1) * sizeof(struct ext2_inode);
-	off = lseek(fd, off, SEEK_SET);
-	if (off == -1) {
-		errno_exit("lseek");
+/* Lay out the entries of DIR into BUF as a list, or only count them if
+   BUF is NULL. Return the number of blocks used. */
+u32 dir_pack_linear(struct node *dir, u8 *buf) {
+	size_t off = 0;
+	size_t last = 0;
+	dir_add_entry(buf, &off, &last, dir->ino, ".");
+	dir_add_entry(buf, &off, &last, dir->parent->ino, "..");
+	for (size_t i = 0; i < dir->num_children; i++) {
+		dir_add_entry(buf, &off, &last, dir->children[i]->ino,
+		              dir->children[i]->name);
 	}
 
-	ssize_t size = sizeof(struct ext2_inode);
-	if (write(fd, inode, size) != size) {
-		errno_exit("write");
+	u32 num_blocks = (off + geometry.block_size - 1) / geometry.block_size;
+	if (buf) {
+		struct ext2_dir_entry *prev = (void *) (buf + last);
+		prev->rec_len += num_blocks * geometry.block_size - off;
 	}
+	return num_blocks;
 }
 
-void write_inode_table(int fd) {
-	u32 current_time = get_current_time();
+/* The half MD4 transform of the ext2 directory hash. */
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s)                                           \
+	(a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+void half_md4_transform(u32 buf[4], const u32 in[8]) {
+	u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_ROUND(DX_F, a, b, c, d, in[0], 3);
+	DX_ROUND(DX_F, d, a, b, c, in[1], 7);
+	DX_ROUND(DX_F, c, d, a, b, in[2], 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3], 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4], 3);
+	DX_ROUND(DX_F, d, a, b, c, in[5], 7);
+	DX_ROUND(DX_F, c, d, a, b, in[6], 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7], 19);
+
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2, 3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2, 5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2, 9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2, 3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2, 5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2, 9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3, 3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3, 9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3, 3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3, 9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/* Return the unsigned half MD4 hash of NAME with the default seed, as the
+   kernel computes it to look NAME up in an indexed directory. */
+u32 dx_hash(const char *name) {
+	u32 buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	const u8 *p = (const u8 *) name;
+	int len = strlen(name);
+
+	while (len > 0) {
+		/* Pack up to 32 bytes into 8 words, padded with the length */
+		u32 in[8];
+		u32 pad = (u32) len | ((u32) len << 8);
+		pad |= pad << 16;
+		u32 val = pad;
+		int n = len < 32 ? len : 32;
+		int w = 0;
+		for (int i = 0; i < n; i++) {
+			val = p[i] + (val << 8);
+			if (i % 4 == 3) {
+				in[w++] = val;
+				val = pad;
+			}
+		}
+		if (w < 8) {
+			in[w++] = val;
+		}
+		while (w < 8) {
+			in[w++] = pad;
+		}
+
+		half_md4_transform(buf, in);
+		len -= 32;
+		p += 32;
+	}
 
-	struct ext2_inode lost_and_found_inode = {0};
-	lost_and_found_inode.i_mode = EXT2_S_IFDIR
-	                              | EXT2_S_IRUSR
-	                              | EXT2_S_IWUSR
-	                              | EXT2_S_IXUSR
-	                              | EXT2_S_IRGRP
-	                              | EXT2_S_IXGRP
-	                              | EXT2_S_IROTH
-	                              | EXT2_S_IXOTH;
-	lost_and_found_inode.i_uid = 0;
-	lost_and_found_inode.i_size = 1024;
-	lost_and_found_inode.i_atime = current_time;
-	lost_and_found_inode.i_ctime = current_time;
-	lost_and_found_inode.i_mtime = current_time;
-	lost_and_found_inode.i_dtime = 0;
-	lost_and_found_inode.i_gid = 0;
-	lost_and_found_inode.i_links_count = 2;
-	lost_and_found_inode.i_blocks = 2; /* These are oddly 512 blocks */
-	lost_and_found_inode.i_block[0] = LOST_AND_FOUND_DIR_BLOCKNO;
-	write_inode(fd, LOST_AND_FOUND_INO, &lost_and_found_inode);
+	u32 hash = buf[1] & ~1U;
+	if (hash == 0x7fffffff << 1) {
+		hash = (0x7fffffff - 1) << 1;  /* Reserved for end of directory */
+	}
+	return hash;
+}
 
-	/* The root directory and the lost+found should be
-	owned by uid 0 and gid 0 (root). The owner should have read, write, and execute permissions. The group and
-	other should have read and execute permissions */
+/* The header of the first block of an indexed directory, after its "."
+   and ".." entries, and the entries that follow it in every index
+   block. The first entry of a block holds the entry count and limit in
+   place of a hash. */
+struct dx_root_info {
+	u32 reserved_zero;
+	u8 hash_version;
+	u8 info_length;
+	u8 indirect_levels;
+	u8 unused_flags;
+};
 
-	// Root Directory
-	struct ext2_inode root_directory_inode = {0};
-	root_directory_inode.i_mode = EXT2_S_IFDIR
-								  | EXT2_S_IRUSR
-								  | EXT2_S_IWUSR
-								  | EXT2_S_IXUSR
-								  | EXT2_S_IRGRP
-								  | EXT2_S_IXGRP
-								  | EXT2_S_IROTH
-								  | EXT2_S_IXOTH;
-	root_directory_inode.i_uid = 0;
-	root_directory_inode.i_size = 1024;
-	root_directory_inode.i_atime = current_time;
-	root_directory_inode.i_ctime = current_time;
-	root_directory_inode.i_mtime = current_time;
-	root_directory_inode.i_dtime = 0;
-	root_directory_inode.i_gid = 0;
-	root_directory_inode.i_links_count = 3; // . .. and itself
-	root_directory_inode.i_blocks = 2;
-	root_directory_inode.i_block[0] = ROOT_DIR_BLOCKNO;
-	write_inode(fd, EXT2_ROOT_INO, &root_directory_inode);
+struct dx_entry {
+	u32 hash;
+	u32 block;
+};
 
-	/* The hello-world file and hello symlink should be owned by
-	uid 1000 and gid 1000 (typically the number of the first “normal” user). The owner should have read and write
-	permissions. The group and other should only have read permission. Your hello-world file should only be 12
-	bytes long and contain “Hello world” followed by a newline */
+struct dx_countlimit {
+	u16 limit;
+	u16 count;
+};
 
-	// Regular File named hello-world
-	struct ext2_inode hello_world_inode = {0};
-	hello_world_inode.i_mode = EXT2_S_IFREG
-							   | EXT2_S_IRUSR
-							   | EXT2_S_IWUSR
-							   | EXT2_S_IRGRP
-							   | EXT2_S_IROTH;
-	hello_world_inode.i_uid = 1000;
-	hello_world_inode.i_size = 12; // 12 bytes ("hello-world" + null byte)
-	hello_world_inode.i_atime = current_time;
-	hello_world_inode.i_ctime = current_time;
-	hello_world_inode.i_mtime = current_time;
-	hello_world_inode.i_dtime = 0;
-	hello_world_inode.i_gid = 1000;
-	hello_world_inode.i_links_count = 1;
-	hello_world_inode.i_blocks = 2;
-	hello_world_inode.i_block[0] = HELLO_WORLD_FILE_BLOCKNO;
-	write_inode(fd, HELLO_WORLD_INO, &hello_world_inode);
+struct dx_name {
+	u32 hash;
+	struct node *node;
+};
 
-	// Symbolic link named hello pointing to hello-world
-	struct ext2_inode hello_inode = {0};
-	hello_inode.i_mode = EXT2_S_IFLNK
-						 | EXT2_S_IRUSR
-						 | EXT2_S_IWUSR
-						 | EXT2_S_IRGRP
-						 | EXT2_S_IROTH;
-	hello_inode.i_uid = 1000;
-	hello_inode.i_size = 11;
-	hello_inode.i_atime = current_time;
-	hello_inode.i_ctime = current_time;
-	hello_inode.i_mtime = current_time;
-	hello_inode.i_dtime = 0;
-	hello_inode.i_gid = 1000;
-	hello_inode.i_links_count = 1;
-	hello_inode.i_blocks = 0;
-	char file_path[] = "hello-world";
-	memcpy((char*)hello_inode.i_block, file_path, 12); // instead of data blocks point point towards file
-	write_inode(fd, HELLO_INO, &hello_inode);
-}
-
-void write_root_dir_block(int fd)
-{
-	off_t off = BLOCK_OFFSET(ROOT_DIR_BLOCKNO);
-	off = lseek(fd, off, SEEK_SET);
-	if (off == -1) {
-		errno_exit("lseek");
+int compare_dx_names(const void *a, const void *b) {
+	const struct dx_name *x = a;
+	const struct dx_name *y = b;
+	if (x->hash != y->hash) {
+		return x->hash < y->hash ? -1 : 1;
 	}
+	return strcmp(x->node->name, y->node->name);
+}
+
+/* Fill the COUNT entries of an index block at ENTRIES, which has room
+   for LIMIT, with the first hashes and block numbers of the COUNT blocks
+   from FIRST_BLOCK. */
+void dx_fill(u8 *entries, u32 limit, u32 count, const u32 *hashes,
+             u32 first_block) {
+	struct dx_entry *e = (void *) entries;
+	struct dx_countlimit countlimit = {limit, count};
+	for (u32 i = 0; i < count; i++) {
+		e[i].hash = hashes[i];
+		e[i].block = first_block + i;
+	}
+	memcpy(&e[0].hash, &countlimit, sizeof(countlimit));
+}
+
+/* Pack the N entries of NAMES into leaf blocks at BUF, or only count the
+   blocks if BUF is NULL. Return the number of leaves, and unless HASHES is
+   NULL, the first hash of each in a new array at *HASHES. A leaf that
+   starts within a run of equal hashes gets the low bit set, so a lookup
+   goes on to it from the leaf before. */
+u32 dx_pack_leaves(struct dx_name *names, size_t n, u8 *buf, u32 **hashes) {
+	size_t off = 0;
+	size_t last = 0;
+	u32 num_leaves = 0;
+	for (size_t i = 0; i < n; i++) {
+		dir_add_entry(buf, &off, &last, names[i].node->ino, names[i].node->name);
+		if (last / geometry.block_size < num_leaves) {
+			continue;
+		}
+		if (hashes) {
+			*hashes = realloc(*hashes, (num_leaves + 1) * sizeof(**hashes));
+			if (*hashes == NULL) {
+				errno_exit("realloc");
+			}
+			(*hashes)[num_leaves] = names[i].hash;
+			if (i > 0 && names[i - 1].hash == names[i].hash) {
+				(*hashes)[num_leaves] |= 1;
+			}
+		}
+		num_leaves++;
+	}
+	if (buf && n > 0) {
+		struct ext2_dir_entry *prev = (void *) (buf + last);
+		prev->rec_len += num_leaves * geometry.block_size - off;
+	}
+	return num_leaves;
+}
+
+/* Lay out the entries of DIR into BUF as a hashed index, or only count
+   them if BUF is NULL. Return the number of blocks used.
+
+   Block 0 holds "." and "..", then the root of the index. With more
+   leaves than the root can point to, blocks 1 through N are a second
+   level of index blocks. The leaf blocks come last and hold the entries
+   sorted by hash, so a lookup reads one index block per level and one
+   leaf. */
+u32 dx_pack(struct node *dir, u8 *buf) {
+	u32 block_size = geometry.block_size;
+	size_t n = dir->num_children;
+	struct dx_name *names = xmalloc(n * sizeof(*names));
+	for (size_t i = 0; i < n; i++) {
+		names[i].hash = dx_hash(dir->children[i]->name);
+		names[i].node = dir->children[i];
+	}
+	qsort(names, n, sizeof(*names), compare_dx_names);
+
+	u32 *hashes = NULL;
+	u32 num_leaves = dx_pack_leaves(names, n, NULL, &hashes);
+	u32 root_limit = (block_size - 32) / sizeof(struct dx_entry);
+	u32 node_limit = (block_size - 8) / sizeof(struct dx_entry);
+	u32 num_nodes = num_leaves <= root_limit ? 0
+	                : (num_leaves + node_limit - 1) / node_limit;
+	if (num_nodes > root_limit) {
+		fprintf(stderr, "%s: too many entries to index (%zu)\n",
+		        node_path(dir), n);
+		exit(1);
+	}
+	if (buf == NULL) {
+		free(names);
+		free(hashes);
+		return 1 + num_nodes + num_leaves;
+	}
+
+	dx_pack_leaves(names, n, buf + (size_t) (1 + num_nodes) * block_size, NULL);
+
+	/* The root block: ".", then a ".." that covers the rest of the block
+	   for readers that do not know about the index */
+	struct ext2_dir_entry dot = {0};
+	dir_entry_set(dot, dir->ino, ".");
+	memcpy(buf, &dot, dot.rec_len);
+	struct ext2_dir_entry dotdot = {0};
+	dir_entry_set(dotdot, dir->parent->ino, "..");
+	memcpy(buf + dot.rec_len, &dotdot, dotdot.rec_len);
+	((struct ext2_dir_entry *) (buf + dot.rec_len))->rec_len = block_size - dot.rec_len;
+
+	struct dx_root_info info = {0, DX_HASH_HALF_MD4, sizeof(info), num_nodes > 0, 0};
+	u8 *root_entries = buf + dot.rec_len + dotdot.rec_len;
+	memcpy(root_entries, &info, sizeof(info));
+	root_entries += sizeof(info);
+
+	if (num_nodes == 0) {
+		dx_fill(root_entries, root_limit, num_leaves, hashes, 1);
+	}
+	else {
+		u32 *node_hashes = xmalloc(num_nodes * sizeof(*node_hashes));
+		for (u32 i = 0; i < num_nodes; i++) {
+			node_hashes[i] = hashes[i * node_limit];
+		}
+		dx_fill(root_entries, root_limit, num_nodes, node_hashes, 1);
+		free(node_hashes);
+
+		/* Each second-level block starts with an empty entry that spans
+		   the block, so it too looks like an empty directory block */
+		for (u32 i = 0; i < num_nodes; i++) {
+			u8 *block = buf + (size_t) (1 + i) * block_size;
+			struct ext2_dir_entry *fake = (void *) block;
+			fake->rec_len = block_size;
+			u32 first = i * node_limit;
+			u32 count = num_leaves - first < node_limit ? num_leaves - first
+			                                            : node_limit;
+			dx_fill(block + 8, node_limit, count, hashes + first,
+			        1 + num_nodes + first);
+		}
+	}
+	free(names);
+	free(hashes);
+	return 1 + num_nodes + num_leaves;
+}
 
-	ssize_t bytes_remaining = BLOCK_SIZE;
-	// .
-	struct ext2_dir_entry current_entry = {0};
-	dir_entry_set(current_entry, EXT2_ROOT_INO, ".");
-	dir_entry_write(current_entry, fd);
+/* Whether DIR gets a hashed index: only with --dir-index, and only when
+   its entries do not fit in one block. */
+int dir_indexed(struct node *dir) {
+	return geometry.dir_index && dir_pack_linear(dir, NULL) > 1;
+}
+
+/* Lay out the entries of DIR into BUF, or only count them if BUF is NULL.
+   Return the number of blocks used. */
+u32 dir_pack(struct node *dir, u8 *buf) {
+	if (dir_indexed(dir)) {
+		return dx_pack(dir, buf);
+	}
+	return dir_pack_linear(dir, buf);
+}
 
-	bytes_remaining -= current_entry.rec_len;
+/* Return the number of data blocks NODE needs. */
+u64 node_data_blocks(struct node *node) {
+	if (S_ISTYPE(node->mode, EXT2_S_IFDIR)) {
+		return dir_pack(node, NULL);
+	}
+	if (S_ISTYPE(node->mode, EXT2_S_IFREG)) {
+		return (node->size + geometry.block_size - 1) / geometry.block_size;
+	}
+	/* Targets too long for i_block go in a data block. Shorter ones are
+	   fast symlinks, stored in i_block itself, which the kernel and
+	   e2fsck accept for up to 59 bytes, 60 with the terminating NUL. */
+	if (S_ISTYPE(node->mode, EXT2_S_IFLNK)
+	    && node->size >= sizeof(((struct ext2_inode *) 0)->i_block)) {
+		return 1;
+	}
+	return 0;
+}
 
-	// ..
-	struct ext2_dir_entry parent_entry = {0};
-	dir_entry_set(parent_entry, EXT2_ROOT_INO, "..");
-	dir_entry_write(parent_entry, fd);
+int is_power_of(u32 n, u32 base) {
+	while (n > 1 && n % base == 0) {
+		n /= base;
+	}
+	return n == 1;
+}
 
-	bytes_remaining -= parent_entry.rec_len;
+/* With sparse_super only groups 0, 1 and powers of 3, 5 and 7 keep a
+   backup of the superblock and descriptor table; otherwise all do. */
+int group_has_super(u32 group) {
+	if (!geometry.sparse_super || group <= 1) {
+		return 1;
+	}
+	return is_power_of(group, 3) || is_power_of(group, 5)
+	       || is_power_of(group, 7);
+}
 
-	// Lost & Found Directory
-	struct ext2_dir_entry lost_and_found_entry = {0};
-	dir_entry_set(lost_and_found_entry, LOST_AND_FOUND_INO, "lost+found");
-	dir_entry_write(lost_and_found_entry, fd);
+u32 group_first_block(u32 group) {
+	return geometry.first_data_block + group * geometry.blocks_per_group;
+}
 
-	bytes_remaining -= lost_and_found_entry.rec_len;
+u32 group_num_blocks(u32 group) {
+	if (group == geometry.num_groups - 1) {
+		return geometry.blocks_count - group_first_block(group);
+	}
+	return geometry.blocks_per_group;
+}
 
-	// Hello World File
-	struct ext2_dir_entry hello_world_entry = {0};
-	dir_entry_set(hello_world_entry, HELLO_WORLD_INO, "hello-world");
-	dir_entry_write(hello_world_entry, fd);
+u32 group_block_bitmap(u32 group) {
+	u32 block = group_first_block(group);
+	if (group_has_super(group)) {
+		block += 1 + geometry.gdt_blocks;
+	}
+	return block;
+}
 
-	bytes_remaining -= hello_world_entry.rec_len;
+u32 group_inode_bitmap(u32 group) {
+	return group_block_bitmap(group) + 1;
+}
 
-	// Hello Symbolic Link
-	struct ext2_dir_entry hello_entry = {0};
-	dir_entry_set(hello_entry, HELLO_INO, "hello");
-	dir_entry_write(hello_entry, fd);
+u32 group_inode_table(u32 group) {
+	return group_block_bitmap(group) + 2;
+}
 
-	bytes_remaining -= hello_entry.rec_len;
+/* Return the first block of GROUP not taken by its metadata. */
+u32 group_data_start(u32 group) {
+	return group_inode_table(group) + geometry.inode_table_blocks;
+}
 
-	// Padding
-	struct ext2_dir_entry fill_entry = {0};
-	fill_entry.rec_len = bytes_remaining;
-	dir_entry_write(fill_entry, fd);
+u32 block_group(u32 block) {
+	return (block - geometry.first_data_block) / geometry.blocks_per_group;
 }
 
-void write_lost_and_found_dir_block(int fd) {
-	off_t off = BLOCK_OFFSET(LOST_AND_FOUND_DIR_BLOCKNO);
-	off = lseek(fd, off, SEEK_SET);
-	if (off == -1) {
-		errno_exit("lseek");
+/* Fix the geometry of an image of BLOCKS_COUNT blocks of BLOCK_SIZE bytes
+   with at least INODES_COUNT inodes. A last group too small for its own
+   metadata is dropped. */
+void geometry_init(u32 block_size, u64 blocks_count, u64 inodes_count,
+                   int sparse_super) {
+	struct geometry *g = &geometry;
+	g->block_size = block_size;
+	g->log_block_size = block_size == 1024 ? 0 : block_size == 2048 ? 1 : 2;
+	g->first_data_block = block_size == 1024 ? 1 : 0;
+	g->blocks_per_group = block_size * 8;
+
+	u32 inodes_per_block = block_size / sizeof(struct ext2_inode);
+	if (blocks_count > UINT32_MAX) {
+		fprintf(stderr, "%llu blocks: too many blocks (at most %u)\n",
+		        (unsigned long long) blocks_count, UINT32_MAX);
+		exit(1);
+	}
+	for (;;) {
+		if (blocks_count <= g->first_data_block) {
+			fprintf(stderr, "image too small\n");
+			exit(1);
+		}
+		g->blocks_count = blocks_count;
+		g->num_groups = (blocks_count - g->first_data_block
+		                 + g->blocks_per_group - 1) / g->blocks_per_group;
+		g->sparse_super = sparse_super && g->num_groups > 1;
+		g->gdt_blocks = (g->num_groups * sizeof(struct ext2_block_group_descriptor)
+		                 + block_size - 1) / block_size;
+
+		u64 per_group = (inodes_count + g->num_groups - 1) / g->num_groups;
+		per_group = (per_group + inodes_per_block - 1) / inodes_per_block
+		            * inodes_per_block;
+		if (per_group == 0) {
+			per_group = inodes_per_block;
+		}
+		if (per_group > block_size * 8
+		    || per_group * g->num_groups > UINT32_MAX) {
+			fprintf(stderr, "%llu inodes: too many inodes for %u groups\n",
+			        (unsigned long long) inodes_count, g->num_groups);
+			exit(1);
+		}
+		g->inodes_per_group = per_group;
+		g->inodes_count = per_group * g->num_groups;
+		g->inode_table_blocks = per_group / inodes_per_block;
+
+		u32 last = g->num_groups - 1;
+		if (group_data_start(last) < g->blocks_count) {
+			break;
+		}
+		if (last == 0) {
+			fprintf(stderr, "image too small\n");
+			exit(1);
+		}
+		blocks_count = group_first_block(last);
 	}
+}
 
-	ssize_t bytes_remaining = BLOCK_SIZE;
+/* Return the number of indirect blocks that map NUM_BLOCKS data blocks
+   past the direct ones, or UINT64_MAX if even triple indirection cannot. */
+u64 map_blocks(u64 num_blocks) {
+	u64 per_block = geometry.block_size / sizeof(u32);
+	u64 map = 0;
+	if (num_blocks <= EXT2_NDIR_BLOCKS) {
+		return 0;
+	}
+	num_blocks -= EXT2_NDIR_BLOCKS;
 
-	struct ext2_dir_entry current_entry = {0};
-	dir_entry_set(current_entry, LOST_AND_FOUND_INO, ".");
-	dir_entry_write(current_entry, fd);
+	// Indirect: one block of pointers to data blocks
+	map += 1;
+	if (num_blocks <= per_block) {
+		return map;
+	}
+	num_blocks -= per_block;
 
-	bytes_remaining -= current_entry.rec_len;
+	// Doubly indirect: one block of pointers to indirect blocks
+	u64 span = per_block * per_block;
+	if (num_blocks <= span) {
+		return map + 1 + (num_blocks + per_block - 1) / per_block;
+	}
+	map += 1 + per_block;
+	num_blocks -= span;
 
-	struct ext2_dir_entry parent_entry = {0};
-	dir_entry_set(parent_entry, EXT2_ROOT_INO, "..");
-	dir_entry_write(parent_entry, fd);
+	// Triply indirect
+	if (num_blocks > span * per_block) {
+		return UINT64_MAX;
+	}
+	return map + 1 + (num_blocks + span - 1) / span
+	       + (num_blocks + per_block - 1) / per_block;
+}
 
-	bytes_remaining -= parent_entry.rec_len;
+u64 rotl64(u64 x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
 
-	struct ext2_dir_entry fill_entry = {0};
-	fill_entry.rec_len = bytes_remaining;
-	dir_entry_write(fill_entry, fd);
+u64 fmix64(u64 k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
 }
 
-void write_hello_world_file_block(int fd)
-{
-	off_t off = BLOCK_OFFSET(HELLO_WORLD_FILE_BLOCKNO);
-	off = lseek(fd, off, SEEK_SET);
-	if (off == -1) {
-		errno_exit("lseek");
+/* Hash SIZE bytes of BUF into the 128-bit H, which seeds the hash, so
+   that hashes can be chained. This is MurmurHash3 (x64, 128 bits) with a
+   128-bit seed: fast, and good enough to tell blocks apart, though not
+   against someone crafting collisions. */
+void hash128(const void *buf, size_t size, u64 h[2]) {
+	const u64 c1 = 0x87c37b91114253d5ULL;
+	const u64 c2 = 0x4cf5ad432745937fULL;
+	const u8 *p = buf;
+	u64 h1 = h[0];
+	u64 h2 = h[1];
+	u64 k1, k2;
+
+	size_t n = size / 16;
+	for (size_t i = 0; i < n; i++) {
+		memcpy(&k1, p + 16 * i, 8);
+		memcpy(&k2, p + 16 * i + 8, 8);
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
 	}
 
-	char content[] = "Hello world\n";
-	ssize_t size = sizeof(content);
-	if (write(fd, content, size) != size) {
-		errno_exit("write");                       
+	u8 tail[16] = {0};
+	memcpy(tail, p + 16 * n, size % 16);
+	memcpy(&k1, tail, 8);
+	memcpy(&k2, tail + 8, 8);
+	k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+	k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+
+	h1 ^= size;
+	h2 ^= size;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	h[0] = h1;
+	h[1] = h2;
+}
+
+/* Return the slot of TABLE that holds KEY, or the free slot where it
+   would go. */
+size_t block_table_slot(struct block_table *table, const u64 key[2]) {
+	size_t i = key[0] & (table->cap - 1);
+	while (table->blocks[i] != 0
+	       && (table->keys[i][0] != key[0] || table->keys[i][1] != key[1])) {
+		i = (i + 1) & (table->cap - 1);
 	}
+	return i;
 }
 
-int main(int argc, char *argv[]) {
-	int fd = open("cs111-base.img", O_CREAT | O_WRONLY, 0666);
-	if (fd == -1) {
-		errno_exit("open");
+/* Return the block TABLE holds for KEY, or 0 if there is none. */
+u32 block_table_find(struct block_table *table, const u64 key[2]) {
+	if (table->cap == 0) {
+		return 0;
 	}
+	return table->blocks[block_table_slot(table, key)];
+}
 
-	if (ftruncate(fd, 0)) {
-		errno_exit("ftruncate");
+/* Record BLOCKNO, which is not 0, as holding the block hashed to KEY,
+   which is not in TABLE yet. */
+void block_table_add(struct block_table *table, const u64 key[2], u32 blockno) {
+	if (2 * (table->len + 1) > table->cap) {
+		struct block_table old = *table;
+		table->cap = old.cap ? 2 * old.cap : 1024;
+		table->keys = xmalloc(table->cap * sizeof(*table->keys));
+		table->blocks = calloc(table->cap, sizeof(*table->blocks));
+		if (table->blocks == NULL) {
+			errno_exit("calloc");
+		}
+		for (size_t i = 0; i < old.cap; i++) {
+			if (old.blocks[i] != 0) {
+				size_t j = block_table_slot(table, old.keys[i]);
+				memcpy(table->keys[j], old.keys[i], sizeof(old.keys[i]));
+				table->blocks[j] = old.blocks[i];
+			}
+		}
+		free(old.keys);
+		free(old.blocks);
 	}
-	if (ftruncate(fd, NUM_BLOCKS * BLOCK_SIZE)) {
-		errno_exit("ftruncate");
+	size_t i = block_table_slot(table, key);
+	memcpy(table->keys[i], key, sizeof(table->keys[i]));
+	table->blocks[i] = blockno;
+	table->len++;
+}
+
+void block_table_free(struct block_table *table) {
+	free(table->keys);
+	free(table->blocks);
+	memset(table, 0, sizeof(*table));
+}
+
+int is_hole_hash(const u64 hash[2]) {
+	return hash[0] == 0 && hash[1] == 0;
+}
+
+/* Return the number of the NUM_BLOCKS data blocks of NODE that neither
+   are zeros nor repeat a block already in TABLE, adding them to TABLE:
+   the blocks --dedup allocates for NODE. */
+u64 dedup_blocks(struct block_table *table, struct node *node, u64 num_blocks) {
+	u64 unique = 0;
+	for (u64 i = 0; i < num_blocks; i++) {
+		const u64 *hash = node->block_hashes[i];
+		if (is_hole_hash(hash) || block_table_find(table, hash)) {
+			continue;
+		}
+		block_table_add(table, hash, 1);
+		unique++;
 	}
+	return unique;
+}
 
-	write_superblock(fd);
-	write_block_group_descriptor_table(fd);
-	write_block_bitmap(fd);
-	write_inode_bitmap(fd);
-	write_inode_table(fd);
-	write_root_dir_block(fd);
-	write_lost_and_found_dir_block(fd);
-	write_hello_world_file_block(fd);
+/* Count the inodes and data blocks the tree at NODE needs. With --dedup,
+   TABLE holds the file blocks counted so far. */
+void count_tree(struct node *node, struct block_table *table,
+                u64 *num_inodes, u64 *num_blocks) {
+	if (node->link) {
+		return;
+	}
+	u64 data = node_data_blocks(node);
+	u64 map = map_blocks(data);
+	if (node->block_hashes) {
+		data = dedup_blocks(table, node, data);
+	}
+	*num_inodes += 1;
+	*num_blocks += data + map;
+	for (size_t i = 0; i < node->num_children; i++) {
+		count_tree(node->children[i], table, num_inodes, num_blocks);
+	}
+}
 
-	if (close(fd)) {
-		errno_exit("close");
+/* Choose the smallest geometry with BLOCK_SIZE blocks that holds the
+   tree at ROOT, and at least INODES_COUNT inodes if it is not zero. */
+void geometry_fit(struct node *root, u32 block_size, u64 inodes_count,
+                  int sparse_super) {
+	geometry.block_size = block_size;
+	u64 num_inodes = 0;
+	u64 num_blocks = 0;
+	struct block_table table = {0};
+	count_tree(root, &table, &num_inodes, &num_blocks);
+	block_table_free(&table);
+	/* The root is one of the reserved inodes */
+	num_inodes += EXT2_GOOD_OLD_FIRST_INO - 2;
+	if (inodes_count < num_inodes) {
+		inodes_count = num_inodes;
+	}
+
+	/* Start from one group: superblock, descriptors, bitmaps, inode table */
+	u32 inodes_per_block = block_size / sizeof(struct ext2_inode);
+	u64 blocks_count = (block_size == 1024) + 4
+	                   + (inodes_count + inodes_per_block - 1) / inodes_per_block
+	                   + num_blocks;
+	/* A group holds at most one inode per bit of its inode bitmap */
+	u64 min_groups = (inodes_count + block_size * 8 - 1) / (block_size * 8);
+	if (min_groups > 1 && blocks_count < (block_size == 1024) + min_groups * block_size * 8) {
+		blocks_count = (block_size == 1024) + min_groups * block_size * 8;
+	}
+	for (;;) {
+		geometry_init(block_size, blocks_count, inodes_count, sparse_super);
+		u64 capacity = 0;
+		for (u32 g = 0; g < geometry.num_groups; g++) {
+			capacity += group_first_block(g) + group_num_blocks(g)
+			            - group_data_start(g);
+		}
+		if (capacity >= num_blocks) {
+			return;
+		}
+		/* Grow what was asked for, not what geometry_init() kept, so
+		   that a runt last group cannot be dropped forever */
+		blocks_count += num_blocks - capacity;
+	}
+}
+
+int bit_test(const u8 *map, u64 i) {
+	return map[i / 8] >> (i % 8) & 1;
+}
+
+int layout_inode_used(struct layout *layout, u32 ino) {
+	return bit_test(layout->inode_map, ino - 1);
+}
+
+void layout_use_inode(struct layout *layout, u32 ino) {
+	assert(!layout_inode_used(layout, ino));
+	layout->inode_map[(ino - 1) / 8] |= 1 << ((ino - 1) % 8);
+	layout->group_inodes[(ino - 1) / geometry.inodes_per_group]++;
+}
+
+void layout_free_inode(struct layout *layout, u32 ino) {
+	assert(layout_inode_used(layout, ino));
+	layout->inode_map[(ino - 1) / 8] &= ~(1 << ((ino - 1) % 8));
+	layout->group_inodes[(ino - 1) / geometry.inodes_per_group]--;
+}
+
+int layout_block_used(struct layout *layout, u32 blockno) {
+	return bit_test(layout->block_map, blockno - geometry.first_data_block);
+}
+
+void layout_use_block(struct layout *layout, u32 blockno) {
+	u32 i = blockno - geometry.first_data_block;
+	assert(!layout_block_used(layout, blockno));
+	layout->block_map[i / 8] |= 1 << (i % 8);
+	layout->group_blocks[block_group(blockno)]++;
+}
+
+void layout_free_block(struct layout *layout, u32 blockno) {
+	u32 i = blockno - geometry.first_data_block;
+	assert(layout_block_used(layout, blockno));
+	layout->block_map[i / 8] &= ~(1 << (i % 8));
+	layout->group_blocks[block_group(blockno)]--;
+}
+
+u32 inode_group(u32 ino) {
+	return (ino - 1) / geometry.inodes_per_group;
+}
+
+u32 group_free_inodes(struct layout *layout, u32 group) {
+	return geometry.inodes_per_group - layout->group_inodes[group];
+}
+
+u32 group_free_blocks(struct layout *layout, u32 group) {
+	return group_num_blocks(group) - layout->group_blocks[group];
+}
+
+/* Return the number of blocks of GROUP in use past its metadata. */
+u32 group_used_data(struct layout *layout, u32 group) {
+	return layout->group_blocks[group] - (group_data_start(group) - group_first_block(group));
+}
+
+/* Start a layout with only the group metadata and the reserved inodes in
+   use. */
+void layout_init(struct layout *layout) {
+	memset(layout, 0, sizeof(*layout));
+	layout->inode_map = calloc((geometry.inodes_count + 7) / 8, 1);
+	layout->block_map = calloc((geometry.blocks_count - geometry.first_data_block + 7) / 8, 1);
+	layout->group_inodes = calloc(geometry.num_groups, sizeof(*layout->group_inodes));
+	layout->group_blocks = calloc(geometry.num_groups, sizeof(*layout->group_blocks));
+	layout->group_dirs = calloc(geometry.num_groups, sizeof(*layout->group_dirs));
+	layout->group_next_ino = calloc(geometry.num_groups, sizeof(*layout->group_next_ino));
+	layout->group_next_block = calloc(geometry.num_groups, sizeof(*layout->group_next_block));
+	if (layout->inode_map == NULL || layout->block_map == NULL
+	    || layout->group_inodes == NULL || layout->group_blocks == NULL
+	    || layout->group_dirs == NULL || layout->group_next_ino == NULL
+	    || layout->group_next_block == NULL) {
+		errno_exit("calloc");
+	}
+	for (u32 g = 0; g < geometry.num_groups; g++) {
+		for (u32 b = group_first_block(g); b < group_data_start(g); b++) {
+			layout_use_block(layout, b);
+		}
+		layout->group_next_ino[g] = g * geometry.inodes_per_group + 1;
+		layout->group_next_block[g] = group_data_start(g);
+	}
+	for (u32 ino = 1; ino < EXT2_GOOD_OLD_FIRST_INO; ino++) {
+		layout_use_inode(layout, ino);
+	}
+	layout->write_time = get_current_time();
+}
+
+/* Return the first free inode of GROUP, or of the groups after it,
+   wrapping around to the first. */
+u32 alloc_inode(struct layout *layout, struct node *node, u32 group) {
+	for (u32 n = 0; n < geometry.num_groups; n++) {
+		u32 g = (group + n) % geometry.num_groups;
+		if (group_free_inodes(layout, g) == 0) {
+			continue;
+		}
+		u32 ino = layout->group_next_ino[g];
+		while (layout_inode_used(layout, ino)) {
+			ino++;
+		}
+		layout_use_inode(layout, ino);
+		layout->group_next_ino[g] = ino + 1;
+		return ino;
+	}
+	fprintf(stderr, "%s: out of inodes (%u)\n", node_path(node),
+	        geometry.inodes_count);
+	exit(1);
+}
+
+void layout_add_dir(struct layout *layout, u32 ino) {
+	layout->dirs_count++;
+	layout->group_dirs[inode_group(ino)]++;
+}
+
+/* Choose the group for the inode of the new directory DIR, as Linux's
+   find_group_orlov() does. Top-level directories go where there are the
+   fewest directories among the groups with no more than the average
+   inodes and data blocks in use, so that unrelated trees start far
+   apart. Data blocks rather than free blocks, or the groups that back
+   up the superblock would never qualify. Deeper directories stay in
+   their parent's group, or the next one after it, while it has room to
+   spare and not too many directories already. */
+u32 dir_group(struct layout *layout, struct node *dir) {
+	u32 num_groups = geometry.num_groups;
+	u32 parent_group = inode_group(dir->parent->ino);
+	u64 free_inodes = 0;
+	u64 free_blocks = 0;
+	u64 used_data = 0;
+	for (u32 g = 0; g < num_groups; g++) {
+		free_inodes += group_free_inodes(layout, g);
+		free_blocks += group_free_blocks(layout, g);
+		used_data += group_used_data(layout, g);
+	}
+	u64 avg_free_inodes = free_inodes / num_groups;
+	u64 avg_free_blocks = free_blocks / num_groups;
+	u64 avg_used_data = (used_data + num_groups - 1) / num_groups;
+
+	if (dir->parent->ino == EXT2_ROOT_INO) {
+		/* lost+found stays next to the root, where mke2fs puts it */
+		if (strcmp(dir->name, "lost+found") == 0) {
+			return parent_group;
+		}
+		u32 best = num_groups;
+		for (u32 g = 0; g < num_groups; g++) {
+			if (group_free_inodes(layout, g) >= avg_free_inodes
+			    && group_used_data(layout, g) <= avg_used_data
+			    && (best == num_groups || layout->group_dirs[g] < layout->group_dirs[best])) {
+				best = g;
+			}
+		}
+		if (best < num_groups) {
+			return best;
+		}
+	}
+	else {
+		u32 max_dirs = layout->dirs_count / num_groups + geometry.inodes_per_group / 16;
+		long long min_inodes = (long long) avg_free_inodes - geometry.inodes_per_group / 4;
+		long long min_blocks = (long long) avg_free_blocks - geometry.blocks_per_group / 4;
+		for (u32 n = 0; n < num_groups; n++) {
+			u32 g = (parent_group + n) % num_groups;
+			if (layout->group_dirs[g] < max_dirs
+			    && group_free_inodes(layout, g) > 0
+			    && group_free_inodes(layout, g) >= min_inodes
+			    && group_free_blocks(layout, g) >= min_blocks) {
+				return g;
+			}
+		}
+	}
+	for (u32 n = 0; n < num_groups; n++) {
+		u32 g = (parent_group + n) % num_groups;
+		if (group_free_inodes(layout, g) > 0
+		    && group_free_inodes(layout, g) >= avg_free_inodes) {
+			return g;
+		}
+	}
+	return parent_group;
+}
+
+/* Append LEN blocks from BLOCKNO, or LEN holes if it is 0, to the
+   *NUM_EXTENTS extents at *EXTENTS. */
+void extent_append(struct extent **extents, u32 *num_extents, u32 blockno,
+                   u32 len, int shared) {
+	if (*num_extents > 0) {
+		struct extent *last = &(*extents)[*num_extents - 1];
+		if (last->shared == shared
+		    && (blockno == 0 ? last->start == 0
+		                     : last->start != 0 && last->start + last->len == blockno)) {
+			last->len += len;
+			return;
+		}
+	}
+	if ((*num_extents & (*num_extents - 1)) == 0) {
+		*extents = realloc(*extents, (*num_extents ? 2 * *num_extents : 1)
+		                             * sizeof(**extents));
+		if (*extents == NULL) {
+			errno_exit("realloc");
+		}
+	}
+	(*extents)[(*num_extents)++] = (struct extent) {blockno, len, shared};
+}
+
+/* Return the first free block of GROUP, or its end if it has none. */
+u32 group_first_free(struct layout *layout, u32 group) {
+	u32 end = group_first_block(group) + group_num_blocks(group);
+	u32 blockno = layout->group_next_block[group];
+	while (blockno < end && layout_block_used(layout, blockno)) {
+		blockno++;
+	}
+	layout->group_next_block[group] = blockno;
+	return blockno;
+}
+
+/* Return the start of the first run of LEN free blocks in GROUP, or 0
+   if there is none. */
+u32 find_run(struct layout *layout, u32 group, u32 len) {
+	u32 end = group_first_block(group) + group_num_blocks(group);
+	u32 start = group_first_free(layout, group);
+	while (end - start >= len) {
+		u32 n = 0;
+		while (n < len && !layout_block_used(layout, start + n)) {
+			n++;
+		}
+		if (n == len) {
+			return start;
+		}
+		start += n + 1;
+		while (start < end && layout_block_used(layout, start)) {
+			start++;
+		}
+	}
+	return 0;
+}
+
+/* Allocate NUM_BLOCKS blocks into *EXTENTS, preferring GROUP. They are
+   one run in the first group from GROUP on that has one free, or else
+   the first free blocks from the first group with no data in it, or
+   from GROUP if every group has some. That keeps a file too large for
+   one group in one run but for the metadata of the groups it spans. */
+void alloc_extents(struct layout *layout, struct node *node, u32 num_blocks,
+                   u32 group, struct extent **extents, u32 *num_extents) {
+	*extents = NULL;
+	*num_extents = 0;
+	if (num_blocks == 0) {
+		return;
+	}
+	for (u32 n = 0; n < geometry.num_groups; n++) {
+		u32 g = (group + n) % geometry.num_groups;
+		u32 start = group_free_blocks(layout, g) >= num_blocks
+		            ? find_run(layout, g, num_blocks) : 0;
+		if (start) {
+			for (u32 i = 0; i < num_blocks; i++) {
+				layout_use_block(layout, start + i);
+			}
+			extent_append(extents, num_extents, start, num_blocks, 0);
+			return;
+		}
+	}
+	u32 from = group;
+	for (u32 n = 0; n < geometry.num_groups; n++) {
+		u32 g = (group + n) % geometry.num_groups;
+		if (group_used_data(layout, g) == 0) {
+			from = g;
+			break;
+		}
+	}
+	for (u32 n = 0; n < geometry.num_groups && num_blocks > 0; n++) {
+		u32 g = (from + n) % geometry.num_groups;
+		u32 end = group_first_block(g) + group_num_blocks(g);
+		for (u32 b = group_first_free(layout, g); b < end && num_blocks > 0; b++) {
+			if (!layout_block_used(layout, b)) {
+				layout_use_block(layout, b);
+				extent_append(extents, num_extents, b, 1, 0);
+				num_blocks--;
+			}
+		}
+	}
+	if (num_blocks > 0) {
+		fprintf(stderr, "%s: out of blocks (%u)\n", node_path(node),
+		        geometry.blocks_count);
+		exit(1);
+	}
+}
+
+u32 alloc_block(struct layout *layout, struct node *node) {
+	struct extent *extent;
+	u32 num_extents;
+	alloc_extents(layout, node, 1, inode_group(node->ino), &extent, &num_extents);
+	u32 blockno = extent->start;
+	free(extent);
+	return blockno;
+}
+
+/* Give NODE its NUM_BLOCKS data blocks for --dedup: a hole for a block
+   of zeros, the block of the first copy for a repeated block, and a new
+   block otherwise. */
+void alloc_dedup(struct layout *layout, struct node *node, u64 num_blocks) {
+	node->extents = NULL;
+	node->num_extents = 0;
+	for (u64 i = 0; i < num_blocks; i++) {
+		const u64 *hash = node->block_hashes[i];
+		if (is_hole_hash(hash)) {
+			extent_append(&node->extents, &node->num_extents, 0, 1, 1);
+			node->num_holes++;
+			continue;
+		}
+		u32 blockno = block_table_find(&layout->dedup, hash);
+		if (blockno) {
+			extent_append(&node->extents, &node->num_extents, blockno, 1, 1);
+			layout->shared_blocks++;
+			continue;
+		}
+		blockno = alloc_block(layout, node);
+		block_table_add(&layout->dedup, hash, blockno);
+		extent_append(&node->extents, &node->num_extents, blockno, 1, 0);
+	}
+}
+
+/* Walks the blocks of a list of extents in order. */
+struct block_iter {
+	struct extent *extents;
+	u32 num_extents;
+	u32 e;
+	u32 k;
+};
+
+u32 block_iter_next(struct block_iter *it) {
+	assert(it->e < it->num_extents);
+	u32 start = it->extents[it->e].start;
+	u32 blockno = start ? start + it->k : 0;  /* A hole */
+	if (++it->k == it->extents[it->e].len) {
+		it->e++;
+		it->k = 0;
+	}
+	return blockno;
+}
+
+/* Move the next N blocks of IT to the *NUM_EXTENTS extents at *EXTENTS. */
+void take_blocks(struct block_iter *it, u64 n, struct extent **extents,
+                 u32 *num_extents) {
+	while (n > 0) {
+		struct extent *extent = &it->extents[it->e];
+		u32 len = extent->len - it->k < n ? extent->len - it->k : n;
+		extent_append(extents, num_extents, extent->start + it->k, len, 0);
+		it->k += len;
+		if (it->k == extent->len) {
+			it->e++;
+			it->k = 0;
+		}
+		n -= len;
+	}
+}
+
+/* Give NODE its data blocks FIRST to FIRST + N - 1 from IT, except for
+   those in NODE->host_holes, which stay holes. */
+void take_data(struct block_iter *it, struct node *node, u64 first, u64 n) {
+	u64 end = first + n;
+	for (u32 h = 0; h < node->num_host_holes && first < end; h++) {
+		u64 hole = node->host_holes[h].start;
+		u64 hole_end = hole + node->host_holes[h].len;
+		if (hole_end <= first) {
+			continue;
+		}
+		if (hole >= end) {
+			break;
+		}
+		if (hole > first) {
+			take_blocks(it, hole - first, &node->extents, &node->num_extents);
+			first = hole;
+		}
+		u64 len = (hole_end < end ? hole_end : end) - first;
+		extent_append(&node->extents, &node->num_extents, 0, len, 1);
+		first += len;
+	}
+	take_blocks(it, end - first, &node->extents, &node->num_extents);
+}
+
+/* Give NODE the next indirect block from RUN, then the next *LEFT data
+   blocks it maps through LEVEL more levels of indirect blocks, in the
+   order write_map() visits them. */
+void split_map(struct block_iter *run, struct node *node, int level, u64 *left) {
+	u64 per_block = geometry.block_size / sizeof(u32);
+	take_blocks(run, 1, &node->map_extents, &node->num_map_extents);
+	if (level == 0) {
+		u64 n = *left < per_block ? *left : per_block;
+		take_data(run, node, node->num_blocks - *left, n);
+		*left -= n;
+		return;
+	}
+	for (u64 i = 0; i < per_block && *left > 0; i++) {
+		split_map(run, node, level - 1, left);
+	}
+}
+
+/* Share out the blocks at EXTENTS between NODE's data and indirect
+   blocks, each indirect block right before the data blocks it maps, as
+   Linux lays files out. Reading the file front to back then never goes
+   back, and e2fsck counts it as contiguous. */
+void split_blocks(struct node *node, struct extent *extents, u32 num_extents) {
+	struct block_iter run = {extents, num_extents, 0, 0};
+	u64 left = node->num_blocks;
+	u64 n = left < EXT2_NDIR_BLOCKS ? left : EXT2_NDIR_BLOCKS;
+	node->extents = NULL;
+	node->num_extents = 0;
+	node->map_extents = NULL;
+	node->num_map_extents = 0;
+	take_data(&run, node, 0, n);
+	left -= n;
+	for (int level = 0; level < 3 && left > 0; level++) {
+		split_map(&run, node, level, &left);
+	}
+}
+
+/* Find the runs of whole blocks that NODE's sparse host file has no data
+   in, so that they stay holes in the image rather than taking blocks of
+   zeros. */
+void find_host_holes(struct node *node) {
+#ifdef SEEK_HOLE
+	int src = open_source(node->path, 0);
+	if (src == -1) {
+		errno_exit(node->path);
+	}
+	u64 end = node_data_blocks(node) * geometry.block_size;
+	off_t pos = 0;
+	while ((u64) pos < node->size) {
+		off_t hole = lseek(src, pos, SEEK_HOLE);
+		if (hole == -1) {
+			errno_exit(node->path);
+		}
+		if ((u64) hole >= node->size) {
+			break;
+		}
+		/* No more data means the hole runs to the end of the file */
+		off_t data = lseek(src, hole, SEEK_DATA);
+		if (data == -1 && errno != ENXIO) {
+			errno_exit(node->path);
+		}
+		u64 hole_end = data == -1 || (u64) data > end ? end : (u64) data;
+		u64 first = (hole + geometry.block_size - 1) / geometry.block_size;
+		u64 last = hole_end / geometry.block_size;
+		if (last > first) {
+			extent_append(&node->host_holes, &node->num_host_holes, first,
+			              last - first, 1);
+			node->num_holes += last - first;
+		}
+		if (data == -1) {
+			break;
+		}
+		pos = data;
+	}
+	if (close(src)) {
+		errno_exit("close");
+	}
+#endif
+}
+
+/* Give NODE NUM_BLOCKS data blocks and the indirect blocks that map
+   them, all in one run near its inode if there is room. With --dedup
+   the indirect blocks come first, then the data blocks as they are
+   found to be new. */
+void alloc_blocks(struct layout *layout, struct node *node, u64 num_blocks) {
+	if (node->sparse && node->path && !node->block_hashes) {
+		find_host_holes(node);
+	}
+	u64 num_map_blocks = map_blocks(num_blocks);
+	if (num_map_blocks == UINT64_MAX
+	    || (!node->block_hashes
+	        && num_blocks - node->num_holes + num_map_blocks > geometry.blocks_count)
+	    || (num_blocks + num_map_blocks) * (geometry.block_size / 512) > UINT32_MAX) {
+		fprintf(stderr, "%s: too large (%llu blocks)\n", node_path(node),
+		        (unsigned long long) num_blocks);
+		exit(1);
+	}
+	node->num_map_blocks = num_map_blocks;
+	node->num_blocks = num_blocks;
+	u32 group = inode_group(node->ino);
+	if (node->block_hashes) {
+		alloc_extents(layout, node, num_map_blocks, group, &node->map_extents,
+		              &node->num_map_extents);
+		alloc_dedup(layout, node, num_blocks);
+		return;
+	}
+	struct extent *extents;
+	u32 num_extents;
+	alloc_extents(layout, node, num_blocks - node->num_holes + num_map_blocks, group,
+	              &extents, &num_extents);
+	split_blocks(node, extents, num_extents);
+	free(extents);
+	free(node->host_holes);
+	node->host_holes = NULL;
+	node->num_host_holes = 0;
+}
+
+/* Give NODE's children inode numbers, directories in the group
+   dir_group() picks and the rest in NODE's, then give NODE and its
+   subtree data blocks. NODE itself was numbered by its parent. */
+void layout_node(struct layout *layout, struct node *node) {
+	if (node->link) {
+		return;
+	}
+	for (size_t i = 0; i < node->num_children; i++) {
+		struct node *child = node->children[i];
+		if (child->ino != 0 || child->link) {
+			continue;
+		}
+		if (S_ISTYPE(child->mode, EXT2_S_IFDIR)) {
+			child->ino = alloc_inode(layout, child, dir_group(layout, child));
+			layout_add_dir(layout, child->ino);
+		}
+		else {
+			child->ino = alloc_inode(layout, child, inode_group(node->ino));
+		}
+	}
+
+	if (S_ISTYPE(node->mode, EXT2_S_IFDIR)) {
+		node->links_count = 2;
+		for (size_t i = 0; i < node->num_children; i++) {
+			if (S_ISTYPE(node->children[i]->mode, EXT2_S_IFDIR)) {
+				node->links_count++;
+			}
+		}
+	}
+	else {
+		node->links_count = 1 + node->extra_names;
+	}
+	u64 num_blocks = node_data_blocks(node);
+	if (S_ISTYPE(node->mode, EXT2_S_IFDIR)) {
+		node->size = num_blocks * geometry.block_size;
+	}
+	if (node->size > INT32_MAX) {
+		layout->large_file = 1;
+	}
+	if (!node->keep_blocks) {
+		alloc_blocks(layout, node, num_blocks);
+	}
+
+	for (size_t i = 0; i < node->num_children; i++) {
+		layout_node(layout, node->children[i]);
+	}
+}
+
+/* Give every later name of a file the inode of its first. */
+void resolve_links(struct node *node) {
+	if (node->link) {
+		node->ino = node->link->ino;
+	}
+	for (size_t i = 0; i < node->num_children; i++) {
+		resolve_links(node->children[i]);
+	}
+}
+
+/* Count the directories under NODE that already have an inode: the
+   root, and with --update those kept from the image. */
+void count_dirs(struct layout *layout, struct node *node) {
+	if (node->ino != 0 && S_ISTYPE(node->mode, EXT2_S_IFDIR)) {
+		layout_add_dir(layout, node->ino);
+	}
+	for (size_t i = 0; i < node->num_children; i++) {
+		count_dirs(layout, node->children[i]);
+	}
+}
+
+/* Number every inode and allocate every data block of the tree at ROOT
+   that does not have them yet. Inodes 2 through 10 are reserved, so in a
+   new image lost+found, the first entry of the root directory, is
+   inode 11. */
+void layout_tree(struct layout *layout, struct node *root) {
+	root->ino = EXT2_ROOT_INO;
+	count_dirs(layout, root);
+	layout_node(layout, root);
+	resolve_links(root);
+}
+
+/* Return the number of blocks of GROUP in use after LAYOUT. */
+u32 group_used_blocks(struct layout *layout, u32 group) {
+	return layout->group_blocks[group];
+}
+
+u32 group_used_inodes(struct layout *layout, u32 group) {
+	return layout->group_inodes[group];
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* The image being built. Metadata, directory and built-in file blocks
+   are assembled in CACHE, one buffer for each block written so far, and
+   reach the disk in image_flush() as runs of consecutive blocks, one
+   pwritev() per run. File contents bypass the cache: the copy threads
+   pwrite() them straight to FD in large chunks.
+
+   A new image reads as zeros until written, so blocks that are all zeros
+   are never written: in a regular file they stay holes. When an image is
+   updated in place, cached blocks are compared with what it holds, and
+   only the ones that differ are written. */
+struct image {
+	int fd;
+	u32 num_blocks;
+	u8 **cache;
+	int update;
+	u8 *old_block;     /* For comparing cached blocks, with UPDATE */
+
+	/* I/O done for --stats, updated atomically by the copy threads */
+	u64 read_calls;
+	u64 write_calls;
+	u64 bytes_written;
+	u64 zero_blocks;   /* Blocks of zeros skipped */
+	u64 unchanged_blocks;  /* Cached blocks the updated image already held */
+};
+
+int is_zero(const u8 *buf, size_t size) {
+	return size == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0);
+}
+
+/* Zero SIZE bytes of FD at OFF, by discarding them if FD supports it. */
+void zero_range(int fd, off_t off, off_t size) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, size) == 0) {
+		return;
+	}
+	if (errno != EOPNOTSUPP) {
+		errno_exit("fallocate");
+	}
+#endif
+	static const u8 zeros[64 * 1024];
+	while (size > 0) {
+		size_t len = size < (off_t) sizeof(zeros) ? (size_t) size : sizeof(zeros);
+		ssize_t n = pwrite(fd, zeros, len, off);
+		if (n == -1) {
+			errno_exit("pwrite");
+		}
+		off += n;
+		size -= n;
+	}
+}
+
+/* Open PATH for the image. A regular file is truncated and extended,
+   which leaves it one big hole; a block device is zeroed instead. With
+   UPDATE, PATH already holds an image of this geometry, which is changed
+   in place. */
+void image_create(struct image *image, const char *path, int update) {
+	off_t size = BLOCK_OFFSET(geometry.blocks_count);
+	image->fd = open(path, update ? O_RDWR : O_CREAT | O_WRONLY, 0666);
+	if (image->fd == -1) {
+		errno_exit("open");
+	}
+	image->update = update;
+	image->old_block = update ? xmalloc(geometry.block_size) : NULL;
+
+	struct stat st;
+	if (fstat(image->fd, &st)) {
+		errno_exit("fstat");
+	}
+	if (update) {
+		/* Keep what is there */
+	}
+	else if (S_ISBLK(st.st_mode)) {
+		off_t device_size = lseek(image->fd, 0, SEEK_END);
+		if (device_size == -1) {
+			errno_exit("lseek");
+		}
+		if (device_size < size) {
+			fprintf(stderr, "%s: device too small (%lld bytes, need %lld)\n",
+			        path, (long long) device_size, (long long) size);
+			exit(1);
+		}
+		zero_range(image->fd, 0, size);
+	}
+	else {
+		if (ftruncate(image->fd, 0)) {
+			errno_exit("ftruncate");
+		}
+		if (ftruncate(image->fd, size)) {
+			errno_exit("ftruncate");
+		}
+	}
+
+	image->num_blocks = geometry.blocks_count;
+	image->cache = calloc(image->num_blocks, sizeof(*image->cache));
+	if (image->cache == NULL) {
+		errno_exit("calloc");
+	}
+	image->read_calls = 0;
+	image->write_calls = 0;
+	image->bytes_written = 0;
+	image->zero_blocks = 0;
+	image->unchanged_blocks = 0;
+}
+
+/* Return the cached copy of block BLOCKNO, zero-filled on first use. */
+u8 *image_block(struct image *image, u32 blockno) {
+	assert(blockno < image->num_blocks);
+	if (image->cache[blockno] == NULL) {
+		image->cache[blockno] = xmalloc(geometry.block_size);
+		memset(image->cache[blockno], 0, geometry.block_size);
+	}
+	return image->cache[blockno];
+}
+
+/* Like pwrite(), but into the cache. */
+void image_pwrite(struct image *image, const void *buf, size_t size, u64 off) {
+	const u8 *p = buf;
+	while (size > 0) {
+		size_t block_off = off % geometry.block_size;
+		size_t n = geometry.block_size - block_off;
+		if (n > size) {
+			n = size;
+		}
+		memcpy(image_block(image, off / geometry.block_size) + block_off, p, n);
+		p += n;
+		off += n;
+		size -= n;
+	}
+}
+
+/* Write the NUM_IOV blocks in IOV to the image at OFF. */
+void image_write_run(struct image *image, struct iovec *iov, int num_iov,
+                     off_t off) {
+	while (num_iov > 0) {
+		ssize_t n = pwritev(image->fd, iov, num_iov, off);
+		if (n == -1) {
+			errno_exit("pwritev");
+		}
+		image->write_calls++;
+		image->bytes_written += n;
+		off += n;
+		/* Skip what was written, in case the write was short */
+		while (num_iov > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			num_iov--;
+		}
+		if (num_iov > 0) {
+			iov->iov_base = (u8 *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/* Return whether cached block BLOCKNO needs writing, and drop it from
+   the cache if not: when the image already holds it, or when it holds
+   nothing but zeros, which are discarded instead. */
+int image_keep_block(struct image *image, u32 blockno) {
+	u8 *block = image->cache[blockno];
+	if (block == NULL) {
+		return 0;
+	}
+	if (image->update) {
+		ssize_t n = pread(image->fd, image->old_block, geometry.block_size,
+		                  BLOCK_OFFSET(blockno));
+		if (n == -1) {
+			errno_exit("pread");
+		}
+		image->read_calls++;
+		if (n == geometry.block_size
+		    && memcmp(block, image->old_block, geometry.block_size) == 0) {
+			image->unchanged_blocks++;
+			free(block);
+			image->cache[blockno] = NULL;
+			return 0;
+		}
+	}
+	if (is_zero(block, geometry.block_size)) {
+		if (image->update) {
+			zero_range(image->fd, BLOCK_OFFSET(blockno), geometry.block_size);
+		}
+		image->zero_blocks++;
+		free(block);
+		image->cache[blockno] = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/* Drop the cached blocks the updated image already holds, and return
+   whether any others are left to write or were zeroed. */
+int image_drop_unchanged(struct image *image) {
+	u64 zero_blocks = image->zero_blocks;
+	int changed = 0;
+	for (u32 blockno = 0; blockno < image->num_blocks; blockno++) {
+		changed |= image_keep_block(image, blockno);
+	}
+	return changed || image->zero_blocks != zero_blocks;
+}
+
+/* Write every cached block out and empty the cache. */
+void image_flush(struct image *image) {
+	struct iovec iov[IOV_MAX];
+	u32 blockno = 0;
+	while (blockno < image->num_blocks) {
+		if (!image_keep_block(image, blockno)) {
+			blockno++;
+			continue;
+		}
+
+		u32 first = blockno;
+		int num_iov = 0;
+		do {
+			iov[num_iov].iov_base = image->cache[blockno];
+			iov[num_iov].iov_len = geometry.block_size;
+			num_iov++;
+			blockno++;
+		} while (blockno < image->num_blocks && num_iov < IOV_MAX
+		         && image_keep_block(image, blockno));
+		image_write_run(image, iov, num_iov, BLOCK_OFFSET(first));
+
+		for (u32 i = first; i < blockno; i++) {
+			free(image->cache[i]);
+			image->cache[i] = NULL;
+		}
+	}
+}
+
+void image_close(struct image *image) {
+	image_flush(image);
+	free(image->cache);
+	free(image->old_block);
+	if (close(image->fd)) {
+		errno_exit("close");
+	}
+}
+
+/* Write the superblock, or its backup at the start of GROUP. */
+void write_superblock(struct image *image, struct layout *layout, u32 group) {
+	u32 current_time = layout->write_time;
+
+	u32 free_blocks = 0;
+	u32 free_inodes = 0;
+	for (u32 g = 0; g < geometry.num_groups; g++) {
+		free_blocks += group_num_blocks(g) - group_used_blocks(layout, g);
+		free_inodes += geometry.inodes_per_group - group_used_inodes(layout, g);
+	}
+
+	struct ext2_superblock superblock = {0};
+
+	superblock.s_inodes_count = geometry.inodes_count;
+	superblock.s_blocks_count = geometry.blocks_count;
+	superblock.s_r_blocks_count = 0;
+	superblock.s_free_blocks_count = free_blocks;
+	superblock.s_free_inodes_count = free_inodes;
+	superblock.s_first_data_block = geometry.first_data_block; /* First Data Block */
+	superblock.s_log_block_size = geometry.log_block_size;	/* 1024 << s_log_block_size */
+	superblock.s_log_frag_size = geometry.log_block_size;	/* Fragments are blocks */
+	superblock.s_blocks_per_group = geometry.blocks_per_group;
+	superblock.s_frags_per_group = geometry.blocks_per_group;
+	superblock.s_inodes_per_group = geometry.inodes_per_group;
+	superblock.s_mtime = 0;				/* Mount time */
+	superblock.s_wtime = current_time;	/* Write time */
+	superblock.s_mnt_count         = 0; /* Number of times mounted so far */
+	superblock.s_max_mnt_count     = UNLIMITED_MNT_COUNT; /* Make this unlimited */
+	superblock.s_magic = EXT2_SUPER_MAGIC; /* ext2 Signature */
+	superblock.s_state             = EXT2_VALID_FS; /* File system is clean */
+	superblock.s_errors            = EXT2_ERRORS_CONTINUE; /* Ignore the error (continue on) */
+	superblock.s_minor_rev_level   = 0; /* Leave this as 0 */
+	superblock.s_lastcheck = current_time; /* Last check time */
+	superblock.s_checkinterval     = CHECK_INTERVAL; /* Force checks by making them every 1 second */
+	superblock.s_creator_os        = EXT2_OS_LINUX; /* Linux */
+	superblock.s_rev_level         = EXT2_GOOD_OLD_REV; /* Unless a feature needs more */
+	superblock.s_def_resuid        = EXT2_DEF_RESUID; /* root */ // 0 is default
+	superblock.s_def_resgid        = EXT2_DEF_RESGID; /* root */ // 0 is default
+
+	if (geometry.sparse_super || geometry.dir_index || layout->large_file || geometry.dedup) {
+		superblock.s_rev_level = EXT2_DYNAMIC_REV;
+		superblock.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+		superblock.s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+		superblock.s_block_group_nr = group;
+	}
+	if (geometry.sparse_super) {
+		superblock.s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+	}
+	if (layout->large_file) {
+		superblock.s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+	}
+	if (geometry.dedup) {
+		/* Keeps the kernel from mounting the image writable */
+		superblock.s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_SHARED_BLOCKS;
+	}
+	if (geometry.dir_index) {
+		/* A zero seed means the default one */
+		superblock.s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+		superblock.s_def_hash_version = DX_HASH_HALF_MD4;
+		superblock.s_flags |= EXT2_FLAGS_UNSIGNED_HASH;
+	}
+
+	memcpy(superblock.s_uuid, volume_uuid, sizeof(volume_uuid));
+
+	memcpy(&superblock.s_volume_name, "cs111-base", 10);
+
+	off_t off = group == 0 ? SUPERBLOCK_OFFSET : BLOCK_OFFSET(group_first_block(group));
+	image_pwrite(image, &superblock, sizeof(superblock), off);
+}
+
+/* Write the descriptor table, or its backup in GROUP. */
+void write_block_group_descriptor_table(struct image *image, struct layout *layout,
+                                        u32 group) {
+	u64 off = BLOCK_OFFSET(group_first_block(group) + 1);
+	for (u32 g = 0; g < geometry.num_groups; g++) {
+		struct ext2_block_group_descriptor block_group_descriptor = {0};
+
+		block_group_descriptor.bg_block_bitmap = group_block_bitmap(g);
+		block_group_descriptor.bg_inode_bitmap = group_inode_bitmap(g);
+		block_group_descriptor.bg_inode_table = group_inode_table(g);
+		block_group_descriptor.bg_free_blocks_count = group_num_blocks(g)
+		                                              - group_used_blocks(layout, g);
+		block_group_descriptor.bg_free_inodes_count = geometry.inodes_per_group
+		                                              - group_used_inodes(layout, g);
+		block_group_descriptor.bg_used_dirs_count = layout->group_dirs[g];
+
+		image_pwrite(image, &block_group_descriptor, sizeof(block_group_descriptor),
+		             off + g * sizeof(block_group_descriptor));
+	}
+}
+
+/* Set bits FROM through TO - 1 of MAP. */
+void bitmap_set_range(u8 *map, u32 from, u32 to) {
+	for (u32 i = from; i < to; i++) {
+		map[i / 8] |= 1 << (i % 8);
+	}
+}
+
+void write_block_bitmap(struct image *image, struct layout *layout, u32 group)
+{
+	u8 *map_value = image_block(image, group_block_bitmap(group));
+
+	// 1 bit = 1 block, starting from the group's first block
+	memcpy(map_value, layout->block_map + group * geometry.blocks_per_group / 8,
+	       (group_num_blocks(group) + 7) / 8);
+
+	// Bitmap padding past the last block
+	bitmap_set_range(map_value, group_num_blocks(group), geometry.block_size * 8);
+}
+
+void write_inode_bitmap(struct image *image, struct layout *layout, u32 group)
+{
+	u8 *map_value = image_block(image, group_inode_bitmap(group));
+
+	// Used inodes, starting with the reserved ones in group 0
+	memcpy(map_value, layout->inode_map + group * geometry.inodes_per_group / 8,
+	       geometry.inodes_per_group / 8);
+
+	// Bitmap padding
+	bitmap_set_range(map_value, geometry.inodes_per_group, geometry.block_size * 8);
+}
+
+/* Write the metadata of every group: superblock and descriptor table
+   backups where there are any, and the bitmaps. */
+/* Write the superblock and all its backups. */
+void write_superblocks(struct image *image, struct layout *layout) {
+	for (u32 g = 0; g < geometry.num_groups; g++) {
+		if (group_has_super(g)) {
+			write_superblock(image, layout, g);
+		}
+	}
+}
+
+void write_groups(struct image *image, struct layout *layout) {
+	for (u32 g = 0; g < geometry.num_groups; g++) {
+		if (group_has_super(g)) {
+			write_superblock(image, layout, g);
+			write_block_group_descriptor_table(image, layout, g);
+		}
+		write_block_bitmap(image, layout, g);
+		write_inode_bitmap(image, layout, g);
+	}
+}
+
+off_t inode_offset(u32 index) {
+	u32 group = (index - 1) / geometry.inodes_per_group;
+	return BLOCK_OFFSET(group_inode_table(group))
+	       + (index - 1) % geometry.inodes_per_group * sizeof(struct ext2_inode);
+}
+
+void write_inode(struct image *image, u32 index, struct ext2_inode *inode) {
+	image_pwrite(image, inode, sizeof(struct ext2_inode), inode_offset(index));
+}
+
+/* Fill the next indirect block from MAP with pointers to the next
+   *LEFT data blocks from DATA, through LEVEL more levels of indirect
+   blocks. Return the indirect block's number. */
+u32 write_map(struct image *image, struct block_iter *map,
+              struct block_iter *data, int level, u64 *left) {
+	u32 blockno = block_iter_next(map);
+	u32 *entries = (u32 *) image_block(image, blockno);
+	for (u32 i = 0; i < geometry.block_size / sizeof(u32) && *left > 0; i++) {
+		if (level == 0) {
+			entries[i] = block_iter_next(data);
+			(*left)--;
+		}
+		else {
+			entries[i] = write_map(image, map, data, level - 1, left);
+		}
+	}
+	return blockno;
+}
+
+/* Point I_BLOCK at NODE's data blocks, writing its indirect blocks. */
+void write_block_map(struct image *image, struct node *node, u32 *i_block) {
+	struct block_iter data = {node->extents, node->num_extents, 0, 0};
+	struct block_iter map = {node->map_extents, node->num_map_extents, 0, 0};
+	u64 left = node->num_blocks;
+	for (u32 i = 0; i < EXT2_NDIR_BLOCKS && left > 0; i++, left--) {
+		i_block[i] = block_iter_next(&data);
+	}
+	for (int level = 0; level < 3 && left > 0; level++) {
+		i_block[EXT2_IND_BLOCK + level] = write_map(image, &map, &data, level, &left);
+	}
+	assert(map.e == map.num_extents);
+}
+
+void write_inode_table(struct image *image, struct node *node) {
+	if (node->link) {
+		return;
+	}
+	struct ext2_inode inode = {0};
+	inode.i_mode = node->mode;
+	inode.i_uid = node->uid & 0xFFFF;
+	inode.i_uid_high = node->uid >> 16;
+	inode.i_size = node->size;
+	if (S_ISTYPE(node->mode, EXT2_S_IFREG)) {
+		inode.i_dir_acl = node->size >> 32;  /* i_size_high */
+	}
+	inode.i_atime = node->atime;
+	inode.i_ctime = node->ctime;
+	inode.i_mtime = node->mtime;
+	inode.i_dtime = 0;
+	inode.i_gid = node->gid & 0xFFFF;
+	inode.i_gid_high = node->gid >> 16;
+	inode.i_links_count = node->links_count;
+	if (S_ISTYPE(node->mode, EXT2_S_IFDIR) && dir_indexed(node)) {
+		inode.i_flags |= EXT2_INDEX_FL;
+	}
+	inode.i_blocks = (node->num_blocks - node->num_holes + node->num_map_blocks)
+	                 * (geometry.block_size / 512); /* These are oddly 512 blocks */
+	write_block_map(image, node, inode.i_block);
+	if (S_ISTYPE(node->mode, EXT2_S_IFLNK) && node->num_blocks == 0) {
+		memcpy((char*)inode.i_block, node->target, node->size); // instead of data blocks point point towards file
+	}
+	if (S_ISTYPE(node->mode, EXT2_S_IFCHR) || S_ISTYPE(node->mode, EXT2_S_IFBLK)) {
+		/* Old style, as the kernel writes it, when both numbers fit */
+		u32 maj = (node->rdev >> 8) & 0xFFF;
+		u32 min = (node->rdev & 0xFF) | (node->rdev >> 12 & ~0xFFu);
+		if (maj < 256 && min < 256) {
+			inode.i_block[0] = maj << 8 | min;
+		}
+		else {
+			inode.i_block[1] = node->rdev;
+		}
+	}
+	write_inode(image, node->ino, &inode);
+
+	for (size_t c = 0; c < node->num_children; c++) {
+		write_inode_table(image, node->children[c]);
+	}
+}
+
+/* Write SIZE bytes of BUF into NODE's data blocks. */
+void write_node_data(struct image *image, struct node *node, const void *buf,
+                     size_t size) {
+	const u8 *p = buf;
+	for (u32 e = 0; e < node->num_extents && size > 0; e++) {
+		size_t n = (size_t) node->extents[e].len * geometry.block_size;
+		if (n > size) {
+			n = size;
+		}
+		image_pwrite(image, p, n, BLOCK_OFFSET(node->extents[e].start));
+		p += n;
+		size -= n;
+	}
+}
+
+/* Write the directory blocks, symlink blocks and built-in file contents
+   of the tree at NODE, and collect the regular files to copy from the
+   host into FILES. */
+void write_tree_blocks(struct image *image, struct node *node,
+                       struct node ***files, size_t *num_files) {
+	if (node->link) {
+		return;
+	}
+	if (S_ISTYPE(node->mode, EXT2_S_IFDIR)) {
+		size_t size = (size_t) node->num_blocks * geometry.block_size;
+		u8 *buf = xmalloc(size);
+		memset(buf, 0, size);
+		dir_pack(node, buf);
+		write_node_data(image, node, buf, size);
+		free(buf);
+	}
+	else if (S_ISTYPE(node->mode, EXT2_S_IFLNK) && node->num_blocks) {
+		write_node_data(image, node, node->target, node->size);
+	}
+	else if (S_ISTYPE(node->mode, EXT2_S_IFREG) && node->data) {
+		write_node_data(image, node, node->data, node->size);
+	}
+	else if (S_ISTYPE(node->mode, EXT2_S_IFREG) && node->num_blocks
+	         && !node->unchanged) {
+		file_list_add(files, num_files, node);
+	}
+
+	for (size_t i = 0; i < node->num_children; i++) {
+		write_tree_blocks(image, node->children[i], files, num_files);
+	}
+}
+
+/* Read SIZE bytes at OFF of the image at FD, which is being updated. */
+void image_read(int fd, void *buf, size_t size, off_t off) {
+	u8 *p = buf;
+	while (size > 0) {
+		ssize_t n = pread(fd, p, size, off);
+		if (n == -1) {
+			errno_exit("pread");
+		}
+		if (n == 0) {
+			fprintf(stderr, "image truncated\n");
+			exit(1);
+		}
+		p += n;
+		off += n;
+		size -= n;
+	}
+}
+
+void update_refused(const char *path, const char *why) {
+	fprintf(stderr, "%s: cannot update: %s\n", path, why);
+	exit(1);
+}
+
+/* Take the geometry of the image at FD, named PATH, checking that it is
+   one ext2-create could have built. */
+void geometry_read(int fd, const char *path) {
+	struct ext2_superblock superblock;
+	image_read(fd, &superblock, sizeof(superblock), SUPERBLOCK_OFFSET);
+	if (superblock.s_magic != EXT2_SUPER_MAGIC || superblock.s_log_block_size > 2) {
+		update_refused(path, "not an ext2 image");
+	}
+	u32 compat = 0;
+	u32 ro_compat = 0;
+	if (superblock.s_rev_level != EXT2_GOOD_OLD_REV) {
+		if (superblock.s_inode_size != EXT2_GOOD_OLD_INODE_SIZE
+		    || superblock.s_first_ino != EXT2_GOOD_OLD_FIRST_INO
+		    || (superblock.s_feature_compat & ~EXT2_FEATURE_COMPAT_DIR_INDEX)
+		    || superblock.s_feature_incompat
+		    || (superblock.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER
+		                                           | EXT2_FEATURE_RO_COMPAT_LARGE_FILE))) {
+			update_refused(path, "unsupported features");
+		}
+		compat = superblock.s_feature_compat;
+		ro_compat = superblock.s_feature_ro_compat;
+	}
+
+	geometry.dir_index = (compat & EXT2_FEATURE_COMPAT_DIR_INDEX) != 0;
+	int sparse_super = (ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) != 0;
+	geometry_init(1024 << superblock.s_log_block_size, superblock.s_blocks_count,
+	              superblock.s_inodes_count, sparse_super);
+	if (geometry.blocks_count != superblock.s_blocks_count
+	    || geometry.inodes_count != superblock.s_inodes_count
+	    || geometry.first_data_block != superblock.s_first_data_block
+	    || geometry.blocks_per_group != superblock.s_blocks_per_group
+	    || geometry.inodes_per_group != superblock.s_inodes_per_group
+	    || geometry.sparse_super != sparse_super) {
+		update_refused(path, "unexpected geometry");
+	}
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		errno_exit("fstat");
+	}
+	if (S_ISREG(st.st_mode) && st.st_size < BLOCK_OFFSET(geometry.blocks_count)) {
+		update_refused(path, "image truncated");
+	}
+}
+
+/* Mark the inodes and blocks the bitmaps of the image at FD have in use
+   in LAYOUT, and take its write time. */
+void layout_read_maps(struct layout *layout, int fd) {
+	struct ext2_superblock superblock;
+	image_read(fd, &superblock, sizeof(superblock), SUPERBLOCK_OFFSET);
+	layout->write_time = superblock.s_wtime;
+
+	u8 *map = xmalloc(geometry.block_size);
+	for (u32 g = 0; g < geometry.num_groups; g++) {
+		image_read(fd, map, geometry.block_size, BLOCK_OFFSET(group_block_bitmap(g)));
+		for (u32 i = 0; i < group_num_blocks(g); i++) {
+			u32 blockno = group_first_block(g) + i;
+			if (bit_test(map, i) && !layout_block_used(layout, blockno)) {
+				layout_use_block(layout, blockno);
+			}
+		}
+		image_read(fd, map, geometry.block_size, BLOCK_OFFSET(group_inode_bitmap(g)));
+		for (u32 i = 0; i < geometry.inodes_per_group; i++) {
+			u32 ino = g * geometry.inodes_per_group + i + 1;
+			if (bit_test(map, i) && !layout_inode_used(layout, ino)) {
+				layout_use_inode(layout, ino);
+			}
+		}
+	}
+	free(map);
+}
+
+/* Append LEN data blocks from BLOCKNO, or LEN holes if it is 0, to the
+   file NODE read from the image. */
+void read_data_blocks(struct node *node, u32 blockno, u64 len) {
+	if (blockno >= geometry.blocks_count || (blockno && blockno < geometry.first_data_block)) {
+		fprintf(stderr, "%s: bad block %u\n", node_path(node), blockno);
+		exit(1);
+	}
+	extent_append(&node->extents, &node->num_extents, blockno, len, blockno == 0);
+	if (blockno == 0) {
+		node->num_holes += len;
+	}
+}
+
+/* Append to NODE the next *LEFT data blocks that the indirect block
+   BLOCKNO maps, through LEVEL more levels of indirect blocks, and the
+   indirect blocks themselves in the order write_map() fills them. */
+void read_map(int fd, struct node *node, u32 blockno, int level, u64 *left) {
+	u64 per_block = geometry.block_size / sizeof(u32);
+	if (blockno == 0) {
+		u64 span = per_block;
+		for (int i = 0; i < level; i++) {
+			span *= per_block;
+		}
+		u64 n = *left < span ? *left : span;
+		read_data_blocks(node, 0, n);
+		*left -= n;
+		return;
+	}
+	if (blockno >= geometry.blocks_count || blockno < geometry.first_data_block) {
+		fprintf(stderr, "%s: bad block %u\n", node_path(node), blockno);
+		exit(1);
+	}
+	extent_append(&node->map_extents, &node->num_map_extents, blockno, 1, 0);
+	node->num_map_blocks++;
+
+	u32 *entries = xmalloc(geometry.block_size);
+	image_read(fd, entries, geometry.block_size, BLOCK_OFFSET(blockno));
+	for (u32 i = 0; i < per_block && *left > 0; i++) {
+		if (level == 0) {
+			read_data_blocks(node, entries[i], 1);
+			(*left)--;
+		}
+		else {
+			read_map(fd, node, entries[i], level - 1, left);
+		}
+	}
+	free(entries);
+}
+
+void read_block_map(int fd, struct node *node, const u32 *i_block) {
+	u64 left = node->num_blocks;
+	for (u32 i = 0; i < EXT2_NDIR_BLOCKS && left > 0; i++, left--) {
+		read_data_blocks(node, i_block[i], 1);
+	}
+	for (int level = 0; level < 3 && left > 0; level++) {
+		read_map(fd, node, i_block[EXT2_IND_BLOCK + level], level, &left);
+	}
+}
+
+void read_image_dir(int fd, struct node *dir, u8 *seen);
+
+/* Read inode INO of the image at FD, the entry NAME of PARENT, and what
+   it holds. SEEN marks the inodes read so far. */
+struct node *read_image_node(int fd, struct node *parent, const char *name,
+                             u32 ino, u8 *seen) {
+	struct node *node = node_new(parent, name);
+	if (parent) {
+		node->path = xmalloc(strlen(node_path(parent)) + strlen(name) + 2);
+		sprintf(node->path, "%s/%s", node_path(parent), name);
+	}
+	if (ino == 0 || ino > geometry.inodes_count) {
+		fprintf(stderr, "%s: bad inode %u\n", node_path(node), ino);
+		exit(1);
+	}
+	if (bit_test(seen, ino - 1)) {
+		update_refused(node_path(node), "hard links are not supported");
+	}
+	seen[(ino - 1) / 8] |= 1 << ((ino - 1) % 8);
+
+	struct ext2_inode inode;
+	image_read(fd, &inode, sizeof(inode), inode_offset(ino));
+	node->ino = ino;
+	node->mode = inode.i_mode;
+	node->uid = inode.i_uid | (u32) inode.i_uid_high << 16;
+	node->gid = inode.i_gid | (u32) inode.i_gid_high << 16;
+	node->size = inode.i_size;
+	if (S_ISTYPE(node->mode, EXT2_S_IFREG)) {
+		node->size |= (u64) inode.i_dir_acl << 32;
+	}
+	node->atime = inode.i_atime;
+	node->ctime = inode.i_ctime;
+	node->mtime = inode.i_mtime;
+	node->links_count = inode.i_links_count;
+
+	if (S_ISTYPE(node->mode, EXT2_S_IFREG) || S_ISTYPE(node->mode, EXT2_S_IFDIR)
+	    || (S_ISTYPE(node->mode, EXT2_S_IFLNK) && inode.i_blocks != 0)) {
+		node->num_blocks = (node->size + geometry.block_size - 1) / geometry.block_size;
+		read_block_map(fd, node, inode.i_block);
+	}
+	if (S_ISTYPE(node->mode, EXT2_S_IFDIR)) {
+		read_image_dir(fd, node, seen);
+	}
+	return node;
+}
+
+/* Read the entries of DIR, sorted by name, into its children. */
+void read_image_dir(int fd, struct node *dir, u8 *seen) {
+	u8 *block = xmalloc(geometry.block_size);
+	struct block_iter it = {dir->extents, dir->num_extents, 0, 0};
+	for (u32 b = 0; b < dir->num_blocks; b++) {
+		u32 blockno = block_iter_next(&it);
+		if (blockno == 0) {
+			continue;
+		}
+		image_read(fd, block, geometry.block_size, BLOCK_OFFSET(blockno));
+		u32 off = 0;
+		while (off < geometry.block_size) {
+			struct ext2_dir_entry *entry = (void *) (block + off);
+			if (entry->rec_len < 8 || off + entry->rec_len > geometry.block_size
+			    || 8 + (entry->name_len & 0xFF) > entry->rec_len) {
+				fprintf(stderr, "%s: bad directory entry\n", node_path(dir));
+				exit(1);
+			}
+			char name[EXT2_NAME_LEN + 1];
+			memcpy(name, entry->name, entry->name_len & 0xFF);
+			name[entry->name_len & 0xFF] = '\0';
+			if (entry->inode != 0 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+				node_add_child(dir, read_image_node(fd, dir, name, entry->inode, seen));
+			}
+			off += entry->rec_len;
+		}
+	}
+	free(block);
+	qsort(dir->children, dir->num_children, sizeof(*dir->children),
+	      compare_nodes);
+}
+
+/* Read the tree of the image at FD. */
+struct node *read_image_tree(int fd) {
+	u8 *seen = calloc((geometry.inodes_count + 7) / 8, 1);
+	if (seen == NULL) {
+		errno_exit("calloc");
+	}
+	struct node *root = read_image_node(fd, NULL, "", EXT2_ROOT_INO, seen);
+	free(seen);
+	if (!S_ISTYPE(root->mode, EXT2_S_IFDIR)) {
+		fprintf(stderr, "root is not a directory\n");
+		exit(1);
+	}
+	return root;
+}
+
+/* Hash the contents of the file OLD in the image at FD the way
+   hash_file() hashes a host file. */
+void hash_image_file(int fd, struct node *old, u64 hash[2]) {
+	u8 *block = xmalloc(geometry.block_size);
+	struct block_iter it = {old->extents, old->num_extents, 0, 0};
+	hash[0] = hash[1] = 0;
+	for (u32 b = 0; b < old->num_blocks; b++) {
+		u32 blockno = block_iter_next(&it);
+		u64 h[2] = {0, 0};
+		if (blockno) {
+			image_read(fd, block, geometry.block_size, BLOCK_OFFSET(blockno));
+			if (!is_zero(block, geometry.block_size)) {
+				hash128(block, geometry.block_size, h);
+			}
+		}
+		hash128(h, sizeof(h), hash);
+	}
+	free(block);
+}
+
+/* Free the blocks of the file OLD in the image being updated. */
+void free_old_blocks(struct layout *layout, struct node *old) {
+	for (u32 e = 0; e < old->num_extents; e++) {
+		for (u32 k = 0; old->extents[e].start && k < old->extents[e].len; k++) {
+			layout_free_block(layout, old->extents[e].start + k);
+		}
+	}
+	for (u32 e = 0; e < old->num_map_extents; e++) {
+		for (u32 k = 0; k < old->map_extents[e].len; k++) {
+			layout_free_block(layout, old->map_extents[e].start + k);
+		}
+	}
+}
+
+/* Free the inodes and blocks of OLD and everything under it, which are
+   gone from the tree. */
+void free_old_tree(struct layout *layout, struct node *old) {
+	free_old_blocks(layout, old);
+	layout_free_inode(layout, old->ino);
+	if ((layout->num_freed_inodes & (layout->num_freed_inodes - 1)) == 0) {
+		layout->freed_inodes = realloc(layout->freed_inodes,
+		                               (layout->num_freed_inodes ? 2 * layout->num_freed_inodes : 1)
+		                               * sizeof(*layout->freed_inodes));
+		if (layout->freed_inodes == NULL) {
+			errno_exit("realloc");
+		}
+	}
+	layout->freed_inodes[layout->num_freed_inodes++] = old->ino;
+	for (size_t i = 0; i < old->num_children; i++) {
+		free_old_tree(layout, old->children[i]);
+	}
+}
+
+void match_children(struct layout *layout, int fd, struct node *dir,
+                    struct node *old, int checksum);
+
+/* Let NODE take over the inode of OLD, the file at the same path in the
+   image at FD, and its blocks too if it needs as many. A regular file of
+   the same size and modification time, or with CHECKSUM the same
+   contents, is not copied again. */
+void match_node(struct layout *layout, int fd, struct node *node,
+                struct node *old, int checksum) {
+	if (!S_ISTYPE(node->mode, old->mode & 0xF000)) {
+		free_old_tree(layout, old);
+		return;
+	}
+	node->ino = old->ino;
+
+	if (node_data_blocks(node) == old->num_blocks && old->num_holes == 0) {
+		node->keep_blocks = 1;
+		node->extents = old->extents;
+		node->num_extents = old->num_extents;
+		node->num_blocks = old->num_blocks;
+		node->map_extents = old->map_extents;
+		node->num_map_extents = old->num_map_extents;
+		node->num_map_blocks = old->num_map_blocks;
+		if (S_ISTYPE(node->mode, EXT2_S_IFREG) && node->path && node->size == old->size) {
+			if (checksum) {
+				u64 hash[2];
+				hash_image_file(fd, old, hash);
+				node->unchanged = hash[0] == node->hash[0] && hash[1] == node->hash[1];
+			}
+			else {
+				node->unchanged = node->mtime == old->mtime;
+			}
+		}
+	}
+	else {
+		free_old_blocks(layout, old);
+	}
+
+	if (S_ISTYPE(node->mode, EXT2_S_IFDIR)) {
+		match_children(layout, fd, node, old, checksum);
+	}
+}
+
+/* Match the entries of DIR with those of OLD, its version in the image,
+   by name, and free what is gone. */
+void match_children(struct layout *layout, int fd, struct node *dir,
+                    struct node *old, int checksum) {
+	char *matched = calloc(old->num_children + 1, 1);
+	if (matched == NULL) {
+		errno_exit("calloc");
+	}
+	for (size_t i = 0; i < dir->num_children; i++) {
+		struct node *child = dir->children[i];
+		struct node **found = bsearch(&child, old->children, old->num_children,
+		                              sizeof(*old->children), compare_nodes);
+		if (found) {
+			matched[found - old->children] = 1;
+			match_node(layout, fd, child, *found, checksum);
+		}
+	}
+	for (size_t i = 0; i < old->num_children; i++) {
+		if (!matched[i]) {
+			free_old_tree(layout, old->children[i]);
+		}
+	}
+	free(matched);
+}
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define COPY_BATCH 64
+
+/* Host files whose contents the copy threads write into the image. Each
+   thread claims the next COPY_BATCH files with an atomic add to NEXT. */
+struct copier {
+	struct image *image;
+	struct node **files;
+	size_t num_files;
+	size_t next;
+};
+
+/* File contents a copy thread has read but not written yet: LEN bytes
+   of BUF that belong at offset START of the image. Files get their
+   blocks in tree order, so a batch of small files usually lands in a
+   few runs, each written with one call. */
+struct copy_run {
+	u8 *buf;
+	off_t start;
+	size_t len;
+};
+
+/* Write the LEN bytes at BUF to the image at OFF. */
+void copy_write(struct image *image, const u8 *buf, size_t len, off_t off) {
+	while (len > 0) {
+		ssize_t n = pwrite(image->fd, buf, len, off);
+		if (n == -1) {
+			errno_exit("pwrite");
+		}
+		__atomic_fetch_add(&image->write_calls, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&image->bytes_written, n, __ATOMIC_RELAXED);
+		buf += n;
+		len -= n;
+		off += n;
+	}
+}
+
+/* Write RUN out, one call for each stretch of blocks that are not all
+   zeros. RUN starts on a block boundary. */
+void copy_run_flush(struct image *image, struct copy_run *run) {
+	size_t data = 0;   /* Start of the stretch being gathered */
+	size_t pos = 0;
+	u64 zero_blocks = 0;
+	while (pos < run->len) {
+		size_t n = run->len - pos < geometry.block_size ? run->len - pos
+		                                                 : geometry.block_size;
+		if (is_zero(run->buf + pos, n)) {
+			copy_write(image, run->buf + data, pos - data, run->start + data);
+			if (image->update) {
+				/* The block may hold something from before */
+				zero_range(image->fd, run->start + pos, n);
+			}
+			data = pos + n;
+			zero_blocks++;
+		}
+		pos += n;
+	}
+	copy_write(image, run->buf + data, pos - data, run->start + data);
+	if (zero_blocks) {
+		__atomic_fetch_add(&image->zero_blocks, zero_blocks, __ATOMIC_RELAXED);
+	}
+	run->len = 0;
+}
+
+/* Read up to SIZE bytes of SRC into BUF, stopping early only at the end
+   of the file. Return the number of bytes read. */
+size_t read_full(struct image *image, int src, u8 *buf, size_t size,
+                 const char *path) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = read(src, buf + done, size - done);
+		__atomic_fetch_add(&image->read_calls, 1, __ATOMIC_RELAXED);
+		if (n == -1) {
+			errno_exit(path);
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/* Like read_full(), but read SIZE bytes from offset POS of the sparse
+   file SRC, and only where it has data. Holes come back as zeros. */
+size_t read_sparse(struct image *image, int src, u8 *buf, size_t size,
+                   off_t pos, const char *path) {
+#ifdef SEEK_DATA
+	memset(buf, 0, size);
+	off_t end = pos + size;
+	while (pos < end) {
+		off_t data = lseek(src, pos, SEEK_DATA);
+		if (data == -1 && errno == ENXIO) {
+			break;  /* Nothing but a hole left */
+		}
+		if (data == -1) {
+			errno_exit(path);
+		}
+		if (data >= end) {
+			break;
+		}
+		off_t hole = lseek(src, data, SEEK_HOLE);
+		if (hole == -1) {
+			errno_exit(path);
+		}
+		if (hole > end) {
+			hole = end;
+		}
+		while (data < hole) {
+			ssize_t n = pread(src, buf + (size - (end - data)), hole - data, data);
+			__atomic_fetch_add(&image->read_calls, 1, __ATOMIC_RELAXED);
+			if (n == -1) {
+				errno_exit(path);
+			}
+			if (n == 0) {
+				return size;
+			}
+			data += n;
+		}
+		pos = hole;
+	}
+	return size;
+#else
+	if (lseek(src, pos, SEEK_SET) == -1) {
+		errno_exit(path);
+	}
+	return read_full(image, src, buf, size, path);
+#endif
+}
+
+/* Read SIZE bytes at offset POS of NODE's host file SRC into BUF. */
+size_t read_file(struct image *image, struct node *node, int src, u8 *buf,
+                 size_t size, off_t pos) {
+	if (node->sparse) {
+		return read_sparse(image, src, buf, size, pos, node->path);
+	}
+	return read_full(image, src, buf, size, node->path);
+}
+
+/* Copy at most NODE->size bytes of the host file into NODE's blocks,
+   appending them to RUN when they fit. A file that shrank since it was
+   walked leaves zeros behind. */
+void copy_file(struct image *image, struct node *node, struct copy_run *run) {
+	int src = open_source(node->path, 0);
+	if (src == -1) {
+		errno_exit(node->path);
+	}
+
+	u64 left = node->size;
+	off_t pos = 0;
+	for (u32 e = 0; e < node->num_extents; e++) {
+		off_t dst = BLOCK_OFFSET(node->extents[e].start);
+		size_t size = (size_t) node->extents[e].len * geometry.block_size;
+		size_t want = left < size ? left : size;
+		left -= want;
+		if (node->extents[e].shared) {
+			pos += want;
+			if (lseek(src, pos, SEEK_SET) == -1) {
+				errno_exit(node->path);
+			}
+			continue;
+		}
+
+		if (run->start + run->len != dst || run->len + size > COPY_BUFFER_SIZE) {
+			copy_run_flush(image, run);
+			run->start = dst;
+		}
+
+		if (size <= COPY_BUFFER_SIZE) {
+			u8 *p = run->buf + run->len;
+			size_t n = read_file(image, node, src, p, want, pos);
+			memset(p + n, 0, size - n);
+			run->len += size;
+			pos += want;
+			continue;
+		}
+
+		// Too big to batch, stream it through the buffer
+		while (want > 0) {
+			size_t n = read_file(image, node, src, run->buf,
+			                     want < COPY_BUFFER_SIZE ? want : COPY_BUFFER_SIZE,
+			                     pos);
+			if (n == 0) {
+				break;
+			}
+			run->len = n;
+			copy_run_flush(image, run);
+			run->start += n;
+			pos += n;
+			want -= n;
+		}
+	}
+
+	if (close(src)) {
+		errno_exit("close");
+	}
+}
+
+void *copier_thread(void *arg) {
+	struct copier *c = arg;
+	struct copy_run run = {xmalloc(COPY_BUFFER_SIZE), 0, 0};
+	for (;;) {
+		size_t i = __atomic_fetch_add(&c->next, COPY_BATCH, __ATOMIC_RELAXED);
+		if (i >= c->num_files) {
+			break;
+		}
+		size_t end = i + COPY_BATCH < c->num_files ? i + COPY_BATCH : c->num_files;
+		for (; i < end; i++) {
+			copy_file(c->image, c->files[i], &run);
+		}
+		copy_run_flush(c->image, &run);
+	}
+	free(run.buf);
+	return NULL;
+}
+
+/* Hash the contents of NODE's host file into NODE->hash, block by block,
+   and with --dedup keep each block's hash too. BUF holds COPY_BUFFER_SIZE
+   bytes. */
+void hash_file(struct image *image, struct node *node, u8 *buf) {
+	int src = open_source(node->path, 0);
+	if (src == -1) {
+		errno_exit(node->path);
+	}
+
+	u64 num_blocks = node_data_blocks(node);
+	if (geometry.dedup) {
+		node->block_hashes = xmalloc(num_blocks * sizeof(*node->block_hashes));
+	}
+	u64 left = node->size;
+	off_t pos = 0;
+	u64 i = 0;
+	while (left > 0) {
+		size_t want = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+		size_t n = read_file(image, node, src, buf, want, pos);
+		size_t size = (want + geometry.block_size - 1) / geometry.block_size
+		              * geometry.block_size;
+		memset(buf + n, 0, size - n);
+		for (size_t off = 0; off < size; off += geometry.block_size, i++) {
+			u64 hash[2] = {0, 0};  /* Zeros stand for a block of zeros */
+			if (!is_zero(buf + off, geometry.block_size)) {
+				hash128(buf + off, geometry.block_size, hash);
+			}
+			if (node->block_hashes) {
+				memcpy(node->block_hashes[i], hash, sizeof(hash));
+			}
+			hash128(hash, sizeof(hash), node->hash);
+		}
+		pos += want;
+		left -= want;
+	}
+	assert(i == num_blocks);
+
+	if (close(src)) {
+		errno_exit("close");
+	}
+}
+
+/* Like copier_thread(), but hash the files instead. */
+void *hasher_thread(void *arg) {
+	struct copier *c = arg;
+	u8 *buf = xmalloc(COPY_BUFFER_SIZE);
+	for (;;) {
+		size_t i = __atomic_fetch_add(&c->next, COPY_BATCH, __ATOMIC_RELAXED);
+		if (i >= c->num_files) {
+			break;
+		}
+		size_t end = i + COPY_BATCH < c->num_files ? i + COPY_BATCH : c->num_files;
+		for (; i < end; i++) {
+			hash_file(c->image, c->files[i], buf);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Collect the host files with contents in the tree at NODE into FILES. */
+void collect_host_files(struct node *node, struct node ***files,
+                        size_t *num_files) {
+	if (S_ISTYPE(node->mode, EXT2_S_IFREG) && node->path && node->size > 0
+	    && !node->link) {
+		file_list_add(files, num_files, node);
+	}
+	for (size_t i = 0; i < node->num_children; i++) {
+		collect_host_files(node->children[i], files, num_files);
+	}
+}
+
+/* Hash the host files of the tree at ROOT with NUM_THREADS threads,
+   counting their reads in IMAGE. */
+void hash_tree_files(struct image *image, struct node *root, long num_threads) {
+	struct copier hasher = {image, NULL, 0, 0};
+	collect_host_files(root, &hasher.files, &hasher.num_files);
+	if (hasher.num_files > 0) {
+		size_t num_batches = (hasher.num_files + COPY_BATCH - 1) / COPY_BATCH;
+		run_threads(hasher_thread, &hasher,
+		            num_threads < num_batches ? num_threads : num_batches);
+	}
+	free(hasher.files);
+}
+
+/* Hash everything the image keeps of the tree at NODE into H. */
+void hash_tree(struct node *node, u64 h[2]) {
+	u64 fields[] = {node->mode, node->uid, node->gid, node->size, node->atime,
+	                node->ctime, node->mtime, node->rdev, node->num_children,
+	                node->extra_names, node->link != NULL};
+	hash128(fields, sizeof(fields), h);
+	hash128(node->name, strlen(node->name), h);
+	if (node->target) {
+		hash128(node->target, node->size, h);
+	}
+	if (node->data) {
+		hash128(node->data, node->size, h);
+	}
+	hash128(node->hash, sizeof(node->hash), h);
+	for (size_t i = 0; i < node->num_children; i++) {
+		hash_tree(node->children[i], h);
+	}
+}
+
+/* Derive the UUID from the tree at ROOT, its file contents and the
+   geometry, so that the same input always gives the same image and an
+   image with that UUID is known to be up to date. */
+void set_content_uuid(struct node *root) {
+	u64 h[2] = {IMAGE_FORMAT_VERSION, 0};
+	hash128(&geometry, sizeof(geometry), h);
+	hash128(&fixed_time, sizeof(fixed_time), h);
+	hash_tree(root, h);
+	memcpy(volume_uuid, h, sizeof(volume_uuid));
+	volume_uuid[6] = (volume_uuid[6] & 0x0F) | 0x80;  /* Version 8, custom */
+	volume_uuid[8] = (volume_uuid[8] & 0x3F) | 0x80;  /* RFC 4122 variant */
+}
+
+/* Return whether PATH already holds the image set_content_uuid() named:
+   the right size, the same UUID, and not mounted or written since. */
+int image_up_to_date(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	struct stat st;
+	struct ext2_superblock superblock;
+	int up_to_date = fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+	                 && st.st_size == BLOCK_OFFSET(geometry.blocks_count)
+	                 && pread(fd, &superblock, sizeof(superblock), SUPERBLOCK_OFFSET)
+	                    == sizeof(superblock)
+	                 && superblock.s_magic == EXT2_SUPER_MAGIC
+	                 && memcmp(superblock.s_uuid, volume_uuid, sizeof(volume_uuid)) == 0
+	                 && superblock.s_mtime == 0
+	                 && superblock.s_wtime == get_current_time();
+	close(fd);
+	return up_to_date;
+}
+
+/* Make the timestamps of the tree at NODE reproducible: access and change
+   times, which merely reading or copying the tree moves, become the
+   modification time, and no time is later than CLAMP unless it is -1. */
+void normalize_times(struct node *node, long long clamp) {
+	if (clamp >= 0 && node->mtime > clamp) {
+		node->mtime = clamp;
+	}
+	node->atime = node->ctime = node->mtime;
+	for (size_t i = 0; i < node->num_children; i++) {
+		normalize_times(node->children[i], clamp);
+	}
+}
+
+/* The Android sparse image format, as read by simg2img and fastboot: a
+   header, then chunks that each cover a number of blocks and hold their
+   contents, a 32-bit value that fills them, or nothing if their contents
+   do not matter. */
+#define SPARSE_HEADER_MAGIC 0xED26FF3A
+#define SPARSE_CHUNK_RAW 0xCAC1
+#define SPARSE_CHUNK_FILL 0xCAC2
+#define SPARSE_CHUNK_DONT_CARE 0xCAC3
+
+struct sparse_header {
+	u32 magic;
+	u16 major_version;
+	u16 minor_version;
+	u16 file_hdr_sz;
+	u16 chunk_hdr_sz;
+	u32 blk_sz;
+	u32 total_blks;
+	u32 total_chunks;
+	u32 image_checksum;
+};
+
+struct sparse_chunk_header {
+	u16 chunk_type;
+	u16 reserved1;
+	u32 chunk_sz;  /* In blocks */
+	u32 total_sz;  /* In bytes, this header included */
+};
+
+/* The chunk being gathered: LEN blocks of TYPE, with their contents in
+   RAW for raw chunks. */
+struct sparse_writer {
+	FILE *out;
+	const char *path;
+	u16 type;
+	u32 fill;
+	u32 len;
+	u8 *raw;
+	u32 num_chunks;
+};
+
+void sparse_write(struct sparse_writer *w, const void *buf, size_t size) {
+	if (fwrite(buf, 1, size, w->out) != size) {
+		errno_exit(w->path);
+	}
+}
+
+void sparse_end_chunk(struct sparse_writer *w) {
+	if (w->len == 0) {
+		return;
+	}
+	struct sparse_chunk_header chunk = {0};
+	chunk.chunk_type = w->type;
+	chunk.chunk_sz = w->len;
+	chunk.total_sz = sizeof(chunk);
+	if (w->type == SPARSE_CHUNK_RAW) {
+		chunk.total_sz += w->len * geometry.block_size;
+	}
+	else if (w->type == SPARSE_CHUNK_FILL) {
+		chunk.total_sz += sizeof(w->fill);
+	}
+	sparse_write(w, &chunk, sizeof(chunk));
+	if (w->type == SPARSE_CHUNK_RAW) {
+		sparse_write(w, w->raw, w->len * geometry.block_size);
+	}
+	else if (w->type == SPARSE_CHUNK_FILL) {
+		sparse_write(w, &w->fill, sizeof(w->fill));
+	}
+	w->num_chunks++;
+	w->len = 0;
+}
+
+/* Add one block to the output: BUF, or nothing if BUF is NULL and the
+   block is not in use. */
+void sparse_add_block(struct sparse_writer *w, const u8 *buf, int in_use) {
+	u16 type = SPARSE_CHUNK_DONT_CARE;
+	u32 fill = 0;
+	if (buf) {
+		type = SPARSE_CHUNK_FILL;
+		memcpy(&fill, buf, sizeof(fill));
+		for (u32 i = sizeof(fill); i < geometry.block_size; i += sizeof(fill)) {
+			if (memcmp(buf, buf + i, sizeof(fill))) {
+				type = SPARSE_CHUNK_RAW;
+				break;
+			}
+		}
+	}
+	else if (in_use) {
+		type = SPARSE_CHUNK_FILL;
+	}
+
+	if (w->len > 0 && (type != w->type
+	                   || (type == SPARSE_CHUNK_FILL && fill != w->fill)
+	                   || (type == SPARSE_CHUNK_RAW
+	                       && (w->len + 1) * geometry.block_size > COPY_BUFFER_SIZE))) {
+		sparse_end_chunk(w);
+	}
+	w->type = type;
+	w->fill = fill;
+	if (type == SPARSE_CHUNK_RAW) {
+		memcpy(w->raw + w->len * geometry.block_size, buf, geometry.block_size);
+	}
+	w->len++;
+}
+
+/* Return whether LAYOUT gave block BLOCKNO to metadata or to a file. */
+int block_in_use(struct layout *layout, u32 blockno) {
+	if (blockno < geometry.first_data_block) {
+		return 0;
+	}
+	return layout_block_used(layout, blockno);
+}
+
+/* Convert the image just written to IMAGE_PATH into a sparse image at
+   PATH. Holes in free blocks become "don't care" chunks, so they are
+   neither stored nor written when the image is flashed; holes elsewhere,
+   such as unused inodes, are filled with zeros. */
+void write_sparse_image(struct layout *layout, const char *image_path,
+                        const char *path) {
+	int fd = open(image_path, O_RDONLY);
+	if (fd == -1) {
+		errno_exit(image_path);
+	}
+	struct sparse_writer w = {fopen(path, "w"), path, 0, 0, 0,
+	                          xmalloc(COPY_BUFFER_SIZE), 0};
+	if (w.out == NULL) {
+		errno_exit(path);
+	}
+
+	/* Room for the header, written last when the chunks are counted */
+	struct sparse_header header = {0};
+	sparse_write(&w, &header, sizeof(header));
+
+	u8 *buf = xmalloc(COPY_BUFFER_SIZE);
+	u32 per_read = COPY_BUFFER_SIZE / geometry.block_size;
+	u32 blockno = 0;
+	while (blockno < geometry.blocks_count) {
+		/* Find the next stretch of data, rounded out to whole blocks */
+		u32 data = blockno;
+		u32 hole = geometry.blocks_count;
+#ifdef SEEK_DATA
+		off_t off = lseek(fd, BLOCK_OFFSET(blockno), SEEK_DATA);
+		if (off == -1 && errno == ENXIO) {
+			data = geometry.blocks_count;
+		}
+		else if (off != -1) {
+			data = off / geometry.block_size;
+			off = lseek(fd, off, SEEK_HOLE);
+			if (off == -1) {
+				errno_exit(image_path);
+			}
+			hole = (off + geometry.block_size - 1) / geometry.block_size;
+		}
+		else if (errno != EINVAL) {
+			errno_exit(image_path);
+		}
+		/* EINVAL: no hole support, so it is all data */
+#endif
+		for (; blockno < data; blockno++) {
+			sparse_add_block(&w, NULL, block_in_use(layout, blockno));
+		}
+		if (hole > geometry.blocks_count) {
+			hole = geometry.blocks_count;
+		}
+		while (blockno < hole) {
+			u32 n = hole - blockno < per_read ? hole - blockno : per_read;
+			size_t size = (size_t) n * geometry.block_size;
+			ssize_t got = pread(fd, buf, size, BLOCK_OFFSET(blockno));
+			if (got == -1) {
+				errno_exit(image_path);
+			}
+			memset(buf + got, 0, size - got);
+			for (u32 i = 0; i < n; i++) {
+				sparse_add_block(&w, buf + (size_t) i * geometry.block_size, 1);
+			}
+			blockno += n;
+		}
+	}
+	sparse_end_chunk(&w);
+
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.minor_version = 0;
+	header.file_hdr_sz = sizeof(struct sparse_header);
+	header.chunk_hdr_sz = sizeof(struct sparse_chunk_header);
+	header.blk_sz = geometry.block_size;
+	header.total_blks = geometry.blocks_count;
+	header.total_chunks = w.num_chunks;
+	if (fseek(w.out, 0, SEEK_SET)) {
+		errno_exit(path);
+	}
+	sparse_write(&w, &header, sizeof(header));
+	if (fclose(w.out)) {
+		errno_exit(path);
+	}
+	if (close(fd)) {
+		errno_exit("close");
+	}
+	free(buf);
+	free(w.raw);
+}
+
+/* What the tree takes up in the image, for --stats. */
+struct space {
+	u64 files;
+	u64 file_bytes;
+	u64 file_blocks;   /* Data blocks of regular files, holes included */
+	u64 file_holes;    /* ... left as holes */
+	u64 map_blocks;    /* Indirect blocks */
+	u64 dir_blocks;
+	u64 fast_symlinks; /* Targets kept in the inode */
+	u64 slow_symlinks; /* Targets in a data block */
+	u64 with_blocks;   /* Files of any type with blocks */
+	u64 fragmented;    /* ... whose blocks are not one run */
+	u64 runs;          /* Runs of blocks of those */
+	u64 away;          /* ... whose first block is not in their inode's group */
+};
+
+/* Add to *RUNS the block BLOCKNO, which follows *LAST, if it starts a new
+   run. A run carries on past the metadata at the start of a group. */
+void count_run(u32 blockno, u32 *last, u64 *runs) {
+	if (blockno == 0) {
+		return;  /* A hole */
+	}
+	u32 group = block_group(blockno);
+	if (*last == 0
+	    || (blockno != *last + 1
+	        && !(group > 0 && *last + 1 == group_first_block(group)
+	             && blockno == group_data_start(group)))) {
+		(*runs)++;
+	}
+	*last = blockno;
+}
+
+void count_map_runs(struct block_iter *map, struct block_iter *data, int level,
+                    u64 *left, u32 *last, u64 *runs) {
+	count_run(block_iter_next(map), last, runs);
+	for (u32 i = 0; i < geometry.block_size / sizeof(u32) && *left > 0; i++) {
+		if (level == 0) {
+			count_run(block_iter_next(data), last, runs);
+			(*left)--;
+		}
+		else {
+			count_map_runs(map, data, level - 1, left, last, runs);
+		}
+	}
+}
+
+/* Return the number of runs of consecutive blocks NODE has, taking them
+   in the order write_block_map() maps them, as e2fsck does. Store its
+   first block in *FIRST. */
+u64 node_runs(struct node *node, u32 *first) {
+	struct block_iter data = {node->extents, node->num_extents, 0, 0};
+	struct block_iter map = {node->map_extents, node->num_map_extents, 0, 0};
+	u64 left = node->num_blocks;
+	u32 last = 0;
+	u64 runs = 0;
+	*first = 0;
+	for (u32 i = 0; i < EXT2_NDIR_BLOCKS && left > 0; i++, left--) {
+		count_run(block_iter_next(&data), &last, &runs);
+		if (*first == 0) {
+			*first = last;
+		}
+	}
+	for (int level = 0; level < 3 && left > 0; level++) {
+		count_map_runs(&map, &data, level, &left, &last, &runs);
+		if (*first == 0) {
+			*first = node->map_extents[0].start;
+		}
+	}
+	return runs;
+}
+
+void count_space(struct node *node, struct space *space) {
+	if (node->link) {
+		return;
+	}
+	if (S_ISTYPE(node->mode, EXT2_S_IFREG)) {
+		space->files++;
+		space->file_bytes += node->size;
+		space->file_blocks += node->num_blocks;
+		space->file_holes += node->num_holes;
+	}
+	else if (S_ISTYPE(node->mode, EXT2_S_IFDIR)) {
+		space->dir_blocks += node->num_blocks;
+	}
+	else if (S_ISTYPE(node->mode, EXT2_S_IFLNK) && node->num_blocks) {
+		space->slow_symlinks++;
+	}
+	else if (S_ISTYPE(node->mode, EXT2_S_IFLNK)) {
+		space->fast_symlinks++;
+	}
+	space->map_blocks += node->num_map_blocks;
+	u32 first;
+	u64 runs = node_runs(node, &first);
+	if (runs > 0) {
+		space->with_blocks++;
+		if (runs > 1) {
+			space->fragmented++;
+			space->runs += runs;
+		}
+		if (block_group(first) != inode_group(node->ino)) {
+			space->away++;
+		}
+	}
+	for (size_t i = 0; i < node->num_children; i++) {
+		count_space(node->children[i], space);
+	}
+}
+
+/* Return the number of inode table blocks that hold some inode in use;
+   the others are left as holes. */
+u64 inode_table_blocks_used(struct layout *layout) {
+	u32 per_block = geometry.block_size / sizeof(struct ext2_inode);
+	u64 used = 0;
+	for (u32 ino = 1; ino <= geometry.inodes_count; ino += per_block) {
+		for (u32 i = 0; i < per_block; i++) {
+			if (layout_inode_used(layout, ino + i)) {
+				used++;
+				break;
+			}
+		}
+	}
+	return used;
+}
+
+/* Parse a byte count with an optional K, M, G or T suffix. */
+u64 parse_size(const char *arg) {
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(arg, &end, 10);
+	int shift = 0;
+	switch (*end) {
+	case 'K': case 'k': shift = 10; end++; break;
+	case 'M': case 'm': shift = 20; end++; break;
+	case 'G': case 'g': shift = 30; end++; break;
+	case 'T': case 't': shift = 40; end++; break;
+	}
+	if (errno || end == arg || *end || n == 0 || n > (UINT64_MAX >> shift)) {
+		fprintf(stderr, "%s: invalid size\n", arg);
+		exit(1);
+	}
+	return (u64) n << shift;
+}
+
+/* Parse SOURCE_DATE_EPOCH, a count of seconds since the epoch. */
+long long parse_epoch(const char *arg) {
+	char *end;
+	errno = 0;
+	long long t = strtoll(arg, &end, 10);
+	if (errno || end == arg || *end || t < 0 || t > UINT32_MAX) {
+		fprintf(stderr, "SOURCE_DATE_EPOCH=%s: invalid time\n", arg);
+		exit(1);
+	}
+	return t;
+}
+
+void usage(const char *prog) {
+	fprintf(stderr,
+	        "usage: %s [--from DIR] [--output IMAGE] [--jobs N] [--stats]\n"
+	        "          [--block-size 1024|2048|4096] [--size BYTES] [--inodes N]\n"
+	        "          [--no-sparse-super] [--dir-index] [--sparse-image FILE]\n"
+	        "          [--deterministic] [--dedup] [--update IMAGE [--checksum]]\n"
+	        "  --from DIR         copy the tree at DIR into the image instead of\n"
+	        "                     the built-in hello-world files\n"
+	        "  --output IMAGE     write IMAGE instead of cs111-base.img\n"
+	        "  --jobs N           walk and copy with N threads (default: one per CPU)\n"
+	        "  --stats            report build time and I/O system calls on stderr\n"
+	        "  --block-size SIZE  block size in bytes (default 1024)\n"
+	        "  --size BYTES       image size, with an optional K, M, G or T suffix\n"
+	        "                     (default: 1M, or just enough for --from DIR)\n"
+	        "  --inodes N         number of inodes (default: one per 8K of image)\n"
+	        "  --no-sparse-super  back up the superblock in every block group\n"
+	        "  --dir-index        index directories larger than a block by hash\n"
+	        "  --sparse-image FILE\n"
+	        "                     also write the image to FILE in the Android\n"
+	        "                     sparse format\n"
+	        "  --deterministic    build the same image from the same input: fixed\n"
+	        "                     timestamps (SOURCE_DATE_EPOCH, or 0) and a UUID\n"
+	        "                     derived from the input, and no rebuild if IMAGE\n"
+	        "                     is already that image\n"
+	        "  --dedup            store identical file blocks once, shared between\n"
+	        "                     files (experimental: the image can only be\n"
+	        "                     mounted read-only)\n"
+	        "  --update IMAGE     change IMAGE in place to hold the tree, copying\n"
+	        "                     only files whose size or modification time\n"
+	        "                     changed\n"
+	        "  --checksum         with --update, compare file contents instead\n",
+	        prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option long_options[] = {
+		{"block-size", required_argument, NULL, 'b'},
+		{"checksum", no_argument, NULL, 'c'},
+		{"dedup", no_argument, NULL, 'e'},
+		{"deterministic", no_argument, NULL, 'D'},
+		{"dir-index", no_argument, NULL, 'd'},
+		{"from", required_argument, NULL, 'f'},
+		{"inodes", required_argument, NULL, 'i'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"no-sparse-super", no_argument, NULL, 'S'},
+		{"output", required_argument, NULL, 'o'},
+		{"size", required_argument, NULL, 'z'},
+		{"sparse-image", required_argument, NULL, 'I'},
+		{"stats", no_argument, NULL, 's'},
+		{"update", required_argument, NULL, 'U'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *from = NULL;
+	const char *output = "cs111-base.img";
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int stats = 0;
+	u32 block_size = DEFAULT_BLOCK_SIZE;
+	u64 size = 0;
+	u64 inodes_count = 0;
+	int sparse_super = 1;
+	int dir_index = 0;
+	const char *sparse_image = NULL;
+	int deterministic = 0;
+	int dedup = 0;
+	const char *update = NULL;
+	int checksum = 0;
+	int geometry_set = 0;
+	double start = now_seconds();
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "b:cdDef:i:I:j:o:sSU:z:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = strtoul(optarg, NULL, 10);
+			if (block_size != 1024 && block_size != 2048 && block_size != 4096) {
+				usage(argv[0]);
+			}
+			geometry_set = 1;
+			break;
+		case 'c':
+			checksum = 1;
+			break;
+		case 'd':
+			dir_index = 1;
+			geometry_set = 1;
+			break;
+		case 'D':
+			deterministic = 1;
+			break;
+		case 'e':
+			dedup = 1;
+			break;
+		case 'f':
+			from = optarg;
+			break;
+		case 'i':
+			inodes_count = strtoull(optarg, NULL, 10);
+			if (inodes_count == 0) {
+				usage(argv[0]);
+			}
+			geometry_set = 1;
+			break;
+		case 'I':
+			sparse_image = optarg;
+			break;
+		case 'j':
+			num_threads = strtol(optarg, NULL, 10);
+			if (num_threads <= 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		case 'S':
+			sparse_super = 0;
+			geometry_set = 1;
+			break;
+		case 'U':
+			update = optarg;
+			break;
+		case 'z':
+			size = parse_size(optarg);
+			geometry_set = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+	}
+	if (num_threads <= 0) {
+		num_threads = 1;
+	}
+	/* An update keeps the geometry and layout of the image */
+	if (update ? geometry_set || deterministic || dedup : checksum) {
+		usage(argv[0]);
+	}
+	if (update) {
+		output = update;
+	}
+
+	const char *epoch = getenv("SOURCE_DATE_EPOCH");
+	if (deterministic) {
+		fixed_time = epoch ? parse_epoch(epoch) : 0;
+	}
+
+	struct node *root = from ? host_tree(from, num_threads) : base_tree();
+	u64 num_links = link_tree(root);
+	double walked = now_seconds();
+	if (deterministic && from) {
+		normalize_times(root, epoch ? fixed_time : -1);
+	}
+	add_lost_and_found(root);
+
+	int update_fd = -1;
+	if (update) {
+		if (num_links > 0) {
+			update_refused(update, "hard links are not supported");
+		}
+		update_fd = open(update, O_RDONLY);
+		if (update_fd == -1) {
+			errno_exit(update);
+		}
+		geometry_read(update_fd, update);
+	}
+	else {
+		geometry.block_size = block_size;
+		geometry.dir_index = dir_index;
+		geometry.dedup = dedup;
+	}
+	struct image hash_reads = {0};
+	if (deterministic || dedup || checksum) {
+		hash_tree_files(&hash_reads, root, num_threads);
+	}
+	if (size == 0 && !from) {
+		size = (u64) DEFAULT_NUM_BLOCKS * DEFAULT_BLOCK_SIZE;
+	}
+	if (update) {
+		/* The geometry came from the image */
+	}
+	else if (size == 0) {
+		geometry_fit(root, block_size, inodes_count, sparse_super);
+	}
+	else {
+		if (inodes_count == 0) {
+			inodes_count = size / BYTES_PER_INODE;
+		}
+		geometry_init(block_size, size / block_size, inodes_count, sparse_super);
+	}
+
+	if (deterministic) {
+		set_content_uuid(root);
+	}
+
+	struct layout layout;
+	layout_init(&layout);
+	if (update) {
+		layout_read_maps(&layout, update_fd);
+		match_node(&layout, update_fd, root, read_image_tree(update_fd), checksum);
+		if (close(update_fd)) {
+			errno_exit("close");
+		}
+	}
+	layout_tree(&layout, root);
+	double laid_out = now_seconds();
+	double built = laid_out;
+	double copied = laid_out;
+
+	struct image image = {0};
+	size_t num_copied = 0;
+	if (deterministic && image_up_to_date(output)) {
+		printf("%s: up to date\n", output);
+	}
+	else {
+		image_create(&image, output, update != NULL);
+
+		write_groups(&image, &layout);
+		struct ext2_inode unused = {0};
+		for (u32 i = 0; i < layout.num_freed_inodes; i++) {
+			write_inode(&image, layout.freed_inodes[i], &unused);
+		}
+		write_inode_table(&image, root);
+
+		struct copier copier = {&image, NULL, 0, 0};
+		write_tree_blocks(&image, root, &copier.files, &copier.num_files);
+		built = now_seconds();
+		if (copier.num_files > 0) {
+			size_t num_batches = (copier.num_files + COPY_BATCH - 1) / COPY_BATCH;
+			run_threads(copier_thread, &copier,
+			            num_threads < num_batches ? num_threads : num_batches);
+		}
+		free(copier.files);
+		num_copied = copier.num_files;
+		copied = now_seconds();
+
+		/* Only an update that changes something moves the write time */
+		if (update && (image_drop_unchanged(&image) || num_copied > 0)) {
+			layout.write_time = get_current_time();
+			write_superblocks(&image, &layout);
+		}
+		image_close(&image);
+	}
+	image.read_calls += hash_reads.read_calls;
+	if (sparse_image) {
+		write_sparse_image(&layout, output, sparse_image);
+	}
+
+	if (stats) {
+		u32 used_inodes = 0;
+		u32 used_blocks = geometry.first_data_block;
+		for (u32 g = 0; g < geometry.num_groups; g++) {
+			used_inodes += group_used_inodes(&layout, g);
+			used_blocks += group_used_blocks(&layout, g);
+		}
+		fprintf(stderr,
+		        "%s: %u inodes, %u blocks (%u groups of %u-byte blocks) in %.3f s; "
+		        "%llu write calls (%llu bytes), %llu read calls, "
+		        "%llu zero blocks skipped\n",
+		        output, used_inodes, used_blocks,
+		        geometry.num_groups, geometry.block_size,
+		        now_seconds() - start,
+		        (unsigned long long) image.write_calls,
+		        (unsigned long long) image.bytes_written,
+		        (unsigned long long) image.read_calls,
+		        (unsigned long long) image.zero_blocks);
+
+		double end = now_seconds();
+		fprintf(stderr,
+		        "%s: %.3f s walking, %.3f s laying out, %.3f s building metadata, "
+		        "%.3f s copying, %.3f s writing metadata\n",
+		        output, walked - start, laid_out - walked, built - laid_out,
+		        copied - built, end - copied);
+
+		struct space space = {0};
+		count_space(root, &space);
+		u64 file_space = space.file_blocks * geometry.block_size;
+		fprintf(stderr,
+		        "%s: %llu files, %llu bytes in %llu blocks (%.1f%% used, "
+		        "%llu left as holes), %llu indirect blocks, %llu directory blocks; "
+		        "%llu fast symlinks, %llu in a block; "
+		        "%llu of %llu inode table blocks in use\n",
+		        output, (unsigned long long) space.files,
+		        (unsigned long long) space.file_bytes,
+		        (unsigned long long) space.file_blocks,
+		        file_space ? 100.0 * space.file_bytes / file_space : 100.0,
+		        (unsigned long long) space.file_holes,
+		        (unsigned long long) space.map_blocks,
+		        (unsigned long long) space.dir_blocks,
+		        (unsigned long long) space.fast_symlinks,
+		        (unsigned long long) space.slow_symlinks,
+		        (unsigned long long) inode_table_blocks_used(&layout),
+		        (unsigned long long) geometry.inode_table_blocks * geometry.num_groups);
+		u32 dir_groups = 0;
+		for (u32 g = 0; g < geometry.num_groups; g++) {
+			dir_groups += layout.group_dirs[g] > 0;
+		}
+		fprintf(stderr,
+		        "%s: %llu of %llu files in more than one run (%llu runs), "
+		        "%llu starting outside their inode's group; "
+		        "directories in %u of %u groups\n",
+		        output, (unsigned long long) space.fragmented,
+		        (unsigned long long) space.with_blocks,
+		        (unsigned long long) space.runs,
+		        (unsigned long long) space.away,
+		        dir_groups, geometry.num_groups);
+		if (update) {
+			fprintf(stderr, "%s: %llu blocks already up to date, %zu files copied\n",
+			        output, (unsigned long long) image.unchanged_blocks,
+			        num_copied);
+		}
+		if (dedup) {
+			/* Blocks of zeros are the holes */
+			fprintf(stderr, "%s: %zu file blocks stored, saved %llu blocks by dedup "
+			        "(%llu shared, %llu of zeros)\n",
+			        output, layout.dedup.len,
+			        (unsigned long long) (layout.shared_blocks + space.file_holes),
+			        (unsigned long long) layout.shared_blocks,
+			        (unsigned long long) space.file_holes);
+		}
 	}
 	return 0;
 }
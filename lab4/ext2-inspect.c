@@ -0,0 +1,680 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ext2.h"
+
+/* Check an ext2 image without mounting it. The image is mapped read-only
+   and its block groups are scanned in parallel: each thread takes the
+   next group, checks its bitmaps against its inode table, and follows
+   the block maps and directory entries of its inodes. Blocks claimed and
+   links found are gathered in shared tables, which a second parallel
+   pass compares with the bitmaps and link counts on disk. */
+
+#define errno_exit(str)                                                        \
+	do { int err = errno; perror(str); exit(err); } while (0)
+
+/* Report at most this many problems, then only count them */
+#define MAX_REPORTED 100
+
+/* The image and what the superblock says about it. */
+struct image {
+	const u8 *data;
+	u64 size;
+	const struct ext2_superblock *sb;
+	const struct ext2_block_group_descriptor *gdt;
+
+	u32 block_size;
+	u32 blocks_count;
+	u32 inodes_count;
+	u32 first_data_block;
+	u32 blocks_per_group;
+	u32 inodes_per_group;
+	u32 inode_size;
+	u32 num_groups;
+	u32 gdt_blocks;
+	u32 first_ino;
+	int sparse_super;
+	int shared_blocks;  /* Files may share data blocks */
+};
+
+struct image image;
+
+/* What the scan found, updated atomically by the threads. */
+struct scan {
+	u8 *claimed;      /* Bitmap of blocks claimed by metadata or an inode */
+	u32 *refs;        /* Directory entries naming each inode */
+	u8 *dirs;         /* Inodes in use as directories */
+	u32 next_group;
+
+	u64 problems;
+	u64 used_inodes;
+	u64 used_blocks;
+	u64 num_dirs;
+	u64 num_files;
+	u64 num_entries;
+};
+
+struct scan scan;
+
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void problem(const char *fmt, ...) {
+	u64 n = __atomic_fetch_add(&scan.problems, 1, __ATOMIC_RELAXED);
+	if (n >= MAX_REPORTED) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	pthread_mutex_lock(&report_lock);
+	vprintf(fmt, ap);
+	putchar('\n');
+	pthread_mutex_unlock(&report_lock);
+	va_end(ap);
+}
+
+void *xmalloc(size_t size) {
+	void *p = calloc(1, size ? size : 1);
+	if (p == NULL) {
+		errno_exit("calloc");
+	}
+	return p;
+}
+
+void run_threads(void *(*fn)(void *), void *arg, int num_threads) {
+	pthread_t *threads = xmalloc(num_threads * sizeof(*threads));
+	for (int i = 0; i < num_threads; i++) {
+		int err = pthread_create(&threads[i], NULL, fn, arg);
+		if (err) {
+			errno = err;
+			errno_exit("pthread_create");
+		}
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+int bit_test(const u8 *map, u32 bit) {
+	return map[bit / 8] >> (bit % 8) & 1;
+}
+
+/* Set BIT of MAP and return whether it was already set. */
+int bit_test_and_set(u8 *map, u32 bit) {
+	u8 mask = 1 << (bit % 8);
+	return __atomic_fetch_or(&map[bit / 8], mask, __ATOMIC_RELAXED) & mask;
+}
+
+const u8 *block_data(u32 blockno) {
+	return image.data + (u64) blockno * image.block_size;
+}
+
+int is_power_of(u32 n, u32 base) {
+	while (n > 1 && n % base == 0) {
+		n /= base;
+	}
+	return n == 1;
+}
+
+int group_has_super(u32 group) {
+	if (!image.sparse_super || group <= 1) {
+		return 1;
+	}
+	return is_power_of(group, 3) || is_power_of(group, 5)
+	       || is_power_of(group, 7);
+}
+
+u32 group_first_block(u32 group) {
+	return image.first_data_block + group * image.blocks_per_group;
+}
+
+u32 group_num_blocks(u32 group) {
+	if (group == image.num_groups - 1) {
+		return image.blocks_count - group_first_block(group);
+	}
+	return image.blocks_per_group;
+}
+
+const struct ext2_inode *get_inode(u32 ino) {
+	u32 group = (ino - 1) / image.inodes_per_group;
+	u32 index = (ino - 1) % image.inodes_per_group;
+	return (const void *) (block_data(image.gdt[group].bg_inode_table)
+	                       + (u64) index * image.inode_size);
+}
+
+/* Map the image at PATH and check what every later step relies on: the
+   superblock, and that the descriptor table and every group's bitmaps
+   and inode table lie inside the image. Exit if they do not. */
+void image_open(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		errno_exit(path);
+	}
+	struct stat st;
+	if (fstat(fd, &st)) {
+		errno_exit(path);
+	}
+	image.size = st.st_size;
+	if (image.size < SUPERBLOCK_OFFSET + sizeof(struct ext2_superblock)) {
+		fprintf(stderr, "%s: too small for an ext2 image\n", path);
+		exit(1);
+	}
+	image.data = mmap(NULL, image.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (image.data == MAP_FAILED) {
+		errno_exit("mmap");
+	}
+	close(fd);
+
+	const struct ext2_superblock *sb = (const void *) (image.data + SUPERBLOCK_OFFSET);
+	image.sb = sb;
+	if (sb->s_magic != EXT2_SUPER_MAGIC) {
+		fprintf(stderr, "%s: bad magic number %#x\n", path, sb->s_magic);
+		exit(1);
+	}
+	if (sb->s_log_block_size > 6) {
+		fprintf(stderr, "%s: bad block size\n", path);
+		exit(1);
+	}
+	image.block_size = 1024 << sb->s_log_block_size;
+	image.blocks_count = sb->s_blocks_count;
+	image.inodes_count = sb->s_inodes_count;
+	image.first_data_block = sb->s_first_data_block;
+	image.blocks_per_group = sb->s_blocks_per_group;
+	image.inodes_per_group = sb->s_inodes_per_group;
+	image.inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+	image.first_ino = EXT2_GOOD_OLD_FIRST_INO;
+	if (sb->s_rev_level >= EXT2_DYNAMIC_REV) {
+		image.inode_size = sb->s_inode_size;
+		image.first_ino = sb->s_first_ino;
+		image.sparse_super = sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+		image.shared_blocks = sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SHARED_BLOCKS;
+	}
+
+	if (image.first_data_block != (image.block_size == 1024)) {
+		fprintf(stderr, "%s: first data block %u with %u-byte blocks\n",
+		        path, image.first_data_block, image.block_size);
+		exit(1);
+	}
+	if (image.blocks_per_group == 0 || image.blocks_per_group > image.block_size * 8
+	    || image.inodes_per_group == 0 || image.inodes_per_group > image.block_size * 8
+	    || image.inode_size < EXT2_GOOD_OLD_INODE_SIZE
+	    || image.inode_size > image.block_size
+	    || (image.inode_size & (image.inode_size - 1))) {
+		fprintf(stderr, "%s: bad group geometry\n", path);
+		exit(1);
+	}
+	if (image.blocks_count <= image.first_data_block
+	    || (u64) image.blocks_count * image.block_size > image.size) {
+		fprintf(stderr, "%s: %u blocks do not fit in %llu bytes\n", path,
+		        image.blocks_count, (unsigned long long) image.size);
+		exit(1);
+	}
+	image.num_groups = (image.blocks_count - image.first_data_block
+	                    + image.blocks_per_group - 1) / image.blocks_per_group;
+	if ((u64) image.inodes_per_group * image.num_groups != image.inodes_count) {
+		fprintf(stderr, "%s: %u inodes, but %u groups of %u\n", path,
+		        image.inodes_count, image.num_groups, image.inodes_per_group);
+		exit(1);
+	}
+	image.gdt_blocks = (image.num_groups * sizeof(struct ext2_block_group_descriptor)
+	                    + image.block_size - 1) / image.block_size;
+	if (image.first_data_block + 1 + image.gdt_blocks > image.blocks_count) {
+		fprintf(stderr, "%s: descriptor table past the end\n", path);
+		exit(1);
+	}
+	image.gdt = (const void *) block_data(image.first_data_block + 1);
+
+	u32 table_blocks = ((u64) image.inodes_per_group * image.inode_size
+	                    + image.block_size - 1) / image.block_size;
+	for (u32 g = 0; g < image.num_groups; g++) {
+		const struct ext2_block_group_descriptor *gd = &image.gdt[g];
+		if (gd->bg_block_bitmap >= image.blocks_count
+		    || gd->bg_inode_bitmap >= image.blocks_count
+		    || gd->bg_inode_table >= image.blocks_count
+		    || gd->bg_inode_table + table_blocks > image.blocks_count) {
+			fprintf(stderr, "%s: group %u metadata past the end\n", path, g);
+			exit(1);
+		}
+	}
+}
+
+/* Claim block BLOCKNO for WHAT, which it is part of. */
+void claim_block(u32 blockno, const char *what, u32 ino) {
+	if (blockno < image.first_data_block || blockno >= image.blocks_count) {
+		problem("inode %u: %s block %u out of range", ino, what, blockno);
+		return;
+	}
+	if (bit_test_and_set(scan.claimed, blockno)) {
+		problem("block %u (%s of inode %u) is claimed twice", blockno, what, ino);
+	}
+}
+
+/* The walk over an inode's blocks. VISIT, if not NULL, is called for
+   each data block in file order. With CLAIM set, every block is claimed
+   on the way. */
+struct block_walk {
+	u32 ino;
+	int claim;
+	u64 num_blocks;     /* Data and indirect blocks found */
+	u64 num_data;
+	u64 last_logical;   /* One past the last mapped data block */
+	void (*visit)(struct block_walk *walk, u64 logical, u32 blockno);
+	void *arg;
+	u64 num_shared;     /* Data blocks another file claimed first */
+};
+
+/* Follow the pointer BLOCKNO to logical block LOGICAL through LEVEL
+   levels of indirect blocks. Return the number of logical blocks it
+   spans. */
+u64 walk_pointer(struct block_walk *walk, u32 blockno, u64 logical, int level) {
+	u64 per_block = image.block_size / sizeof(u32);
+	u64 span = 1;
+	for (int i = 0; i < level; i++) {
+		span *= per_block;
+	}
+	if (blockno == 0) {
+		return span;  /* A hole */
+	}
+	if (walk->claim && level == 0 && image.shared_blocks
+	    && blockno >= image.first_data_block && blockno < image.blocks_count) {
+		/* With shared_blocks, a data block may be another file's too */
+		walk->num_shared += bit_test_and_set(scan.claimed, blockno) != 0;
+	}
+	else if (walk->claim) {
+		claim_block(blockno, level ? "indirect" : "data", walk->ino);
+	}
+	if (blockno < image.first_data_block || blockno >= image.blocks_count) {
+		return span;
+	}
+	walk->num_blocks++;
+	if (level == 0) {
+		walk->num_data++;
+		walk->last_logical = logical + 1;
+		if (walk->visit) {
+			walk->visit(walk, logical, blockno);
+		}
+		return span;
+	}
+
+	const u32 *entries = (const void *) block_data(blockno);
+	for (u64 i = 0; i < per_block; i++) {
+		walk_pointer(walk, entries[i], logical + i * (span / per_block), level - 1);
+	}
+	return span;
+}
+
+void walk_blocks(struct block_walk *walk, const struct ext2_inode *inode) {
+	u64 logical = 0;
+	for (int i = 0; i < EXT2_N_BLOCKS; i++) {
+		int level = i < EXT2_NDIR_BLOCKS ? 0 : i - EXT2_NDIR_BLOCKS + 1;
+		logical += walk_pointer(walk, inode->i_block[i], logical, level);
+	}
+}
+
+/* Check the entries of one directory block and count the inodes they
+   name. */
+void visit_dir_block(struct block_walk *walk, u64 logical, u32 blockno) {
+	const u8 *block = block_data(blockno);
+	u32 off = 0;
+	while (off < image.block_size) {
+		const struct ext2_dir_entry *entry = (const void *) (block + off);
+		u32 left = image.block_size - off;
+		if (left < 8 || entry->rec_len < 8 || entry->rec_len % 4
+		    || entry->rec_len > left) {
+			problem("directory %u: bad entry at block %llu offset %u",
+			        walk->ino, (unsigned long long) logical, off);
+			return;
+		}
+		u32 name_len = entry->name_len & 0xFF;
+		if (entry->inode && 8 + name_len > entry->rec_len) {
+			problem("directory %u: name overflows entry at block %llu offset %u",
+			        walk->ino, (unsigned long long) logical, off);
+			return;
+		}
+		if (logical == 0 && off == 0
+		    && (entry->inode != walk->ino || name_len != 1 || entry->name[0] != '.')) {
+			problem("directory %u: first entry is not \".\"", walk->ino);
+		}
+		if (entry->inode > image.inodes_count) {
+			problem("directory %u: entry \"%.*s\" names inode %u, out of range",
+			        walk->ino, (int) name_len, entry->name, entry->inode);
+		}
+		else if (entry->inode) {
+			__atomic_fetch_add(&scan.refs[entry->inode], 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&scan.num_entries, 1, __ATOMIC_RELAXED);
+		}
+		off += entry->rec_len;
+	}
+}
+
+/* Check the inode INO, which the inode bitmap marks in use. */
+void check_inode(u32 ino, const struct ext2_inode *inode) {
+	u16 type = inode->i_mode & 0xF000;
+	if (ino < image.first_ino && ino != EXT2_ROOT_INO) {
+		/* Reserved: only claim its blocks, as the resize inode has */
+		struct block_walk walk = {ino, 1, 0, 0, 0, NULL, NULL};
+		walk_blocks(&walk, inode);
+		__atomic_fetch_add(&scan.used_blocks, walk.num_blocks, __ATOMIC_RELAXED);
+		return;
+	}
+	if (type != EXT2_S_IFREG && type != EXT2_S_IFDIR && type != EXT2_S_IFLNK
+	    && type != EXT2_S_IFCHR && type != EXT2_S_IFBLK && type != EXT2_S_IFIFO
+	    && type != EXT2_S_IFSOCK) {
+		problem("inode %u: bad mode %#o", ino, inode->i_mode);
+		return;
+	}
+	if (ino == EXT2_ROOT_INO && type != EXT2_S_IFDIR) {
+		problem("root inode is not a directory");
+	}
+	if (inode->i_links_count == 0 || inode->i_dtime) {
+		problem("inode %u: in use but deleted", ino);
+	}
+
+	struct block_walk walk = {ino, 1, 0, 0, 0, NULL, NULL};
+	u64 size = inode->i_size;
+	if (type == EXT2_S_IFREG) {
+		size |= (u64) inode->i_dir_acl << 32;
+		__atomic_fetch_add(&scan.num_files, 1, __ATOMIC_RELAXED);
+	}
+	if (type == EXT2_S_IFDIR) {
+		walk.visit = visit_dir_block;
+		__atomic_fetch_add(&scan.num_dirs, 1, __ATOMIC_RELAXED);
+		bit_test_and_set(scan.dirs, ino);
+	}
+	int fast_symlink = type == EXT2_S_IFLNK && inode->i_blocks == 0;
+	int device = type == EXT2_S_IFCHR || type == EXT2_S_IFBLK;
+	if (!fast_symlink && !device) {
+		walk_blocks(&walk, inode);
+	}
+
+	if ((u64) inode->i_blocks != walk.num_blocks * (image.block_size / 512)) {
+		problem("inode %u: i_blocks is %u, but %llu blocks are mapped",
+		        ino, inode->i_blocks, (unsigned long long) walk.num_blocks);
+	}
+	u64 size_blocks = (size + image.block_size - 1) / image.block_size;
+	if (walk.last_logical > size_blocks) {
+		problem("inode %u: blocks mapped past its size of %llu bytes",
+		        ino, (unsigned long long) size);
+	}
+	if (type == EXT2_S_IFDIR && (walk.num_data == 0 || size % image.block_size
+	                             || walk.num_data != size_blocks)) {
+		problem("directory %u: size %llu does not match its %llu blocks",
+		        ino, (unsigned long long) size, (unsigned long long) walk.num_data);
+	}
+	__atomic_fetch_add(&scan.used_blocks, walk.num_blocks - walk.num_shared,
+	                   __ATOMIC_RELAXED);
+}
+
+/* Claim GROUP's metadata blocks, then check its inodes. */
+void scan_group(u32 group) {
+	const struct ext2_block_group_descriptor *gd = &image.gdt[group];
+	u32 first = group_first_block(group);
+	u32 table_blocks = ((u64) image.inodes_per_group * image.inode_size
+	                    + image.block_size - 1) / image.block_size;
+	if (group_has_super(group)) {
+		for (u32 b = first; b < first + 1 + image.gdt_blocks; b++) {
+			claim_block(b, "superblock", 0);
+		}
+	}
+	claim_block(gd->bg_block_bitmap, "block bitmap", 0);
+	claim_block(gd->bg_inode_bitmap, "inode bitmap", 0);
+	for (u32 b = 0; b < table_blocks; b++) {
+		claim_block(gd->bg_inode_table + b, "inode table", 0);
+	}
+	__atomic_fetch_add(&scan.used_blocks,
+	                   (group_has_super(group) ? 1 + image.gdt_blocks : 0)
+	                   + 2 + table_blocks, __ATOMIC_RELAXED);
+
+	const u8 *inode_bitmap = block_data(gd->bg_inode_bitmap);
+	u32 used = 0;
+	u32 dirs = 0;
+	for (u32 i = 0; i < image.inodes_per_group; i++) {
+		u32 ino = group * image.inodes_per_group + i + 1;
+		const struct ext2_inode *inode = get_inode(ino);
+		if (!bit_test(inode_bitmap, i)) {
+			if (inode->i_mode && inode->i_links_count && inode->i_dtime == 0) {
+				problem("inode %u: looks in use but is free in the bitmap", ino);
+			}
+			continue;
+		}
+		used++;
+		if (S_ISTYPE(inode->i_mode, EXT2_S_IFDIR)) {
+			dirs++;
+		}
+		check_inode(ino, inode);
+	}
+	for (u32 i = image.inodes_per_group; i < image.block_size * 8; i++) {
+		if (!bit_test(inode_bitmap, i)) {
+			problem("group %u: inode bitmap padding not set", group);
+			break;
+		}
+	}
+	if (gd->bg_free_inodes_count != image.inodes_per_group - used) {
+		problem("group %u: %u free inodes recorded, %u found", group,
+		        gd->bg_free_inodes_count, image.inodes_per_group - used);
+	}
+	if (gd->bg_used_dirs_count != dirs) {
+		problem("group %u: %u directories recorded, %u found", group,
+		        gd->bg_used_dirs_count, dirs);
+	}
+	__atomic_fetch_add(&scan.used_inodes, used, __ATOMIC_RELAXED);
+}
+
+/* Compare GROUP's block bitmap with the blocks claimed in it, and the
+   link counts of its inodes with the entries naming them. */
+void check_group(u32 group) {
+	const struct ext2_block_group_descriptor *gd = &image.gdt[group];
+	const u8 *block_bitmap = block_data(gd->bg_block_bitmap);
+	u32 first = group_first_block(group);
+	u32 num_blocks = group_num_blocks(group);
+	u32 used = 0;
+	u32 reported = 0;
+	for (u32 i = 0; i < num_blocks; i++) {
+		int on_disk = bit_test(block_bitmap, i);
+		int claimed = bit_test(scan.claimed, first + i);
+		used += on_disk;
+		if (on_disk != claimed && reported++ < 3) {
+			problem("block %u: %s in the bitmap but %s", first + i,
+			        on_disk ? "used" : "free", claimed ? "claimed" : "unclaimed");
+		}
+	}
+	for (u32 i = num_blocks; i < image.block_size * 8; i++) {
+		if (!bit_test(block_bitmap, i)) {
+			problem("group %u: block bitmap padding not set", group);
+			break;
+		}
+	}
+	if (gd->bg_free_blocks_count != num_blocks - used) {
+		problem("group %u: %u free blocks recorded, %u found", group,
+		        gd->bg_free_blocks_count, num_blocks - used);
+	}
+
+	const u8 *inode_bitmap = block_data(gd->bg_inode_bitmap);
+	for (u32 i = 0; i < image.inodes_per_group; i++) {
+		u32 ino = group * image.inodes_per_group + i + 1;
+		if (ino < image.first_ino && ino != EXT2_ROOT_INO) {
+			continue;
+		}
+		u32 refs = scan.refs[ino];
+		if (!bit_test(inode_bitmap, i)) {
+			if (refs) {
+				problem("inode %u: free, but named by %u entries", ino, refs);
+			}
+			continue;
+		}
+		const struct ext2_inode *inode = get_inode(ino);
+		if (refs == 0) {
+			problem("inode %u: in use, but no directory names it", ino);
+		}
+		else if (refs != inode->i_links_count) {
+			problem("inode %u: link count %u, but named by %u entries", ino,
+			        inode->i_links_count, refs);
+		}
+	}
+}
+
+void *scan_thread(void *arg) {
+	void (*fn)(u32) = arg;
+	for (;;) {
+		u32 group = __atomic_fetch_add(&scan.next_group, 1, __ATOMIC_RELAXED);
+		if (group >= image.num_groups) {
+			return NULL;
+		}
+		fn(group);
+	}
+}
+
+/* Print the tree under directory DIR, named PATH. */
+void list_dir(u32 dir, const char *path, int depth);
+
+struct list_arg {
+	u32 dir;
+	const char *path;
+	int depth;
+};
+
+void visit_list_block(struct block_walk *walk, u64 logical, u32 blockno) {
+	struct list_arg *arg = walk->arg;
+	const u8 *block = block_data(blockno);
+	u32 off = 0;
+	while (off + 8 <= image.block_size) {
+		const struct ext2_dir_entry *entry = (const void *) (block + off);
+		if (entry->rec_len < 8 || entry->rec_len > image.block_size - off) {
+			return;
+		}
+		u32 name_len = entry->name_len & 0xFF;
+		off += entry->rec_len;
+		if (entry->inode == 0 || entry->inode > image.inodes_count
+		    || (name_len == 1 && entry->name[0] == '.')
+		    || (name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
+			continue;
+		}
+
+		const struct ext2_inode *inode = get_inode(entry->inode);
+		size_t len = strlen(arg->path) + 1 + name_len + 1;
+		char *path = xmalloc(len);
+		snprintf(path, len, "%s/%.*s", arg->path, (int) name_len, entry->name);
+		u64 size = inode->i_size;
+		if (S_ISTYPE(inode->i_mode, EXT2_S_IFREG)) {
+			size |= (u64) inode->i_dir_acl << 32;
+		}
+		printf("%8u %06o %12llu %s\n", entry->inode, inode->i_mode,
+		       (unsigned long long) size, path);
+		/* Directories deeper than this must be a loop */
+		if (S_ISTYPE(inode->i_mode, EXT2_S_IFDIR) && arg->depth < 4096) {
+			list_dir(entry->inode, path, arg->depth + 1);
+		}
+		free(path);
+	}
+}
+
+void list_dir(u32 dir, const char *path, int depth) {
+	struct list_arg arg = {dir, path, depth};
+	struct block_walk walk = {dir, 0, 0, 0, 0, visit_list_block, &arg};
+	walk_blocks(&walk, get_inode(dir));
+}
+
+void usage(const char *prog) {
+	fprintf(stderr,
+	        "usage: %s [--jobs N] [--list] IMAGE\n"
+	        "  --jobs N  scan with N threads (default: one per CPU)\n"
+	        "  --list    print every file in the image\n",
+	        prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option long_options[] = {
+		{"jobs", required_argument, NULL, 'j'},
+		{"list", no_argument, NULL, 'l'},
+		{NULL, 0, NULL, 0}
+	};
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int list = 0;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "j:l", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'j':
+			num_threads = strtol(optarg, NULL, 10);
+			if (num_threads <= 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+	if (num_threads <= 0) {
+		num_threads = 1;
+	}
+	const char *path = argv[optind];
+
+	image_open(path);
+	if (num_threads > image.num_groups) {
+		num_threads = image.num_groups;
+	}
+	scan.claimed = xmalloc(image.blocks_count / 8 + 1);
+	scan.refs = xmalloc(((size_t) image.inodes_count + 1) * sizeof(*scan.refs));
+	scan.dirs = xmalloc(image.inodes_count / 8 + 1);
+
+	/* Blocks before the first group, the boot block with 1 KiB blocks,
+	   belong to no group and are not in any bitmap */
+	scan.next_group = 0;
+	run_threads(scan_thread, scan_group, num_threads);
+	scan.next_group = 0;
+	run_threads(scan_thread, check_group, num_threads);
+
+	const struct ext2_superblock *sb = image.sb;
+	u64 free_blocks = 0;
+	u64 free_inodes = 0;
+	for (u32 g = 0; g < image.num_groups; g++) {
+		free_blocks += image.gdt[g].bg_free_blocks_count;
+		free_inodes += image.gdt[g].bg_free_inodes_count;
+	}
+	if (sb->s_free_blocks_count != free_blocks) {
+		problem("superblock: %u free blocks recorded, groups have %llu",
+		        sb->s_free_blocks_count, (unsigned long long) free_blocks);
+	}
+	if (sb->s_free_inodes_count != free_inodes) {
+		problem("superblock: %u free inodes recorded, groups have %llu",
+		        sb->s_free_inodes_count, (unsigned long long) free_inodes);
+	}
+	if (!bit_test(scan.dirs, EXT2_ROOT_INO)) {
+		problem("root directory missing");
+	}
+	else if (list) {
+		list_dir(EXT2_ROOT_INO, "", 0);
+	}
+
+	if (scan.problems > MAX_REPORTED) {
+		printf("... and %llu more\n",
+		       (unsigned long long) (scan.problems - MAX_REPORTED));
+	}
+	printf("%s: %u groups of %u-byte blocks; %llu/%u inodes, %llu/%u blocks used; "
+	       "%llu directories, %llu files, %llu entries; %llu problems\n",
+	       path, image.num_groups, image.block_size,
+	       (unsigned long long) scan.used_inodes, image.inodes_count,
+	       (unsigned long long) scan.used_blocks + image.first_data_block,
+	       image.blocks_count,
+	       (unsigned long long) scan.num_dirs, (unsigned long long) scan.num_files,
+	       (unsigned long long) scan.num_entries,
+	       (unsigned long long) scan.problems);
+	return scan.problems ? 1 : 0;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <stdint.h>
+
+/* The on-disk format of ext2, as far as ext2-create writes it and
+   ext2-inspect checks it. All fields are little-endian. */
+
+/* http://www.nongnu.org/ext2-doc/ext2.html */
+/* http://www.science.smith.edu/~nhowe/262/oldlabs/ext2.html */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t i16;
+typedef int32_t i32;
+
+/* The superblock is always at byte 1024, whatever the block size */
+#define SUPERBLOCK_OFFSET 1024
+
+#define EXT2_SUPER_MAGIC 0xEF53
+
+#define	EXT2_BAD_INO             1
+#define EXT2_ROOT_INO            2
+#define EXT2_GOOD_OLD_FIRST_INO 11
+
+#define EXT2_GOOD_OLD_REV 0
+#define EXT2_DYNAMIC_REV  1
+
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+/* ext4's shared_blocks: data blocks may belong to several files, so the
+   file system must not be written. The kernel only mounts it read-only,
+   and e2fsck accepts the shared blocks. */
+#define EXT2_FEATURE_RO_COMPAT_SHARED_BLOCKS 0x4000
+
+#define EXT2_S_IFSOCK 0xC000
+#define EXT2_S_IFLNK  0xA000
+#define EXT2_S_IFREG  0x8000
+#define EXT2_S_IFBLK  0x6000
+#define EXT2_S_IFDIR  0x4000
+#define EXT2_S_IFCHR  0x2000
+#define EXT2_S_IFIFO  0x1000
+#define EXT2_S_ISUID  0x0800
+#define EXT2_S_ISGID  0x0400
+#define EXT2_S_ISVTX  0x0200
+#define EXT2_S_IRUSR  0x0100
+#define EXT2_S_IWUSR  0x0080
+#define EXT2_S_IXUSR  0x0040
+#define EXT2_S_IRGRP  0x0020
+#define EXT2_S_IWGRP  0x0010
+#define EXT2_S_IXGRP  0x0008
+#define EXT2_S_IROTH  0x0004
+#define EXT2_S_IWOTH  0x0002
+#define EXT2_S_IXOTH  0x0001
+
+#define S_ISTYPE(mode, type) (((mode) & 0xF000) == (type))
+
+#define	EXT2_NDIR_BLOCKS 12
+#define	EXT2_IND_BLOCK   EXT2_NDIR_BLOCKS
+#define	EXT2_DIND_BLOCK  (EXT2_IND_BLOCK + 1)
+#define	EXT2_TIND_BLOCK  (EXT2_DIND_BLOCK + 1)
+#define	EXT2_N_BLOCKS    (EXT2_TIND_BLOCK + 1)
+
+#define EXT2_NAME_LEN 255
+#define EXT2_LINK_MAX 32000
+
+#define EXT2_INDEX_FL 0x00001000 /* Hash-indexed directory */
+
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+#define DX_HASH_HALF_MD4 1
+
+struct ext2_superblock {
+	u32 s_inodes_count;
+	u32 s_blocks_count;
+	u32 s_r_blocks_count;
+	u32 s_free_blocks_count;
+	u32 s_free_inodes_count;
+	u32 s_first_data_block;
+	u32 s_log_block_size;
+	i32 s_log_frag_size;
+	u32 s_blocks_per_group;
+	u32 s_frags_per_group;
+	u32 s_inodes_per_group;
+	u32 s_mtime;
+	u32 s_wtime;
+	u16 s_mnt_count;
+	i16 s_max_mnt_count;
+	u16 s_magic;
+	u16 s_state;
+	u16 s_errors;
+	u16 s_minor_rev_level;
+	u32 s_lastcheck;
+	u32 s_checkinterval;
+	u32 s_creator_os;
+	u32 s_rev_level;
+	u16 s_def_resuid;
+	u16 s_def_resgid;
+	u32 s_first_ino;
+	u16 s_inode_size;
+	u16 s_block_group_nr;
+	u32 s_feature_compat;
+	u32 s_feature_incompat;
+	u32 s_feature_ro_compat;
+	u8 s_uuid[16];
+	u8 s_volume_name[16];
+	u8 s_last_mounted[64];
+	u32 s_algorithm_usage_bitmap;
+	u8 s_prealloc_blocks;
+	u8 s_prealloc_dir_blocks;
+	u16 s_padding1;
+	u8 s_journal_uuid[16];
+	u32 s_journal_inum;
+	u32 s_journal_dev;
+	u32 s_last_orphan;
+	u32 s_hash_seed[4];
+	u8 s_def_hash_version;
+	u8 s_jnl_backup_type;
+	u16 s_desc_size;
+	u32 s_default_mount_opts;
+	u32 s_first_meta_bg;
+	u32 s_mkfs_time;
+	u32 s_jnl_blocks[17];
+	u32 s_blocks_count_hi;
+	u32 s_r_blocks_count_hi;
+	u32 s_free_blocks_hi;
+	u16 s_min_extra_isize;
+	u16 s_want_extra_isize;
+	u32 s_flags;
+	u32 s_reserved[167];
+};
+
+_Static_assert(sizeof(struct ext2_superblock) == 1024, "superblock size");
+
+struct ext2_block_group_descriptor
+{
+	u32 bg_block_bitmap;
+	u32 bg_inode_bitmap;
+	u32 bg_inode_table;
+	u16 bg_free_blocks_count;
+	u16 bg_free_inodes_count;
+	u16 bg_used_dirs_count;
+	u16 bg_pad;
+	u32 bg_reserved[3];
+};
+
+struct ext2_inode {
+	u16 i_mode;
+	u16 i_uid;
+	u32 i_size;
+	u32 i_atime;
+	u32 i_ctime;
+	u32 i_mtime;
+	u32 i_dtime;
+	u16 i_gid;
+	u16 i_links_count;
+	u32 i_blocks;
+	u32 i_flags;
+	u32 i_reserved1;
+	u32 i_block[EXT2_N_BLOCKS];
+	u32 i_version;
+	u32 i_file_acl;
+	u32 i_dir_acl;
+	u32 i_faddr;
+	u8  i_frag;
+	u8  i_fsize;
+	u16 i_pad1;
+	u16 i_uid_high;  /* l_i_uid_high: bits 16-31 of the owner's user ID */
+	u16 i_gid_high;  /* l_i_gid_high */
+	u32 i_reserved2;
+};
+
+struct ext2_dir_entry {
+	u32 inode;
+	u16 rec_len;
+	u16 name_len;
+	u8  name[EXT2_NAME_LEN];
+};
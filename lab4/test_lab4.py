@@ -1,6 +1,9 @@
 import datetime
 import os
+import re
+import stat
 import subprocess
+import tempfile
 import time
 import unittest
 
@@ -35,3 +38,198 @@ class Lab4TestCase(unittest.TestCase):
     def test_hello_world(self):
         with open('mnt/hello-world') as f:
             self.assertEqual(f.read(), "Hello world\n")
+
+    def test_from_dir(self):
+        with tempfile.TemporaryDirectory() as src:
+            os.makedirs(os.path.join(src, 'a', 'b'))
+            with open(os.path.join(src, 'a', 'b', 'file'), 'w') as f:
+                f.write('contents\n')
+            for i in range(50):
+                open(os.path.join(src, 'a', 'entry-%02d' % i), 'w').close()
+            os.symlink('b/file', os.path.join(src, 'a', 'link'))
+            image = os.path.join(src, 'from.img')
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image, '--jobs', '4'])
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['fsck.ext2', '-f', '-n', image], capture_output=True)
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['debugfs', '-R', 'cat /a/b/file', image], capture_output=True, text=True)
+            self.assertEqual(p.stdout, 'contents\n')
+
+    def test_dir_index(self):
+        with tempfile.TemporaryDirectory() as src:
+            os.makedirs(os.path.join(src, 'd'))
+            for i in range(2000):
+                with open(os.path.join(src, 'd', 'file-%d' % i), 'w') as f:
+                    f.write('%d\n' % i)
+            image = os.path.join(src, 'index.img')
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image, '--dir-index'])
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['fsck.ext2', '-f', '-n', image], capture_output=True)
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['debugfs', '-R', 'cat /d/file-1234', image], capture_output=True, text=True)
+            self.assertEqual(p.stdout, '1234\n')
+
+    def test_deterministic(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            images = [os.path.join(tmp, name) for name in ('a.img', 'b.img')]
+            for image in images:
+                p = subprocess.run(['./ext2-create', '--deterministic', '--output', image])
+                self.assertEqual(p.returncode, 0)
+            with open(images[0], 'rb') as a, open(images[1], 'rb') as b:
+                self.assertEqual(a.read(), b.read())
+            p = subprocess.run(['./ext2-create', '--deterministic', '--output', images[0]],
+                               capture_output=True, text=True)
+            self.assertIn('up to date', p.stdout)
+
+    def test_update(self):
+        with tempfile.TemporaryDirectory() as src, tempfile.TemporaryDirectory() as tmp:
+            for name in ('keep', 'change', 'remove'):
+                with open(os.path.join(src, name), 'w') as f:
+                    f.write(name + '\n')
+            image = os.path.join(tmp, 'update.img')
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image, '--size', '1M'])
+            self.assertEqual(p.returncode, 0)
+            with open(os.path.join(src, 'change'), 'w') as f:
+                f.write('changed\n' * 1000)
+            os.remove(os.path.join(src, 'remove'))
+            os.makedirs(os.path.join(src, 'new'))
+            with open(os.path.join(src, 'new', 'file'), 'w') as f:
+                f.write('new\n')
+            p = subprocess.run(['./ext2-create', '--update', image, '--from', src])
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['fsck.ext2', '-f', '-n', image], capture_output=True)
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['debugfs', '-R', 'cat /change', image], capture_output=True, text=True)
+            self.assertEqual(p.stdout, 'changed\n' * 1000)
+            p = subprocess.run(['debugfs', '-R', 'cat /new/file', image], capture_output=True, text=True)
+            self.assertEqual(p.stdout, 'new\n')
+            p = subprocess.run(['debugfs', '-R', 'stat /remove', image], capture_output=True, text=True)
+            self.assertIn('not found', p.stderr)
+
+    def test_inspect(self):
+        p = subprocess.run(['./ext2-inspect', '--list', 'cs111-base.img'], capture_output=True, text=True)
+        self.assertEqual(p.returncode, 0)
+        self.assertIn('/hello-world', p.stdout)
+        with tempfile.TemporaryDirectory() as tmp:
+            image = os.path.join(tmp, 'bad.img')
+            with open('cs111-base.img', 'rb') as f:
+                data = bytearray(f.read())
+            # Superblock free block count
+            data[1024 + 12] ^= 1
+            with open(image, 'wb') as f:
+                f.write(data)
+            p = subprocess.run(['./ext2-inspect', image], capture_output=True, text=True)
+            self.assertEqual(p.returncode, 1)
+
+    def test_large_ids(self):
+        with tempfile.TemporaryDirectory() as src:
+            path = os.path.join(src, 'file')
+            with open(path, 'w') as f:
+                f.write('contents\n')
+            try:
+                os.chown(path, 100000, 200001)
+            except PermissionError:
+                self.skipTest('chown needs root')
+            image = os.path.join(src, 'ids.img')
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image])
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['debugfs', '-R', 'stat /file', image], capture_output=True, text=True)
+            self.assertRegex(p.stdout, r'User: +100000 +Group: +200001\b')
+
+    def test_sparse_file(self):
+        with tempfile.TemporaryDirectory() as src:
+            path = os.path.join(src, 'sparse')
+            with open(path, 'wb') as f:
+                f.seek(32 << 20)
+                f.write(b'middle\n')
+                f.truncate(64 << 20)
+            image = os.path.join(src, 'sparse.img')
+            # Far too small for the file with its holes filled in
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image,
+                                '--size', '1M'])
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['fsck.ext2', '-f', '-n', image], capture_output=True)
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['debugfs', '-R', 'dump /sparse ' + path + '.out', image],
+                               capture_output=True)
+            with open(path, 'rb') as a, open(path + '.out', 'rb') as b:
+                self.assertEqual(a.read(), b.read())
+
+    def test_update_unchanged(self):
+        with tempfile.TemporaryDirectory() as src, tempfile.TemporaryDirectory() as tmp:
+            os.makedirs(os.path.join(src, 'd'))
+            for name in ('a', os.path.join('d', 'b')):
+                with open(os.path.join(src, name), 'w') as f:
+                    f.write(name + '\n')
+            image = os.path.join(tmp, 'update.img')
+            # Several groups, so several superblock backups
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image, '--size', '40M'])
+            self.assertEqual(p.returncode, 0)
+            with open(image, 'rb') as f:
+                before = f.read()
+            mtime = os.stat(image).st_mtime_ns
+            # A later write time would show in the superblock
+            time.sleep(1.1)
+            p = subprocess.run(['./ext2-create', '--update', image, '--from', src, '--stats'],
+                               capture_output=True, text=True)
+            self.assertEqual(p.returncode, 0)
+            self.assertIn(' 0 write calls', p.stderr)
+            self.assertEqual(os.stat(image).st_mtime_ns, mtime)
+            with open(image, 'rb') as f:
+                self.assertEqual(f.read(), before)
+
+    def test_hard_links(self):
+        with tempfile.TemporaryDirectory() as src:
+            os.makedirs(os.path.join(src, 'd'))
+            path = os.path.join(src, 'a')
+            with open(path, 'w') as f:
+                f.write('contents\n')
+            os.link(path, os.path.join(src, 'd', 'b'))
+            image = os.path.join(src, 'links.img')
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image])
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['fsck.ext2', '-f', '-n', image], capture_output=True)
+            self.assertEqual(p.returncode, 0)
+            # One inode with both names, and its data stored once
+            inodes = []
+            for name in ('/a', '/d/b'):
+                p = subprocess.run(['debugfs', '-R', 'stat ' + name, image],
+                                   capture_output=True, text=True)
+                self.assertRegex(p.stdout, r'Links: 2\b')
+                inodes.append(re.search(r'Inode: (\d+)', p.stdout).group(1))
+            self.assertEqual(inodes[0], inodes[1])
+            p = subprocess.run(['./ext2-create', '--update', image, '--from', src],
+                               capture_output=True)
+            self.assertEqual(p.returncode, 1)
+
+    def test_large_device_numbers(self):
+        with tempfile.TemporaryDirectory() as src:
+            try:
+                os.mknod(os.path.join(src, 'dev'), 0o600 | stat.S_IFCHR,
+                         os.makedev(300, 70000))
+            except PermissionError:
+                self.skipTest('mknod needs root')
+            image = os.path.join(src, 'dev.img')
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image])
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['debugfs', '-R', 'stat /dev', image], capture_output=True, text=True)
+            self.assertIn('(New-style) Device major/minor number: 300:70000', p.stdout)
+
+    def test_dedup_read_only(self):
+        with tempfile.TemporaryDirectory() as src:
+            data = os.urandom(8192)
+            for name in ('a', 'b'):
+                with open(os.path.join(src, name), 'wb') as f:
+                    f.write(data)
+            image = os.path.join(src, 'dedup.img')
+            p = subprocess.run(['./ext2-create', '--from', src, '--output', image, '--dedup'])
+            self.assertEqual(p.returncode, 0)
+            # The shared_blocks feature keeps the kernel from mounting it writable
+            p = subprocess.run(['dumpe2fs', '-h', image], capture_output=True, text=True)
+            self.assertRegex(p.stdout, r'Filesystem features:.*\bshared_blocks\b')
+            p = subprocess.run(['fsck.ext2', '-f', '-n', image], capture_output=True)
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['./ext2-inspect', image], capture_output=True)
+            self.assertEqual(p.returncode, 0)
+            p = subprocess.run(['debugfs', '-R', 'cat /b', image], capture_output=True)
+            self.assertEqual(p.stdout, data)